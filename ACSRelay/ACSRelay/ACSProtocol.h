@@ -20,6 +20,9 @@
 #ifndef _acsprotocol_h
 #define _acsprotocol_h
 
+#include <bitset>
+#include <stdint.h>
+
 /**
  * @namespace ACSProtocol
  * @brief Contains most used constants in the Assetto Corsa Server UDP protocol,
@@ -58,6 +61,48 @@ namespace ACSProtocol
     const char ACSP_NEXT_SESSION = 207;
     const char ACSP_RESTART_SESSION = 208;
     const char ACSP_ADMIN_COMMAND = 209; ///< Send message plus a UTF-32 string with the command
+
+    // ACSRelay extensions. Plugins may send these to the relay, which
+    // handles them itself and never passes them on to the server.
+
+    const char ACSR_SET_CAR_FILTER = 240; ///< Followed by a 64 bit little endian mask of the cars whose updates the plugin wants
+
+    // Only ever exchanged between relays, over their TCP link.
+
+    const char ACSR_CAR_UPDATE_CODEC = 241; ///< Sent by a downstream relay that can decode ACSR_CAR_UPDATE_DELTA packets
+    const char ACSR_CAR_UPDATE_DELTA = 242; ///< ACSP_CAR_UPDATE encoded against the previous one about the same car
+    const char ACSR_COMPRESSION = 243; ///< Asks the upstream relay to compress the stream, which it confirms by sending it back before doing so
+
+    /**
+     * @brief Set of packet types, indexed by the unsigned value of the type.
+     */
+    typedef std::bitset< 256 > TypeMask;
+
+    /**
+     * @brief Finds the car ID in an ACSP_NEW_CONNECTION or ACSP_CONNECTION_CLOSED packet.
+     *        It comes after the driver's name and GUID, both UTF-32 strings.
+     * @param msg Array containing the packet.
+     * @param n Size of the packet.
+     * @return Car ID, or -1 if the packet is too short.
+     */
+    inline int ConnectionCarId ( const char* msg, const long n )
+    {
+        long index = 1;
+
+        // A length followed by as many 4 byte characters, twice.
+        for ( int i = 0; i < 2; i++ )
+        {
+            if ( index >= n )
+                return -1;
+
+            index += 1 + 4 * static_cast<uint8_t> ( msg[ index ] );
+        }
+
+        if ( index >= n )
+            return -1;
+
+        return static_cast<int8_t> ( msg[ index ] );
+    }
 }
 
 #endif // _acsprotocol_h
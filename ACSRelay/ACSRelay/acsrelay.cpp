@@ -22,15 +22,40 @@
     #include <ws2tcpip.h>
 #else
     #include <sys/socket.h>
-    #include <sys/select.h>
 #endif
 
+#include <algorithm>
 #include <chrono>
 #include <iostream>
 #include <limits.h>
+#include <thread>
+#include "bufferpool.h"
+#include "shard.h"
+#include "sharedeventloop.h"
 #include "udpsocket.h"
 #include "log.h"
 
+#ifdef __linux__
+    #include "sharedmemorysocket.h"
+#endif
+
+/**
+ * @brief Picks the earliest of two event loop timeouts.
+ * @param a Timeout in milliseconds, or -1 for none.
+ * @param b Timeout in milliseconds, or -1 for none.
+ * @return The shortest timeout that isn't -1, never below 0.
+ */
+static int Earliest ( const int a, const int b )
+{
+    if ( a < 0 )
+        return b < 0 ? -1 : b;
+
+    if ( b < 0 )
+        return a;
+
+    return std::max ( 0, std::min ( a, b ) );
+}
+
 ACSRelay* ACSRelay::mInstance = NULL;
 
 ACSRelay* ACSRelay::Build ( Configuration::RelayParams params )
@@ -49,26 +74,81 @@ ACSRelay::ACSRelay ()
       mLocalPort(0),
       mRemotePort(0),
       mRelayPort(0),
-      mMaxFd(0),
+      mRelayUDPPort(0),
       mServerSocket(NULL),
       mRelaySocket(NULL),
+      mRelayUDPSocket(NULL),
+      mServerBatchSocket(NULL),
+      mEventLoop( EventLoop::Build ( EventLoop::EPOLL, EventLoop::LEVEL ) ),
+      mEdge(false),
+      mRecvBatch(1),
+      mDeltaUpdates(false),
+      mCompression(false),
+      mPeers( new PeerGroup ( mEventLoop, kDefaultSendQueueSize, kDefaultSendQueueSize, 0, 0, 0 ) ),
       mRequestedInterval(0),
-      mSetInterval(0)
+      mSetInterval(0),
+      mStatsInterval(0),
+      mLastStats(Clock::now ())
 {
 }
 
-ACSRelay::ACSRelay ( Configuration::RelayParams params )
+ACSRelay::ACSRelay ( Configuration::RelayParams params, EventLoop* loop )
     : mServerType( params.server_type ),
       mHost ( params.host ),
       mLocalPort(params.local_port),
       mRemotePort(params.remote_port),
       mRelayPort(params.relay_port),
-      mMaxFd(0),
+      mRelayUDPPort(params.relay_udp_port),
       mServerSocket(NULL),
       mRelaySocket(NULL),
+      mRelayUDPSocket(NULL),
+      mServerBatchSocket(NULL),
+      mEventLoop( loop == NULL ? EventLoop::Build ( params.io_backend, params.io_trigger ) : new SharedEventLoop ( loop, this ) ),
+      mEdge(false),
+      mRecvBatch(params.recv_batch),
+      mDeltaUpdates(params.delta_updates),
+      mCompression(params.compression),
+      mPeers(NULL),
       mRequestedInterval(0),
-      mSetInterval(0)
+      mSetInterval(0),
+      mStatsInterval(params.stats_interval),
+      mLastStats(Clock::now ())
 {
+    FanoutWorker* worker;
+
+    for ( unsigned int i = 0; i < params.workers; i++ )
+    {
+        worker = new FanoutWorker ( i + 1, params.io_backend, params.io_trigger,
+                                    params.send_queue_size, params.send_queue_high_water,
+                                    params.send_queue_timeout, params.stats_interval, params.compression_flush );
+
+        mWorkers.push_back ( worker );
+
+        // The workers just sit idle until they're handed peers and messages.
+        if ( !worker -> Start () )
+        {
+            Log::w () << "Fan-out worker threads are not supported on this platform. Serving every peer from a single thread.";
+
+            for ( auto w = mWorkers.begin (); w != mWorkers.end (); ++w )
+            {
+                delete *w;
+            }
+
+            mWorkers.clear ();
+            break;
+        }
+    }
+
+    if ( mWorkers.empty () )
+    {
+        mPeers = new PeerGroup ( mEventLoop, params.send_queue_size, params.send_queue_high_water,
+                                 params.send_queue_timeout, params.stats_interval, params.compression_flush );
+    }
+    else
+    {
+        Log::v () << "Sharing peers between " << static_cast<unsigned long> ( mWorkers.size () ) << " fan-out workers.";
+    }
+
     for ( auto it = params.plugins.begin(); it != params.plugins.end(); it++ )
     {
         AddPeer ( *it );
@@ -91,10 +171,22 @@ void ACSRelay::AddPeer ( PeerConnection *plugin)
     {
         // Check if the PeerConnection has an UDP socket. If so,
         // it is a simple plugin.
-        if (  dynamic_cast<UDPSocket*>(plugin -> GetSocket()) != NULL )
+        if ( dynamic_cast<UDPSocket*>(plugin -> GetSocket()) != NULL && static_cast<UDPSocket*>(plugin -> GetSocket()) -> Multicast () )
+        {
+            Log::v() << "Adding new plugins " << plugin -> Name() <<  " (multicast group " << host << ":" << plugin -> GetSocket () -> RemotePort () << "). " << "Listening on local UDP port " << plugin -> GetSocket() -> LocalPort() << ".";
+        }
+        else if ( plugin -> GetSocket () -> HasManyReaders () )
+        {
+            Log::v() << "Adding new plugins " << plugin -> Name() << " (shared memory). " << "Listening on local UDP port " << plugin -> GetSocket() -> LocalPort() << ".";
+        }
+        else if (  dynamic_cast<UDPSocket*>(plugin -> GetSocket()) != NULL )
         {
             Log::v() << "Adding new plugin " << plugin -> Name() <<  " (" << host << ":" << plugin -> GetSocket () -> RemotePort () << "). " << "Listening on local UDP port " << plugin -> GetSocket() -> LocalPort() << ".";
         }
+        else if ( dynamic_cast<RelayUDPSocket*>(plugin -> GetSocket()) != NULL )
+        {
+            Log::v() << "Adding new downstream relay " << plugin -> Name() <<  " (" << host << ":" << plugin -> GetSocket () -> RemotePort () << "). " << "Linked over UDP from local port " << plugin -> GetSocket() -> LocalPort() << ".";
+        }
         else
         {
             // If it has a TCP socket (the only other option), it is a downstream
@@ -103,65 +195,168 @@ void ACSRelay::AddPeer ( PeerConnection *plugin)
         }
     }
 
-    if ( plugin -> GetSocket () -> Fd () > mMaxFd )
-        mMaxFd = plugin -> GetSocket () -> Fd ();
+    // Bring the peer up to date with the current session. It's sent
+    // once the peer is served, by whichever thread that is.
+    mSnapshot.Replay ( plugin, mCarInfo );
 
-    mPeers[ plugin -> GetSocket() -> Fd () ] = plugin;
-}
+    if ( mWorkers.empty () )
+    {
+        mPeers -> Add ( plugin );
+        return;
+    }
 
-void ACSRelay::AddPeer ( Configuration::PluginParams params )
-{
-    AddPeer ( new PeerConnection ( params.name, params.host, params.local_port, params.remote_port ) );
+    // Hand the peer to the least busy worker.
+    FanoutWorker* worker = mWorkers[ 0 ];
+
+    for ( auto w = mWorkers.begin (); w != mWorkers.end (); ++w )
+    {
+        if ( ( *w ) -> Load () < worker -> Load () )
+            worker = *w;
+    }
+
+    worker -> AddPeer ( plugin );
+    worker -> Notify ();
 }
 
-void ACSRelay::RelayFromPlugin ( PeerConnection* plugin )
+void ACSRelay::AddPeer ( Configuration::PluginParams params )
 {
-    long n;
-    char msg[ BUFFER_SIZE ];
-    uint8_t ri;
+    PeerConnection* plugin;
+    unsigned int listeners = params.listeners;
 
-    n = plugin -> GetSocket() -> Read ( msg, BUFFER_SIZE );
+    if ( listeners > 1 )
+    {
+        if ( params.local_port == 0 || params.shared_memory != "" )
+        {
+            Log::w () << "LISTENERS only applies to plugins sending to a RELAY_PORT over UDP. Ignoring it for " << params.name << ".";
+            listeners = 1;
+        }
+        else if ( mWorkers.size () < 2 )
+        {
+            Log::w () << "LISTENERS needs at least two WORKERS to read " << params.name << "'s packets in parallel. Ignoring it.";
+            listeners = 1;
+        }
+        else if ( !UDPSocket::CanReusePort () )
+        {
+            Log::w () << "Sockets can't share a port on this platform. Ignoring LISTENERS for " << params.name << ".";
+            listeners = 1;
+        }
+        else
+        {
+            listeners = std::min ( listeners, static_cast<unsigned int> ( mWorkers.size () ) );
+        }
+    }
 
-    if ( n < 1 )
+    if ( params.shared_memory != "" )
     {
-        // We'll get here only if the peer's TCP socket has been disconnected.
-        // Destroy the PeerConnection to make sure we close the socket on our side.
-        for ( auto p = mPeers.begin (); p != mPeers.end (); ++p )
+#ifdef __linux__
+        SharedMemorySocket* ring = new SharedMemorySocket ( params.shared_memory, params.shared_memory_size, params.local_port );
+
+        if ( !ring -> Ready () )
         {
-            if ( p -> second == plugin )
-            {
-                Log::v () << "TCP read error from " << plugin -> Name() << ". Closing connection and removing downstream relay.";
-                delete p -> second;
-                mPeers.erase( p -> first );
-                break;
-            }
+            Log::e () << "Plugins " << params.name << " won't get any server messages.";
+            delete ring;
+            return;
         }
+
+        plugin = new PeerConnection ( params.name, ring );
+#else
+        Log::e () << "Shared memory rings are only available on Linux. Plugins " << params.name << " won't get any server messages.";
         return;
+#endif
+    }
+    else
+    {
+        UDPSocket* socket = new UDPSocket ( params.host, params.local_port, params.remote_port, listeners > 1 );
+
+        // A multicast group reaches any number of plugins on the LAN
+        // with a single datagram.
+        socket -> SetMulticast ( params.multicast_ttl, params.multicast_interface );
+
+        plugin = new PeerConnection ( params.name, socket );
     }
 
-    Log::d() << "Caught message from " << plugin -> Name () << "!" << Log::Packet ( msg, n );
+    plugin -> SetSubscriptions ( params.subscriptions );
+    plugin -> SetCarFilter ( params.cars );
+    AddPeer ( plugin );
 
-    // Only relay packets that can actually be sent by a plugin.
-    // Everything else must be bogus.
+    // More sockets on the same port, each going to the least busy worker.
+    // The system hands every datagram from a given sender to the same
+    // socket, so each sender's packets are still read in order. Answers
+    // go to the last sender on the socket that asked, as they would with
+    // a single socket, and broadcasts only go through the plugin itself.
+    for ( unsigned int i = 1; i < listeners; i++ )
+    {
+        plugin = new PeerConnection ( params.name + "#" + std::to_string ( i ), new UDPSocket ( params.local_port, true ) );
+        plugin -> SetSubscriptions ( ACSProtocol::TypeMask () );
+        plugin -> SetCarFilter ( params.cars );
+        AddPeer ( plugin );
+    }
+}
 
-    switch ( static_cast<int8_t> ( msg[ 0 ] ) )
+size_t ACSRelay::PeerCount () const
+{
+    size_t count = 0;
+
+    if ( mWorkers.empty () )
+        return mPeers -> Size ();
+
+    for ( auto w = mWorkers.begin (); w != mWorkers.end (); ++w )
     {
-        case ACSProtocol::ACSP_REALTIMEPOS_INTERVAL:
-        case ACSProtocol::ACSP_GET_CAR_INFO:
-        case ACSProtocol::ACSP_SEND_CHAT:
-        case ACSProtocol::ACSP_BROADCAST_CHAT:
-        case ACSProtocol::ACSP_GET_SESSION_INFO:
-        case ACSProtocol::ACSP_SET_SESSION_INFO:
-        case ACSProtocol::ACSP_KICK_USER:
-        case ACSProtocol::ACSP_NEXT_SESSION:
-        case ACSProtocol::ACSP_RESTART_SESSION:
-        case ACSProtocol::ACSP_ADMIN_COMMAND:
-            break;
-        default:
-            Log::v () << "Received an invalid packet from plugin " << plugin -> Name() << ". Dropping.";
-            return;
+        count += ( *w ) -> Load ();
     }
 
+    return count;
+}
+
+bool ACSRelay::RelayFromPlugin ( PeerConnection* plugin )
+{
+    long n;
+    PacketBuffer* packet;
+
+    packet = PacketBuffer::Acquire ();
+    n = mPeers -> Receive ( plugin, packet );
+
+    if ( n > 0 )
+        RelayToServer ( packet -> Data (), n );
+
+    packet -> Release ();
+
+    return n >= 0;
+}
+
+void ACSRelay::RelayFromWorker ( FanoutWorker* worker )
+{
+    PacketBuffer* packet;
+
+    worker -> ClearUpstream ();
+
+    while ( ( packet = worker -> ReadUpstream () ) != NULL )
+    {
+        RelayToServer ( packet -> Data (), packet -> Length () );
+        packet -> Release ();
+    }
+}
+
+void ACSRelay::RelayToServer ( char* msg, const long n )
+{
+    PacketBuffer* car_info;
+    uint8_t ri;
+
+    // The server already told us about this car. The peer that asked is
+    // waiting for it, so it's going to get it just like a server response.
+    if ( static_cast<int8_t> ( msg[ 0 ] ) == ACSProtocol::ACSP_GET_CAR_INFO && n >= 2 &&
+         ( car_info = mCarInfo.Get ( static_cast<int8_t> ( msg[ 1 ] ) ) ) != NULL )
+    {
+        LOG_DEBUG ( "Answering ACSP_GET_CAR_INFO from the cache." );
+        DeliverToPeers ( car_info );
+        FlushPeers ();
+        return;
+    }
+
+    // Another plugin asked the same thing and the server hasn't answered
+    // yet. Its answer will reach this plugin too.
+    if ( !mPendingRequests.Forward ( msg, n, Clock::now () ) )
+        return;
 
     // Only send ACSP_REALTIMEPOS_INTERVAL to server if it's lower
     // than before.
@@ -170,7 +365,6 @@ void ACSRelay::RelayFromPlugin ( PeerConnection* plugin )
         if ( n >= 2 )
         {
             ri = msg[ 1 ];
-            plugin -> SetCarUpdateInterval ( ri );
 #ifdef _ENABLE_RTPI_CHECK
             // If mSetInterval is not zero, then we know the server is online
             // and we can send the packet. Set mRequestedInterval as well, so
@@ -181,7 +375,7 @@ void ACSRelay::RelayFromPlugin ( PeerConnection* plugin )
                 if ( ri < mSetInterval )
                 {
                     mSetInterval = mRequestedInterval = ri;
-                    Log::d () << "Relaying packet to server.";
+                    LOG_DEBUG ( "Relaying packet to server." );
                     mServerSocket -> Send ( msg, n );
                 }
             }
@@ -197,7 +391,7 @@ void ACSRelay::RelayFromPlugin ( PeerConnection* plugin )
                 // interval is shorter than what we previously had.
                 if ( mRequestedInterval == 0 || ri < mRequestedInterval )
                 {
-                    Log::d () << "Set mRequestedInterval to " << ri << " ms.";
+                    LOG_DEBUG ( "Set mRequestedInterval to " << ri << " ms." );
                     mRequestedInterval = ri;
                     Log::v () << "Car update interval set to " << ri << " ms.";
                 }
@@ -206,40 +400,57 @@ void ACSRelay::RelayFromPlugin ( PeerConnection* plugin )
             if ( mSetInterval == 0 || ri < mSetInterval )
             {
                 mSetInterval = ri;
-                Log::d() << "Relaying packet to server.";
+                LOG_DEBUG ( "Relaying packet to server." );
                 mServerSocket -> Send ( msg, n );
             }
 #endif
         }
     }
-    // This plugin is requesting info about a car. Take notice and make sure to
-    // relay the server's response to this plugin.
-    else if ( static_cast<int8_t> ( msg[ 0 ] ) == ACSProtocol::ACSP_GET_CAR_INFO )
-    {
-        plugin -> RequestCarInfo ( static_cast<int8_t> ( msg[ 1 ] ) );
-        Log::d () << "Relaying packet to server";
-        mServerSocket -> Send ( msg, n );
-    }
-    // This plugin is requesting info about a session. Take notice and make sure to relay the server's response to this plugin.
-    else if ( static_cast<int8_t> ( msg[ 0 ] ) == ACSProtocol::ACSP_GET_SESSION_INFO )
-    {
-        plugin -> RequestSessionInfo ( static_cast<int8_t> ( msg[ 1 ] ) );
-        Log::d () << "Relaying packet to server";
-        mServerSocket -> Send ( msg, n );
-    }
     else
     {
-        Log::d () << "Relaying packet to server";
+        LOG_DEBUG ( "Relaying packet to server" );
         mServerSocket -> Send ( msg, n );
     }
 }
 
-void ACSRelay::RelayFromServer()
+bool ACSRelay::RelayFromServer()
 {
     long n;
-    char msg[ BUFFER_SIZE ];
+    PacketBuffer* packet;
+
+    if ( mServerBatchSocket != NULL )
+    {
+        // Drain the whole burst, one recvmmsg() at a time. A batch that
+        // isn't full means there was nothing else waiting on the socket.
+        do
+        {
+            n = mServerBatchSocket -> ReadBatch ();
+
+            for ( long i = 0; i < n; i++ )
+            {
+                RelayServerMessage ( mServerBatchSocket -> BatchPacket ( i ) );
+            }
+
+            // Send the whole batch out at once.
+            FlushPeers ();
+        }
+        while ( n == static_cast<long> ( mServerBatchSocket -> BatchSize () ) );
+
+        return false;
+    }
 
-    n = mServerSocket -> Read ( msg, BUFFER_SIZE );
+    packet = PacketBuffer::Acquire ();
+    n = mServerSocket -> Read ( packet -> Data (), packet -> Capacity () );
+    packet -> SetLength ( n );
+
+    if ( n < 1 )
+        packet -> Release ();
+
+    if ( n < 0 && Socket::WouldBlock () )
+    {
+        // Nothing left to read.
+        return false;
+    }
 
     if ( n < 1 )
     {
@@ -259,11 +470,61 @@ void ACSRelay::RelayFromServer()
         {
             // If upstream resides a classic AC game server, it means we've had
             // an error while reading from the socket. We should just ignore it.
-            return;
+            return false;
         }
     }
 
-    Log::d() << "Caught message from  server!" << Log::Packet ( msg, n );
+    RelayServerMessage ( packet );
+    FlushPeers ();
+
+    // The peers that still need the message hold their own references.
+    packet -> Release ();
+
+    return true;
+}
+
+void ACSRelay::DeliverToPeers ( PacketBuffer* packet )
+{
+    if ( mWorkers.empty () )
+    {
+        mPeers -> Deliver ( packet, mSetInterval );
+        return;
+    }
+
+    // Every worker gets a reference to the same buffer and picks
+    // the peers that should get it by itself.
+    for ( auto w = mWorkers.begin (); w != mWorkers.end (); ++w )
+    {
+        ( *w ) -> Relay ( packet, mSetInterval );
+    }
+}
+
+void ACSRelay::FlushPeers ()
+{
+    if ( mWorkers.empty () )
+    {
+        mPeers -> Flush ();
+        return;
+    }
+
+    for ( auto w = mWorkers.begin (); w != mWorkers.end (); ++w )
+    {
+        ( *w ) -> Notify ();
+    }
+}
+
+void ACSRelay::RelayServerMessage ( PacketBuffer* packet )
+{
+    PacketBuffer* fitted;
+    char* msg = packet -> Data ();
+    long n = packet -> Length ();
+
+    if ( n < 1 )
+    {
+        return;
+    }
+
+    LOG_DEBUG ( "Caught message from  server!" << Log::Packet ( msg, n ) );
 
     // Only relay packets that can actually be sent by the server.
     // Everything else must be bogus.
@@ -289,7 +550,6 @@ void ACSRelay::RelayFromServer()
             return;
     }
 
-    // Send realtime position update to subscribed plugins
     if ( static_cast<int8_t> ( msg[ 0 ] ) == ACSProtocol::ACSP_CAR_UPDATE )
     {
 #ifdef _ENABLE_RTPI_CHECK
@@ -304,91 +564,235 @@ void ACSRelay::RelayFromServer()
             mRequestedInterval = 0;
         }
 #endif
+    }
 
-        for ( auto p = mPeers.begin (); p != mPeers.end (); ++p )
-        {
-            // Send ACSP_CAR_UPDATE packets to any plugin that is interested.
-            // A plugin will expect an ACSP_CAR_UPDATE packet only after
-            // its car update interval has elapsed.
-            //
-            // Also, if the plugin has the minimum car update interval make
-            // sure to send it the packet.
-            Time t = Clock::now ();
-
-            if ( p -> second -> CarUpdateInterval () == mSetInterval ||
-                 p -> second -> IsWaitingCarUpdate ( static_cast<int8_t> ( msg[ 1 ] ), t ) )
-            {
-                Log::d () << "Relaying packet to " << p -> second -> Name ();
-                p -> second -> GetSocket () -> Send ( msg, n );
-                p -> second -> CarUpdateArrived ( static_cast<int8_t> ( msg[ 1 ] ), t );
-            }
-        }
+    // Peers may keep the message queued for a while. Don't let them hold
+    // a whole datagram buffer for a car update, and leave it free for
+    // the next read.
+    fitted = packet -> Fit ();
+
+    mCarInfo.Update ( fitted );
+    mSnapshot.Update ( fitted );
+    mPendingRequests.Update ( fitted );
+    DeliverToPeers ( fitted );
+
+    fitted -> Release ();
+
+#ifdef _ENABLE_RTPI_CHECK
+    // The server sent us a message so it's online. This is the right time
+    // to check if we have to send it a ACSP_REALTIMEPOS_INTERVAL packet.
+    if ( mRequestedInterval != 0 )
+    {
+        char rtpi[ 3 ];
+
+        rtpi[0] = ACSProtocol::ACSP_REALTIMEPOS_INTERVAL;
+        *(reinterpret_cast<uint16_t*>( rtpi + 1 )) = mRequestedInterval;
+
+        // Send the ACSP_REALTIMEPOS_INTERVAL packet to the server:
+        mServerSocket -> Send ( rtpi, 3 );
+
+        LOG_DEBUG ( "Sent packet to server:" << Log::Packet ( rtpi, 3 ) );
+    }
+#endif
+}
+
+bool ACSRelay::AcceptRelay ()
+{
+    TCPSocket* tcp_socket;
+    PeerConnection* relay;
+    std::string incoming_relay_name;
+    int fd;
+
+    fd = mRelaySocket -> Accept ();
+
+    if ( fd < 0 )
+    {
+        if ( !Socket::WouldBlock () )
+            Log::v () << "Couldn't accept connection from downstream relay.";
+        return false;
     }
-    // One or more of the plugins requested ACSP_CAR_INFO. Send it to interested plugin(s).
-    else if ( static_cast<int8_t> ( msg[ 0 ] ) == ACSProtocol::ACSP_CAR_INFO )
+
+    // Allow TCP connection and add it to our downstream peer list.
+
+    tcp_socket = new TCPSocket ( TCPSocket::FROM_FD, fd );
+
+    // Generate a unique identifier for the newly accepted ACSRelay connection
+    // based on the current size of the peer list.
+    //
+    // Note: This isn't required to be unique. However, it's preferrable for
+    // logging purposes.
+    incoming_relay_name = "RELAY_";
+    incoming_relay_name += int( PeerCount () );
+
+    relay = new PeerConnection ( incoming_relay_name, reinterpret_cast<Socket*> ( tcp_socket ) );
+    AddPeer ( relay );
+
+    return true;
+}
+
+bool ACSRelay::AcceptUDPRelay ()
+{
+    RelayUDPSocket* link;
+    PeerConnection* relay;
+
+    // Repeated HELLOs and stray datagrams are skipped along the way.
+    link = mRelayUDPSocket -> Accept ();
+
+    if ( link == NULL )
+        return false;
+
+    relay = new PeerConnection ( "RELAY_" + std::to_string ( PeerCount () ), link );
+    AddPeer ( relay );
+
+    return true;
+}
+
+void ACSRelay::MaintainUpstreamLink ()
+{
+    RelayUDPSocket* link = static_cast<RelayUDPSocket*> ( mServerSocket );
+    char rtpi[ 3 ];
+
+    link -> Maintain ();
+
+    if ( !link -> Reconnected () )
+        return;
+
+    Log::i () << "Linked with the upstream relay again.";
+
+    // To the upstream relay, this is a new downstream relay that hasn't
+    // asked for anything yet.
+    if ( mSetInterval != 0 )
     {
-        for ( auto p = mPeers.begin (); p != mPeers.end (); ++p )
-        {
-            if ( p -> second -> IsWaitingCarInfo ( static_cast<int8_t> ( msg[ 1 ] ) ) )
-            {
-                Log::d () << "Relaying packet to " << p -> second -> Name ();
-                p -> second -> GetSocket () -> Send ( msg, n );
-                p -> second -> CarInfoArrived ( static_cast<int8_t> ( msg[ 1 ] ) );
-            }
-        }
+        rtpi[ 0 ] = ACSProtocol::ACSP_REALTIMEPOS_INTERVAL;
+        *(reinterpret_cast<uint16_t*>( rtpi + 1 )) = mSetInterval;
+
+        link -> Send ( rtpi, 3 );
+    }
+}
+
+__attribute__((__noreturn__)) void ACSRelay::Start()
+{
+    EventLoop::Event ready[ kMaxReadyEvents ];
+    int n;
+
+    if ( !Open () )
+    {
+        Log::e () << "Exiting program...";
+        exit ( mLocalPort == 0 || mRemotePort == 0 ? 2 : 1 );
     }
-    // One or more of the plugins requested ACSP_SESSION_INFO. Send it to interested plugin(s).
-    else if ( static_cast<int8_t> ( msg[ 0 ] ) == ACSProtocol::ACSP_SESSION_INFO )
+
+    while ( 1 )
     {
-        for ( auto p = mPeers.begin (); p != mPeers.end (); ++p )
+        n = mEventLoop -> Wait ( ready, kMaxReadyEvents, Timeout () );
+
+        for ( int i = 0; i < n; i++ )
         {
-            if ( p -> second -> IsWaitingSessionInfo ( static_cast<int8_t> ( msg[ 1 ] ) ) )
-            {
-                Log::d () << "Relaying packet to " << p -> second -> Name ();
-                p -> second -> GetSocket () -> Send ( msg, n );
-                p -> second -> SessionInfoArrived ( static_cast<int8_t> ( msg[ 1 ] ) );
-            }
+            Dispatch ( ready[ i ] );
         }
+
+        Maintain ( Clock::now () );
     }
-    // For other types of packets just relay the message to all plugins.
-    else
+}
+
+__attribute__((__noreturn__)) void ACSRelay::Serve ( const std::list< Configuration::RelayParams > servers )
+{
+    const Configuration::RelayParams& io = servers.front ();
+    std::vector< Shard* > shards;
+    std::vector< unsigned long > busy;
+    unsigned int count, cpus;
+    size_t relays = 0;
+    size_t i = 0;
+    Shard* shard;
+
+    count = std::max ( 1u, std::min ( io.shards, static_cast<unsigned int> ( servers.size () ) ) );
+
+    for ( unsigned int s = 0; s < count; s++ )
     {
-        for ( auto p = mPeers.begin (); p != mPeers.end (); ++p )
+        shards.push_back ( new Shard ( s + 1, io.io_backend, io.io_trigger ) );
+    }
+
+    // Spread the servers evenly, so that their bursts land on different shards.
+    for ( auto s = servers.begin (); s != servers.end (); ++s, ++i )
+    {
+        Log::i () << "Serving " << s -> name << "...";
+
+        // A server that can't be reached mustn't take the others down.
+        if ( !shards[ i % count ] -> Add ( *s ) )
         {
-            Log::d () << "Relaying packet to " << p -> second -> Name ();
-            p -> second -> GetSocket () -> Send ( msg, n );
+            Log::e () << "Not serving " << s -> name << ".";
+            continue;
         }
+
+        relays += 1;
     }
 
-#ifdef _ENABLE_RTPI_CHECK
-    // The server sent us a message so it's online. This is the right time
-    // to check if we have to send it a ACSP_REALTIMEPOS_INTERVAL packet.
-    if ( mRequestedInterval != 0 )
+    if ( relays == 0 )
     {
-        msg[0] = ACSProtocol::ACSP_REALTIMEPOS_INTERVAL;
-        *(reinterpret_cast<uint16_t*>( msg + 1 )) = mRequestedInterval;
+        Log::e () << "No server left to serve.";
+        Log::e () << "Exiting program...";
+        exit ( 1 );
+    }
 
-        // Send the ACSP_REALTIMEPOS_INTERVAL packet to the server:
-        mServerSocket -> Send ( msg, 3 );
+    if ( count == 1 )
+    {
+        Log::i () << "Serving " << static_cast<unsigned long> ( relays ) << " servers from a single thread.";
+        shards[ 0 ] -> Run ();
+    }
+
+    Log::i () << "Serving " << static_cast<unsigned long> ( relays ) << " servers from " << count << " shards.";
 
-        Log::d () << "Sent packet to server:" << Log::Packet ( msg, 3 );
+    cpus = std::max ( 1u, std::thread::hardware_concurrency () );
+
+    for ( auto s = shards.begin (); s != shards.end (); ++s )
+    {
+        shard = *s;
+
+        if ( shard -> Size () == 0 )
+            continue;
+
+        Log::v () << "Shard " << shard -> Id () << " relays " << static_cast<unsigned long> ( shard -> Size () ) << " servers.";
+        shard -> Start ( io.affinity ? static_cast<int> ( ( shard -> Id () - 1 ) % cpus ) : -1 );
+    }
+
+    // The shards run by themselves from now on. Only report how busy they are.
+    busy.assign ( count, 0 );
+
+    while ( 1 )
+    {
+        std::this_thread::sleep_for ( std::chrono::seconds ( io.stats_interval != 0 ? io.stats_interval : 3600 ) );
+
+        if ( io.stats_interval == 0 )
+            continue;
+
+        for ( unsigned int s = 0; s < count; s++ )
+        {
+            const Shard::Metrics& metrics = shards[ s ] -> GetMetrics ();
+            unsigned long us = metrics.busy_us.load ( std::memory_order_relaxed );
+
+            if ( shards[ s ] -> Size () == 0 )
+                continue;
+
+            Log::i () << "Shard " << shards[ s ] -> Id () << ": "
+                      << static_cast<unsigned long> ( shards[ s ] -> Size () ) << " servers, "
+                      << metrics.wakeups.load ( std::memory_order_relaxed ) << " wakeups, "
+                      << metrics.events.load ( std::memory_order_relaxed ) << " events, "
+                      << ( us - busy[ s ] ) / ( 10000UL * io.stats_interval ) << "% busy.";
+
+            busy[ s ] = us;
+        }
     }
-#endif
 }
 
-__attribute__((__noreturn__)) void ACSRelay::Start()
+bool ACSRelay::Open ()
 {
-    fd_set fds;
-
-    PeerConnection* plugin;
     TCPSocket* tcp_socket;
-    std::string incoming_relay_name;
+    RelayUDPSocket* udp_link;
+    bool added;
 
     if ( mLocalPort == 0 || mRemotePort == 0 )
     {
         Log::e () << "Invalid port configuration. Check the settings file is written properly.";
-        Log::e () << "Exiting program...";
-        exit ( 2 );
+        return false;
     }
 
     Log::i () << "Relay starting...";
@@ -399,22 +803,79 @@ __attribute__((__noreturn__)) void ACSRelay::Start()
         case Configuration::AC:
             mServerSocket = new UDPSocket ( mLocalPort );
             Log::v () << "Listening on local UDP port " << mLocalPort << " for messages from the server...";
+
+            if ( mRecvBatch > 1 )
+            {
+                mServerBatchSocket = static_cast<UDPSocket*> ( mServerSocket );
+                mServerBatchSocket -> SetBatchSize ( mRecvBatch );
+                Log::v () << "Reading up to " << mRecvBatch << " datagrams at once from the server.";
+            }
             break;
         case Configuration::RELAY:
             tcp_socket = new TCPSocket ( mHost, mRemotePort );
             Log::v () << "Trying to connect with another relay (" << mHost << ":" << mRemotePort << ") via TCP" << "...";
 
-            if ( tcp_socket -> Connect ( kTCPTimeout ) >= 0 )
+            if ( tcp_socket -> Connect ( kTCPTimeout, mEventLoop ) >= 0 )
             {
                 Log::v () << "Connected!";
             }
             else
             {
                 Log::v () << "Failed! ACSRelay is closing.";
-                exit ( 1 );
+                delete tcp_socket;
+                return false;
+            }
+
+            // Relays that don't know about it drop the request, and
+            // keep sending car updates as they are.
+            if ( mDeltaUpdates )
+            {
+                char codec = ACSProtocol::ACSR_CAR_UPDATE_CODEC;
+
+                tcp_socket -> EnableCarUpdateDecoding ();
+                tcp_socket -> Send ( &codec, 1 );
+                Log::v () << "Asked the relay to delta-encode car updates.";
+            }
+
+            if ( mCompression )
+            {
+                char compression = ACSProtocol::ACSR_COMPRESSION;
+
+                if ( tcp_socket -> EnableDecompression () )
+                {
+                    tcp_socket -> Send ( &compression, 1 );
+                    Log::v () << "Asked the relay to compress messages.";
+                }
+                else
+                {
+                    Log::w () << "Compression isn't supported by this build of ACSRelay.";
+                }
             }
+
             mServerSocket = reinterpret_cast<Socket*> ( tcp_socket );
 
+            break;
+        case Configuration::RELAY_UDP:
+            udp_link = new RelayUDPSocket ( mHost, mRemotePort );
+            Log::v () << "Trying to link with another relay (" << mHost << ":" << mRemotePort << ") over UDP" << "...";
+
+            // Same patience as with a TCP connection.
+            if ( udp_link -> Connect ( kTCPTimeout ) >= 0 )
+            {
+                Log::v () << "Linked!";
+            }
+            else
+            {
+                Log::v () << "Failed! ACSRelay is closing.";
+                delete udp_link;
+                return false;
+            }
+
+            if ( mDeltaUpdates || mCompression )
+                Log::w () << "DELTA_UPDATES and COMPRESSION only apply to TCP links. Ignoring them.";
+
+            mServerSocket = udp_link;
+
             break;
     }
 
@@ -424,87 +885,151 @@ __attribute__((__noreturn__)) void ACSRelay::Start()
         Log::v () << "Configured as a ACSRelay server. Listening for messages from other relays on local TCP port " << mRelayPort << ".";
     }
 
-    Log::i () << "Relay started!";
-
-
-    if ( mServerSocket -> Fd () > mMaxFd )
-        mMaxFd = mServerSocket -> Fd ();
+    // Sockets are registered with the event loop once. Wait() hands back
+    // the registered pointer, which tells us how to treat each message.
+    // The server's datagrams may be received by the loop itself.
+    if ( mServerType == Configuration::AUTO || mServerType == Configuration::AC )
+        added = static_cast<UDPSocket*> ( mServerSocket ) -> Attach ( mEventLoop, mServerSocket );
+    else
+        added = mEventLoop -> Add ( mServerSocket -> Fd (), mServerSocket );
 
-    if ( mRelaySocket != NULL )
-        mMaxFd = ( mMaxFd < mRelaySocket -> Fd () ) ? mRelaySocket -> Fd () : mMaxFd;
+    if ( !added )
+    {
+        Log::e () << "Couldn't monitor the server socket.";
+        return false;
+    }
 
-    // Initially disable realtime car updates for all plugins.
-    for ( auto p = mPeers.begin(); p != mPeers.end (); ++p )
+    if ( mRelaySocket != NULL && !mEventLoop -> Add ( mRelaySocket -> Fd (), mRelaySocket ) )
     {
-        p -> second -> SetCarUpdateInterval ( 0 );
+        Log::e () << "Couldn't monitor the relay socket. Downstream relays won't be able to connect.";
     }
 
-    while ( 1 )
+    if ( mRelayUDPPort != 0 )
     {
-        FD_ZERO ( &fds );
+        mRelayUDPSocket = new RelayUDPSocket ( mRelayUDPPort );
+        Log::v () << "Listening for other relays linking over UDP on local UDP port " << mRelayUDPPort << ".";
 
-        for ( auto p = mPeers.begin(); p != mPeers.end (); ++p )
-        {
-            FD_SET ( p -> second -> GetSocket () -> Fd (), &fds );
+        if ( !mEventLoop -> Add ( mRelayUDPSocket -> Fd (), mRelayUDPSocket ) )
+            Log::e () << "Couldn't monitor the UDP relay socket. Downstream relays won't be able to link over UDP.";
+    }
 
-            // Check if a recently added plugin has a file descriptor
-            // bigger than the previous maximum value:
+    mEdge = ( mEventLoop -> GetTrigger () == EventLoop::EDGE );
 
-            if ( p -> second -> GetSocket() -> Fd () > mMaxFd )
-            {
-                mMaxFd = p -> second -> GetSocket() -> Fd ();
-            }
+    // Pending connections are drained in edge triggered mode as well, so
+    // accept() must not block once the backlog is empty. Accepted sockets
+    // don't inherit this flag.
+    if ( mEdge && mRelaySocket != NULL )
+        mRelaySocket -> SetBlocking ( false );
+
+    // Messages the workers' peers send to the server.
+    for ( auto w = mWorkers.begin (); w != mWorkers.end (); ++w )
+    {
+        if ( !mEventLoop -> Add ( ( *w ) -> UpstreamFd (), *w ) )
+        {
+            Log::e () << "Couldn't monitor a fan-out worker.";
+            return false;
         }
+    }
+
+    Log::i () << "Relay started!";
+
+    return true;
+}
 
-        FD_SET ( mServerSocket -> Fd (), &fds );
-        if ( mRelaySocket != NULL )
-            FD_SET ( mRelaySocket -> Fd (), &fds );
+void ACSRelay::Dispatch ( const EventLoop::Event& event )
+{
+    PeerConnection* peer;
+
+    if ( event.data == mServerSocket )
+    {
+        // Message came from the server. Treat it as such.
+        // In edge triggered mode we won't be notified again
+        // about data that is already queued, so drain the socket.
+        // A TCP socket may also hold more messages than the
+        // one we've just read, which the event loop can't know about.
+        while ( RelayFromServer () && ( mEdge || mServerSocket -> HasPending () ) );
+    }
+    else if ( event.data == mRelaySocket )
+    {
+        // Connection request from a downstream ACSRelay instance.
+        while ( AcceptRelay () && mEdge );
+    }
+    else if ( event.data == mRelayUDPSocket )
+    {
+        // Downstream ACSRelay instance saying hello over UDP.
+        while ( AcceptUDPRelay () && mEdge );
+    }
+    else if ( !mWorkers.empty () )
+    {
+        // One of the workers' peers has something for the server.
+        RelayFromWorker ( static_cast<FanoutWorker*> ( event.data ) );
+    }
+    else
+    {
+        peer = static_cast<PeerConnection*> ( event.data );
 
-        select ( mMaxFd + 1, &fds, NULL, NULL, NULL );
+        if ( event.writable )
+            mPeers -> Writable ( peer );
 
-        for ( int i = 0; i <= mMaxFd; i++ )
+        // Message came from a plugin. Treat it as such.
+        if ( event.readable )
         {
-            if ( FD_ISSET ( i, &fds ) )
-            {
-                if ( i == mServerSocket -> Fd () )
-                {
-                    // Message came from the server. Treat it as such.
-                    RelayFromServer ();
-                }
-                else
-                {
-                    // We either received a message from a plugin,
-                    // or a connection request from a downstream
-                    // ACSRelay instance.
-
-                    if ( mRelaySocket != NULL && i == mRelaySocket -> Fd () )
-                    {
-                        // Allow TCP connection and add it to our downstream peer list.
-
-                        tcp_socket = new TCPSocket ( TCPSocket::FROM_FD, mRelaySocket -> Accept() );
-
-                        // Generate a unique identifier for the newly accepted ACSRelay connection
-                        // based on the current size of the peer list.
-                        //
-                        // Note: This isn't required to be unique. However, it's preferrable for
-                        // logging purposes.
-                        incoming_relay_name = "RELAY_";
-                        incoming_relay_name += int( mPeers.size() );
-
-                        plugin = new PeerConnection ( incoming_relay_name, reinterpret_cast<Socket*> ( tcp_socket ) );
-                        AddPeer ( plugin );
-                    }
-                    else
-                    {
-                        // Message came from a plugin. Treat it as such.
-                        RelayFromPlugin ( mPeers[ i ] );
-                    }
-                }
-            }
+            while ( RelayFromPlugin ( peer ) && ( mEdge || peer -> GetSocket () -> HasPending () ) );
         }
     }
 }
 
+void ACSRelay::Maintain ( const Time now )
+{
+    if ( mWorkers.empty () )
+        mPeers -> Maintain ( now );
+
+    if ( mServerType == Configuration::RELAY_UDP )
+        MaintainUpstreamLink ();
+
+    mPendingRequests.Reissue ( now, mServerSocket );
+
+    if ( mStatsInterval != 0 && now - mLastStats >= std::chrono::seconds ( mStatsInterval ) )
+    {
+        mLastStats = now;
+        BufferPool::LogStatistics ();
+
+        if ( mServerType == Configuration::RELAY && static_cast<TCPSocket*> ( mServerSocket ) -> Compression () != NULL )
+            Log::i () << "Upstream relay: " << static_cast<TCPSocket*> ( mServerSocket ) -> Compression () -> Summary ();
+
+        if ( mServerType == Configuration::RELAY_UDP )
+            Log::i () << "Upstream relay: " << static_cast<RelayUDPSocket*> ( mServerSocket ) -> Summary ();
+    }
+}
+
+int ACSRelay::Timeout () const
+{
+    Time now = Clock::now ();
+    int timeout = mWorkers.empty () ? mPeers -> Timeout () : -1;
+
+    if ( mStatsInterval != 0 )
+    {
+        timeout = Earliest ( timeout, static_cast<int> ( std::chrono::duration_cast< Ms > (
+                      mLastStats + std::chrono::seconds ( mStatsInterval ) - now ).count () ) );
+    }
+
+    if ( mServerType == Configuration::RELAY_UDP )
+        timeout = Earliest ( timeout, static_cast<RelayUDPSocket*> ( mServerSocket ) -> Timeout () );
+
+    return Earliest ( timeout, mPendingRequests.Timeout ( now ) );
+}
+
 ACSRelay::~ACSRelay()
 {
+    for ( auto w = mWorkers.begin (); w != mWorkers.end (); ++w )
+    {
+        delete *w;
+    }
+
+    delete mPeers;
+    delete mEventLoop;
+
+    delete mServerSocket;
+    delete mRelaySocket;
+    delete mRelayUDPSocket;
 }
@@ -25,9 +25,17 @@
 #include "INIReader.h"
 #include "peerconnection.h"
 #include "ACSProtocol.h"
+#include "carinfocache.h"
+#include "pendingrequests.h"
+#include "relayudpsocket.h"
+#include "sessionsnapshot.h"
 #include "socket.h"
 #include "tcpsocket.h"
+#include "udpsocket.h"
 #include "configuration.h"
+#include "eventloop.h"
+#include "fanoutworker.h"
+#include "peergroup.h"
 
 #include <queue>
 
@@ -35,8 +43,6 @@
     #include <fstream>
 #endif
 
-#define BUFFER_SIZE 512
-
 /**
  * @class ACSRelay
  * @brief Main class for handling ACSP messages.
@@ -91,6 +97,13 @@ public:
      * @param port Port number as an unsigned integer.
      */
     void SetRelayPort ( const unsigned int port ) { mRelayPort = port; }
+    /**
+     * @brief Set the local UDP relay port.
+     *        This will be the UDP port on which ACSRelay will listen for
+     *        downstream ACSRelay instances linking over UDP.
+     * @param port Port number as an unsigned integer.
+     */
+    void SetRelayUDPPort ( const unsigned int port ) { mRelayUDPPort = port; }
     /**
      * @brief Adds a plugin in the specified list.
      * @param plugin Pointer to a PluginHandler object associated with a plugin.
@@ -106,6 +119,45 @@ public:
      * @brief Monitors traffic between AC Server and UDP plugins.
      */
     void Start ();
+    /**
+     * @brief Monitors traffic between several AC Servers and their plugins.
+     *        The servers are spread between shards, each of them a thread
+     *        waiting on a single event loop. With a single shard, the
+     *        calling thread does the work. Servers that can't be reached
+     *        are left out.
+     * @param servers Configuration of each server. The first one's tells
+     *        how many shards there are.
+     */
+    static void Serve ( const std::list< Configuration::RelayParams > servers );
+    /**
+     * @brief Constructs a relay that waits for events on a loop shared with
+     *        other relays, leaving the waiting to the caller.
+     * @param params Configuration of the server and its plugins.
+     * @param loop Shared event loop, whose reported events are handed to
+     *        Dispatch() once SharedEventLoop::Route() says they belong to the relay.
+     * @return Pointer to the newly constructed relay.
+     */
+    static ACSRelay* Build ( Configuration::RelayParams params, EventLoop* loop ) { return new ACSRelay ( params, loop ); }
+    /**
+     * @brief Connects to the server and starts listening for downstream relays.
+     * @return False if the relay can't work.
+     */
+    bool Open ();
+    /**
+     * @brief Deals with a socket reported by the event loop.
+     * @param event Ready socket, as registered with the relay's event loop.
+     */
+    void Dispatch ( const EventLoop::Event& event );
+    /**
+     * @brief Periodic housekeeping, run after every wait on the event loop.
+     * @param now Current time.
+     */
+    void Maintain ( const Time now );
+    /**
+     * @brief Computes how long the event loop may wait for events.
+     * @return Milliseconds until the next housekeeping is due, or -1 if there's none.
+     */
+    int Timeout () const;
     
 private:
     
@@ -115,19 +167,74 @@ private:
      * @brief ACSRelay object constructor.
      */
     ACSRelay ();
-    ACSRelay ( Configuration::RelayParams params );
+    /**
+     * @brief ACSRelay object constructor.
+     * @param params Configuration of the server and its plugins.
+     * @param loop Event loop shared with other relays, or NULL for a loop of its own.
+     */
+    ACSRelay ( Configuration::RelayParams params, EventLoop* loop = NULL );
     
     // METHODS
     
     /**
      * @brief Reads, interprets and relays datagrams coming from an UDP plugin.
      * @param plugin Pointer to a Plugin object, associated with the UDP plugin that generated the datagram.
+     * @return True if a datagram was read and more may be waiting on the socket.
+     */
+    bool RelayFromPlugin ( PeerConnection* plugin );
+    /**
+     * @brief Relays the messages that a FanoutWorker received from its peers.
+     * @param worker Pointer to the FanoutWorker.
      */
-    void RelayFromPlugin ( PeerConnection* plugin );
+    void RelayFromWorker ( FanoutWorker* worker );
+    /**
+     * @brief Relays a message coming from a plugin to the server.
+     *        Requests for car info found in the cache are answered right away instead,
+     *        and requests already waiting for the server's answer aren't sent again.
+     * @param msg Message as a byte array.
+     * @param n Size of the message.
+     */
+    void RelayToServer ( char* msg, const long n );
     /**
      * @brief Reads, interprets and relays datagrams coming from the AC Server.
+     * @return True if a datagram was read and more may be waiting on the socket.
+     */
+    bool RelayFromServer ();
+    /**
+     * @brief Interprets and relays a single datagram coming from the AC Server.
+     * @param packet Buffer holding the datagram. Peers that can't get it
+     *        right away keep a reference to it.
+     */
+    void RelayServerMessage ( PacketBuffer* packet );
+    /**
+     * @brief Hands a server message to the peers, or to the workers serving them.
+     * @param packet Buffer holding the message.
+     */
+    void DeliverToPeers ( PacketBuffer* packet );
+    /**
+     * @brief Sends every message relayed by RelayServerMessage() since the last call.
+     */
+    void FlushPeers ();
+    /**
+     * @brief Retrieves the total number of peers.
+     * @return Number of peers.
+     */
+    size_t PeerCount () const;
+    /**
+     * @brief Accepts a connection from a downstream ACSRelay and adds it to the peer list.
+     * @return True if a connection was accepted and more may be pending.
+     */
+    bool AcceptRelay ();
+    /**
+     * @brief Answers a downstream ACSRelay linking over UDP and adds it to the peer list.
+     * @return True if a link was started and more may be pending.
      */
-    void RelayFromServer ();
+    bool AcceptUDPRelay ();
+    /**
+     * @brief Keeps the UDP link to the upstream relay going. Once it has
+     *        been started again, asks for car updates again.
+     */
+    void MaintainUpstreamLink ();
     
     // VARS
     
@@ -139,16 +246,37 @@ private:
     unsigned int mLocalPort;
     unsigned int mRemotePort;
     unsigned int mRelayPort;
-    int mMaxFd;
+    unsigned int mRelayUDPPort;
     Socket* mServerSocket;
     TCPSocket* mRelaySocket;
-    
-    std::map< int, PeerConnection* > mPeers;
+    RelayUDPSocket* mRelayUDPSocket;
+    UDPSocket* mServerBatchSocket;
+
+    EventLoop* mEventLoop;
+    bool mEdge;
+    unsigned int mRecvBatch;
+    bool mDeltaUpdates;
+    bool mCompression;
+
+
+    // Peers are either served by this thread, or shared between
+    // the workers when there are any.
+    PeerGroup* mPeers;
+    std::vector< FanoutWorker* > mWorkers;
 
     uint16_t mRequestedInterval;
     uint16_t mSetInterval;
+
+    CarInfoCache mCarInfo;
+    SessionSnapshot mSnapshot;
+    PendingRequests mPendingRequests;
+
+    unsigned int mStatsInterval;
+    Time mLastStats;
     
     const static unsigned int kTCPTimeout = 30;
+    const static int kMaxReadyEvents = 64;
+    const static size_t kDefaultSendQueueSize = 1024;
 };
 
 #endif // _acsrelay_h
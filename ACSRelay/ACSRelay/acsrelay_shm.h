@@ -0,0 +1,277 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reading server messages out of ACSRelay's shared memory ring.
+ *
+ * Plugins running on the same machine as ACSRelay may read the server's
+ * messages from the ring instead of a UDP socket. ACSRelay writes every
+ * message once, however many plugins read it. Plugins still send their
+ * commands (ACSP_REALTIMEPOS_INTERVAL, ACSP_GET_CAR_INFO, ...) as UDP
+ * datagrams, to the RELAY_PORT of the [SHARED_MEMORY] group.
+ *
+ * Every reader sees every message written to the ring, including answers
+ * to the other readers' requests and car updates at the shortest interval
+ * any of them asked for. Readers skip what they don't need.
+ *
+ * ACSRelay never waits for the readers. A reader that falls more than the
+ * size of the ring behind skips to the newest message, and the number of
+ * messages it lost is counted in the "lost" field of its reader.
+ *
+ * A relay that is killed can't tell its readers. The next one to start with
+ * the same name does, by closing the ring it left behind.
+ *
+ * Linux only. Link with -lrt on C libraries older than glibc 2.34. Usage:
+ *
+ *     acsr_shm_reader reader;
+ *     char msg[ 1024 ];
+ *     long n;
+ *
+ *     if ( acsr_shm_open ( &reader, "/acsrelay" ) < 0 )
+ *         return;
+ *
+ *     while ( ( n = acsr_shm_read ( &reader, msg, sizeof ( msg ) ) ) != ACSR_SHM_CLOSED )
+ *     {
+ *         if ( n > 0 )
+ *             handle_packet ( msg, n );
+ *         else if ( n == 0 )
+ *             acsr_shm_wait ( &reader, 1000 );
+ *     }
+ *
+ *     acsr_shm_close ( &reader );
+ *
+ * This header is plain C. ACSRelay itself uses it to lay out the ring.
+ */
+
+#ifndef _acsrelay_shm_h
+#define _acsrelay_shm_h
+
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ACSR_SHM_MAGIC 0x52534341u   /* "ACSR" */
+#define ACSR_SHM_VERSION 1u
+#define ACSR_SHM_WRAP 0xFFFFFFFFu    /* Record length telling the rest of the ring is unused. */
+#define ACSR_SHM_CLOSED ( -1 )       /* acsr_shm_read(): ACSRelay is done with the ring. Open it again. */
+#define ACSR_SHM_TOO_BIG ( -2 )      /* acsr_shm_read(): the message didn't fit the buffer, and was skipped. */
+
+/*
+ * Start of the shared memory object. The ring follows it.
+ *
+ * The ring holds records made of a 32 bit length, in the machine's byte
+ * order, followed by the message and padded to a multiple of 8 bytes.
+ * Positions count bytes since the ring was created. The record at position
+ * p starts at offset p % size of the ring.
+ */
+typedef struct acsr_shm_header
+{
+    uint32_t magic;     /* ACSR_SHM_MAGIC once the ring is ready. */
+    uint32_t version;   /* ACSR_SHM_VERSION. */
+    uint64_t size;      /* Size of the ring, a power of two. */
+    uint64_t write;     /* Position up to which records are complete. */
+    uint64_t reserve;   /* Position up to which records are being written. Whatever is
+                           more than a ring's size before it may have been overwritten. */
+    uint32_t futex;     /* Changes whenever records are completed. Readers sleep on it. */
+    uint32_t waiters;   /* Number of readers sleeping. */
+    uint32_t closed;    /* Set once ACSRelay is done with the ring. */
+    uint32_t reserved[ 5 ];
+} acsr_shm_header;
+
+/*
+ * A reader's view of the ring.
+ */
+typedef struct acsr_shm_reader
+{
+    acsr_shm_header* header;
+    const char* ring;
+    size_t mapped;
+    uint64_t pos;       /* Position of the next record to read. */
+    uint64_t lost;      /* Number of times the reader fell behind and skipped messages. */
+} acsr_shm_reader;
+
+/*
+ * Size of the record holding a message of the given length.
+ */
+static inline uint64_t acsr_shm_record_size ( const uint64_t length )
+{
+    return ( sizeof ( uint32_t ) + length + 7 ) & ~( uint64_t ) 7;
+}
+
+/*
+ * Maps the ring, starting with the next message written to it.
+ * Returns 0 on success, -1 if the ring doesn't exist or isn't ready.
+ */
+static inline int acsr_shm_open ( acsr_shm_reader* reader, const char* name )
+{
+    acsr_shm_header* header;
+    struct stat st;
+    int fd;
+
+    memset ( reader, 0, sizeof ( *reader ) );
+
+    /* Readers write to the header when they go to sleep. */
+    fd = shm_open ( name, O_RDWR, 0 );
+
+    if ( fd < 0 )
+        return -1;
+
+    if ( fstat ( fd, &st ) < 0 || ( size_t ) st.st_size < sizeof ( acsr_shm_header ) )
+    {
+        close ( fd );
+        return -1;
+    }
+
+    header = ( acsr_shm_header* ) mmap ( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close ( fd );
+
+    if ( header == MAP_FAILED )
+        return -1;
+
+    if ( __atomic_load_n ( &header -> magic, __ATOMIC_ACQUIRE ) != ACSR_SHM_MAGIC ||
+         header -> version != ACSR_SHM_VERSION ||
+         sizeof ( acsr_shm_header ) + header -> size > ( size_t ) st.st_size )
+    {
+        munmap ( header, st.st_size );
+        return -1;
+    }
+
+    reader -> header = header;
+    reader -> ring = ( const char* ) ( header + 1 );
+    reader -> mapped = st.st_size;
+    reader -> pos = __atomic_load_n ( &header -> write, __ATOMIC_ACQUIRE );
+
+    return 0;
+}
+
+/*
+ * Reads the next message.
+ * Returns its size, 0 if there's nothing new, ACSR_SHM_TOO_BIG if it
+ * didn't fit the buffer, or ACSR_SHM_CLOSED.
+ */
+static inline long acsr_shm_read ( acsr_shm_reader* reader, char* msg, const size_t len )
+{
+    acsr_shm_header* header = reader -> header;
+    uint64_t size = header -> size;
+    uint64_t write, offset, length, copied;
+
+    for ( ;; )
+    {
+        if ( __atomic_load_n ( &header -> closed, __ATOMIC_ACQUIRE ) )
+            return ACSR_SHM_CLOSED;
+
+        write = __atomic_load_n ( &header -> write, __ATOMIC_ACQUIRE );
+
+        if ( write == reader -> pos )
+            return 0;
+
+        offset = reader -> pos & ( size - 1 );
+        length = *( const uint32_t* ) ( reader -> ring + offset );
+
+        /* The record may be overwritten while it's copied. Never copy past
+           the end of the ring or the buffer, and check it afterwards. */
+        copied = 0;
+
+        if ( length != ACSR_SHM_WRAP )
+        {
+            copied = length < len ? length : len;
+
+            if ( copied > size - offset - sizeof ( uint32_t ) )
+                copied = size - offset - sizeof ( uint32_t );
+
+            memcpy ( msg, reader -> ring + offset + sizeof ( uint32_t ), copied );
+        }
+
+        __atomic_thread_fence ( __ATOMIC_ACQUIRE );
+
+        if ( write - reader -> pos > size ||
+             __atomic_load_n ( &header -> reserve, __ATOMIC_RELAXED ) - reader -> pos > size )
+        {
+            /* Fell behind. Start over with the newest message. */
+            reader -> pos = __atomic_load_n ( &header -> write, __ATOMIC_ACQUIRE );
+            reader -> lost += 1;
+            continue;
+        }
+
+        if ( length == ACSR_SHM_WRAP )
+        {
+            reader -> pos += size - offset;
+            continue;
+        }
+
+        reader -> pos += acsr_shm_record_size ( length );
+
+        return length <= len ? ( long ) length : ACSR_SHM_TOO_BIG;
+    }
+}
+
+/*
+ * Sleeps until a message is written to the ring, or the timeout expires.
+ * Returns 1 if there may be something to read, 0 on timeout.
+ */
+static inline int acsr_shm_wait ( acsr_shm_reader* reader, const int timeout_ms )
+{
+    acsr_shm_header* header = reader -> header;
+    struct timespec ts;
+    uint32_t futex;
+    int ready;
+
+    futex = __atomic_load_n ( &header -> futex, __ATOMIC_SEQ_CST );
+    __atomic_add_fetch ( &header -> waiters, 1, __ATOMIC_SEQ_CST );
+
+    /* ACSRelay only wakes readers it knows are sleeping. */
+    ready = __atomic_load_n ( &header -> write, __ATOMIC_SEQ_CST ) != reader -> pos ||
+            __atomic_load_n ( &header -> closed, __ATOMIC_SEQ_CST );
+
+    if ( !ready )
+    {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = ( long ) ( timeout_ms % 1000 ) * 1000000;
+
+        syscall ( SYS_futex, &header -> futex, FUTEX_WAIT, futex, timeout_ms < 0 ? NULL : &ts, NULL, 0 );
+
+        ready = __atomic_load_n ( &header -> write, __ATOMIC_SEQ_CST ) != reader -> pos ||
+                __atomic_load_n ( &header -> closed, __ATOMIC_SEQ_CST );
+    }
+
+    __atomic_sub_fetch ( &header -> waiters, 1, __ATOMIC_SEQ_CST );
+
+    return ready;
+}
+
+/*
+ * Unmaps the ring.
+ */
+static inline void acsr_shm_close ( acsr_shm_reader* reader )
+{
+    if ( reader -> header != NULL )
+        munmap ( reader -> header, reader -> mapped );
+
+    memset ( reader, 0, sizeof ( *reader ) );
+}
+
+#endif /* _acsrelay_shm_h */
@@ -0,0 +1,187 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bufferpool.h"
+#include "log.h"
+
+#include <new>
+
+const size_t BufferPool::kClassSizes[ SIZE_CLASSES ] = {
+    128,   // A car update is 33 bytes, and most other messages aren't much longer.
+    1152,  // A whole datagram (PACKET_BUFFER_SIZE) along with its PacketBuffer.
+    16384  // TCP_BUFFER_SIZE.
+};
+
+thread_local BufferPool::Cache BufferPool::mCache;
+BufferPool::Depot BufferPool::mDepots[ SIZE_CLASSES ];
+BufferPool::Statistics BufferPool::mStatistics[ SIZE_CLASSES ];
+
+BufferPool::Cache::Cache ()
+{
+    for ( int i = 0; i < SIZE_CLASSES; i++ )
+    {
+        free[ i ] = NULL;
+        count[ i ] = 0;
+    }
+}
+
+BufferPool::Cache::~Cache ()
+{
+    // The thread is exiting, but other threads may still use its blocks.
+    for ( int i = 0; i < SIZE_CLASSES; i++ )
+    {
+        if ( count[ i ] > 0 )
+            Spill ( *this, i, count[ i ] );
+    }
+}
+
+int BufferPool::ClassOf ( const size_t size )
+{
+    int i = 0;
+
+    while ( i < SIZE_CLASSES && kClassSizes[ i ] < size )
+        i++;
+
+    return i;
+}
+
+void* BufferPool::Allocate ( const size_t size )
+{
+    Block* block;
+    int c = ClassOf ( size );
+
+    if ( c == SIZE_CLASSES )
+    {
+        block = static_cast<Block*> ( ::operator new ( sizeof ( Block ) + size ) );
+        block -> size_class = SIZE_CLASSES;
+        return block + 1;
+    }
+
+    Cache& cache = mCache;
+
+    if ( cache.free[ c ] == NULL )
+        Refill ( cache, c );
+
+    if ( cache.free[ c ] != NULL )
+    {
+        block = cache.free[ c ];
+        cache.free[ c ] = block -> next;
+        cache.count[ c ] -= 1;
+    }
+    else
+    {
+        block = static_cast<Block*> ( ::operator new ( sizeof ( Block ) + kClassSizes[ c ] ) );
+        block -> size_class = c;
+        mStatistics[ c ].allocated.fetch_add ( 1, std::memory_order_relaxed );
+    }
+
+    mStatistics[ c ].in_use.fetch_add ( 1, std::memory_order_relaxed );
+
+    return block + 1;
+}
+
+void BufferPool::Free ( void* ptr )
+{
+    Block* block;
+    int c;
+
+    if ( ptr == NULL )
+        return;
+
+    block = static_cast<Block*> ( ptr ) - 1;
+    c = block -> size_class;
+
+    if ( c == SIZE_CLASSES )
+    {
+        ::operator delete ( block );
+        return;
+    }
+
+    Cache& cache = mCache;
+
+    block -> next = cache.free[ c ];
+    cache.free[ c ] = block;
+    cache.count[ c ] += 1;
+
+    mStatistics[ c ].in_use.fetch_sub ( 1, std::memory_order_relaxed );
+
+    // Threads that mostly free what others allocate (like fan-out workers
+    // releasing server messages) would otherwise hoard blocks.
+    if ( cache.count[ c ] >= kCacheSize )
+        Spill ( cache, c, kCacheSize / 2 );
+}
+
+void BufferPool::Refill ( Cache& cache, const int size_class )
+{
+    Depot& depot = mDepots[ size_class ];
+    Block* block;
+    size_t n = 0;
+
+    std::lock_guard< std::mutex > lock ( depot.mutex );
+
+    while ( n < kCacheSize / 2 && depot.free != NULL )
+    {
+        block = depot.free;
+        depot.free = block -> next;
+
+        block -> next = cache.free[ size_class ];
+        cache.free[ size_class ] = block;
+        n++;
+    }
+
+    depot.count -= n;
+    cache.count[ size_class ] += n;
+
+    mStatistics[ size_class ].refills.fetch_add ( n, std::memory_order_relaxed );
+}
+
+void BufferPool::Spill ( Cache& cache, const int size_class, const size_t count )
+{
+    Depot& depot = mDepots[ size_class ];
+    Block* first = cache.free[ size_class ];
+    Block* last = first;
+
+    for ( size_t i = 1; i < count; i++ )
+        last = last -> next;
+
+    cache.free[ size_class ] = last -> next;
+    cache.count[ size_class ] -= count;
+
+    std::lock_guard< std::mutex > lock ( depot.mutex );
+
+    last -> next = depot.free;
+    depot.free = first;
+    depot.count += count;
+
+    mStatistics[ size_class ].spills.fetch_add ( count, std::memory_order_relaxed );
+}
+
+void BufferPool::LogStatistics ()
+{
+    const char* names[ SIZE_CLASSES ] = { "small", "large", "stream" };
+
+    for ( int i = 0; i < SIZE_CLASSES; i++ )
+    {
+        Log::i () << "Buffer pool, " << names[ i ] << " blocks (" << static_cast<unsigned long> ( kClassSizes[ i ] ) << " bytes): "
+                  << mStatistics[ i ].in_use.load ( std::memory_order_relaxed ) << " in use, "
+                  << mStatistics[ i ].allocated.load ( std::memory_order_relaxed ) << " allocated, "
+                  << mStatistics[ i ].refills.load ( std::memory_order_relaxed ) << " refilled and "
+                  << mStatistics[ i ].spills.load ( std::memory_order_relaxed ) << " spilled by thread caches.";
+    }
+}
@@ -0,0 +1,160 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _bufferpool_h
+#define _bufferpool_h
+
+#include <atomic>
+#include <mutex>
+#include <stddef.h>
+
+/**
+ * @class BufferPool
+ * @brief Slab allocator for the buffers used while relaying messages.
+ *        Blocks come in a few fixed sizes (size classes), matching what
+ *        the relay keeps around: small ACSP messages such as car updates,
+ *        whole datagrams such as CAR_INFO or CHAT with their UTF-32 strings,
+ *        and the reassembly buffers of TCP streams.
+ *
+ *        Each thread keeps a cache of free blocks per size class, so most
+ *        allocations take no lock at all. Caches that grow too big hand
+ *        half of their blocks to a shared depot, and empty ones take them
+ *        back from it. Blocks are only allocated from the heap when the
+ *        depot is empty too, and never given back to it.
+ *
+ *        Blocks may be freed by a thread other than the one that allocated them.
+ */
+class BufferPool
+{
+public:
+
+    /**
+     * @brief Size classes of the pool, smallest first.
+     */
+    enum SizeClass {
+        SMALL = 0, /*!< Car updates and other short messages. */
+        LARGE,     /*!< Any datagram the relay can receive. */
+        STREAM,    /*!< TCP reassembly buffers. */
+        SIZE_CLASSES
+    };
+
+    // METHODS
+
+    /**
+     * @brief Allocates a block from the smallest size class that can hold size bytes.
+     *        Requests bigger than the largest class are served by the heap.
+     * @param size Number of bytes needed.
+     * @return Pointer to the block.
+     */
+    static void* Allocate ( const size_t size );
+    /**
+     * @brief Gives a block back to the pool.
+     * @param block Pointer returned by Allocate(), or NULL.
+     */
+    static void Free ( void* block );
+    /**
+     * @brief Retrieves the size of the blocks of a size class.
+     * @param size_class BufferPool::SizeClass.
+     * @return Number of usable bytes in each block.
+     */
+    static size_t ClassSize ( const SizeClass size_class ) { return kClassSizes[ size_class ]; }
+    /**
+     * @brief Logs how many blocks of each size class are allocated and in use.
+     */
+    static void LogStatistics ();
+
+private:
+
+    // METHODS
+
+    /**
+     * @brief Finds the smallest size class that can hold size bytes.
+     * @param size Number of bytes needed.
+     * @return BufferPool::SizeClass, or SIZE_CLASSES if no class is big enough.
+     */
+    static int ClassOf ( const size_t size );
+
+    // TYPES
+
+    /**
+     * @brief Header in front of every block.
+     */
+    struct alignas ( 16 ) Block {
+        Block* next;
+        int size_class;
+    };
+
+    /**
+     * @brief Free blocks owned by a single thread, one list per size class.
+     *        Whatever is left in it when the thread exits goes to the depot.
+     */
+    struct Cache {
+        Block* free[ SIZE_CLASSES ];
+        size_t count[ SIZE_CLASSES ];
+
+        Cache ();
+        ~Cache ();
+    };
+
+    /**
+     * @brief Free blocks shared by all threads, for one size class.
+     */
+    struct Depot {
+        std::mutex mutex;
+        Block* free;
+        size_t count;
+    };
+
+    /**
+     * @brief Counters reported by LogStatistics().
+     */
+    struct Statistics {
+        std::atomic< unsigned long > allocated; /*!< Blocks taken from the heap. */
+        std::atomic< long > in_use;             /*!< Blocks handed out and not freed yet. */
+        std::atomic< unsigned long > refills;   /*!< Blocks moved from the depot to a thread cache. */
+        std::atomic< unsigned long > spills;    /*!< Blocks moved from a thread cache to the depot. */
+    };
+
+    // METHODS
+
+    /**
+     * @brief Moves up to half a cache worth of blocks from the depot to a thread cache.
+     * @param cache Cache of the calling thread.
+     * @param size_class BufferPool::SizeClass.
+     */
+    static void Refill ( Cache& cache, const int size_class );
+    /**
+     * @brief Moves blocks from a thread cache to the depot.
+     * @param cache Cache of the calling thread.
+     * @param size_class BufferPool::SizeClass.
+     * @param count Number of blocks to move.
+     */
+    static void Spill ( Cache& cache, const int size_class, const size_t count );
+
+    // VARS
+
+    static thread_local Cache mCache;
+    static Depot mDepots[ SIZE_CLASSES ];
+    static Statistics mStatistics[ SIZE_CLASSES ];
+
+    static const size_t kClassSizes[ SIZE_CLASSES ];
+    const static size_t kCacheSize = 64;
+};
+
+#endif // _bufferpool_h
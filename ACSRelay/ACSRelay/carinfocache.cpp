@@ -0,0 +1,97 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "carinfocache.h"
+#include "ACSProtocol.h"
+
+CarInfoCache::CarInfoCache ()
+{
+    for ( int i = 0; i < kMaxCars; i++ )
+    {
+        mCarInfo[ i ] = NULL;
+    }
+}
+
+void CarInfoCache::Update ( PacketBuffer* packet )
+{
+    const char* msg = packet -> Data ();
+    long n = packet -> Length ();
+    int cid;
+
+    switch ( static_cast<int8_t> ( msg[ 0 ] ) )
+    {
+        case ACSProtocol::ACSP_CAR_INFO:
+            if ( n < 2 )
+                return;
+
+            cid = static_cast<int8_t> ( msg[ 1 ] );
+
+            if ( cid < 0 || cid >= kMaxCars )
+                return;
+
+            Forget ( cid );
+
+            packet -> Retain ();
+            mCarInfo[ cid ] = packet;
+            break;
+        case ACSProtocol::ACSP_NEW_CONNECTION:
+        case ACSProtocol::ACSP_CONNECTION_CLOSED:
+            cid = ACSProtocol::ConnectionCarId ( msg, n );
+
+            if ( cid >= 0 && cid < kMaxCars )
+                Forget ( cid );
+            break;
+        case ACSProtocol::ACSP_VERSION:
+            // The server has just started. It may not even have the same cars.
+            Clear ();
+            break;
+        default:
+            break;
+    }
+}
+
+PacketBuffer* CarInfoCache::Get ( const int cid ) const
+{
+    if ( cid < 0 || cid >= kMaxCars )
+        return NULL;
+
+    return mCarInfo[ cid ];
+}
+
+void CarInfoCache::Clear ()
+{
+    for ( int i = 0; i < kMaxCars; i++ )
+    {
+        Forget ( i );
+    }
+}
+
+void CarInfoCache::Forget ( const int cid )
+{
+    if ( mCarInfo[ cid ] == NULL )
+        return;
+
+    mCarInfo[ cid ] -> Release ();
+    mCarInfo[ cid ] = NULL;
+}
+
+CarInfoCache::~CarInfoCache ()
+{
+    Clear ();
+}
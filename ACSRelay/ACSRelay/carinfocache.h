@@ -0,0 +1,79 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _carinfocache_h
+#define _carinfocache_h
+
+#include "packetbuffer.h"
+
+/**
+ * @class CarInfoCache
+ * @brief Keeps the latest ACSP_CAR_INFO the server sent for each car, so that
+ *        plugins asking for it again can be answered without bothering the
+ *        server. A car's entry is forgotten as soon as somebody connects to
+ *        or disconnects from it, and every entry is forgotten when the server
+ *        (re)starts.
+ */
+class CarInfoCache
+{
+public:
+
+    // CTOR/DCTOR
+
+    CarInfoCache ();
+    virtual ~CarInfoCache ();
+
+    // METHODS
+
+    /**
+     * @brief Takes note of a message from the server. ACSP_CAR_INFO packets are
+     *        kept, the ones that make them out of date drop the matching entries.
+     * @param packet Buffer holding a valid server message.
+     */
+    void Update ( PacketBuffer* packet );
+    /**
+     * @brief Looks up the ACSP_CAR_INFO packet of a car.
+     * @param cid Car ID as represented in Assetto Corsa.
+     * @return Pointer to the buffer holding the packet, or NULL if it isn't known.
+     *         The cache keeps its reference; callers that keep the buffer must retain it.
+     */
+    PacketBuffer* Get ( const int cid ) const;
+    /**
+     * @brief Forgets every entry.
+     */
+    void Clear ();
+
+private:
+
+    // METHODS
+
+    /**
+     * @brief Forgets the entry of a car.
+     * @param cid Car ID as represented in Assetto Corsa.
+     */
+    void Forget ( const int cid );
+
+    // VARS
+
+    const static int kMaxCars = 64;
+
+    PacketBuffer* mCarInfo[ kMaxCars ];
+};
+
+#endif // _carinfocache_h
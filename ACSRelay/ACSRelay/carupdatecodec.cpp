@@ -0,0 +1,203 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "carupdatecodec.h"
+#include "ACSProtocol.h"
+
+#include <math.h>
+#include <string.h>
+
+// Layout of an ACSP_CAR_UPDATE: type, car ID, position and velocity (three
+// floats each), gear, engine RPM (uint16) and normalized spline position.
+static const size_t kFloatOffset[] = { 2, 6, 10, 14, 18, 22, 29 };
+static const double kFloatStep[] = { 1e-3, 1e-3, 1e-3, 1e-3, 1e-3, 1e-3, 1e-7 };
+static const int kFloats = 7;
+static const size_t kGearOffset = 26;
+static const size_t kRPMOffset = 27;
+// Quantized values beyond this are most likely garbage. Send them as they are.
+static const double kMaxQuantized = 1e15;
+
+// The gear and RPM share a field, the floats take the others.
+static int FieldOf ( const int f ) { return f < 6 ? f : f == 6 ? 7 : 6; }
+
+CarUpdateCodec::CarUpdateCodec ()
+{
+    for ( int i = 0; i < kMaxCars; i++ )
+    {
+        mCars[ i ].known = false;
+    }
+}
+
+bool CarUpdateCodec::Quantize ( const char* msg, int64_t* fields )
+{
+    float value;
+    double q;
+
+    for ( int f = 0; f < kFloats; f++ )
+    {
+        memcpy ( &value, msg + kFloatOffset[ f ], sizeof ( value ) );
+
+        q = value / kFloatStep[ f ];
+
+        if ( !( fabs ( q ) < kMaxQuantized ) )
+            return false;
+
+        fields[ FieldOf ( f ) ] = llround ( q );
+    }
+
+    fields[ 6 ] = ( static_cast<int64_t> ( static_cast<uint8_t> ( msg[ kGearOffset ] ) ) << 16 ) |
+                  static_cast<uint8_t> ( msg[ kRPMOffset ] ) |
+                  ( static_cast<int64_t> ( static_cast<uint8_t> ( msg[ kRPMOffset + 1 ] ) ) << 8 );
+
+    return true;
+}
+
+void CarUpdateCodec::Restore ( const int64_t* fields, char* msg )
+{
+    float value;
+
+    for ( int f = 0; f < kFloats; f++ )
+    {
+        value = static_cast<float> ( fields[ FieldOf ( f ) ] * kFloatStep[ f ] );
+        memcpy ( msg + kFloatOffset[ f ], &value, sizeof ( value ) );
+    }
+
+    msg[ kGearOffset ] = static_cast<char> ( ( fields[ 6 ] >> 16 ) & 0xFF );
+    msg[ kRPMOffset ] = static_cast<char> ( fields[ 6 ] & 0xFF );
+    msg[ kRPMOffset + 1 ] = static_cast<char> ( ( fields[ 6 ] >> 8 ) & 0xFF );
+}
+
+long CarUpdateCodec::Encode ( const char* msg, const size_t len, char* out ) const
+{
+    int64_t fields[ kFields ];
+    int64_t difference;
+    uint64_t delta;
+    size_t n = 3;
+    uint8_t mask = 0;
+    int cid;
+
+    if ( len != kCarUpdateSize || static_cast<int8_t> ( msg[ 0 ] ) != ACSProtocol::ACSP_CAR_UPDATE )
+        return -1;
+
+    cid = static_cast<int8_t> ( msg[ 1 ] );
+
+    if ( cid < 0 || cid >= kMaxCars || !mCars[ cid ].known || !Quantize ( msg, fields ) )
+        return -1;
+
+    for ( int i = 0; i < kFields; i++ )
+    {
+        if ( fields[ i ] == mCars[ cid ].fields[ i ] )
+            continue;
+
+        mask |= 1 << i;
+
+        // Zigzag, so that small negative differences stay small.
+        difference = fields[ i ] - mCars[ cid ].fields[ i ];
+        delta = ( static_cast<uint64_t> ( difference ) << 1 ) ^ static_cast<uint64_t> ( difference >> 63 );
+
+        while ( delta >= 0x80 )
+        {
+            out[ n++ ] = static_cast<char> ( ( delta & 0x7F ) | 0x80 );
+            delta >>= 7;
+        }
+
+        out[ n++ ] = static_cast<char> ( delta );
+    }
+
+    // Not worth it.
+    if ( n >= len )
+        return -1;
+
+    out[ 0 ] = ACSProtocol::ACSR_CAR_UPDATE_DELTA;
+    out[ 1 ] = msg[ 1 ];
+    out[ 2 ] = static_cast<char> ( mask );
+
+    return n;
+}
+
+long CarUpdateCodec::Decode ( const char* packet, const size_t len, char* msg )
+{
+    int64_t fields[ kFields ];
+    uint64_t delta;
+    size_t n = 3;
+    uint8_t mask;
+    int cid, shift;
+
+    if ( len < 3 || static_cast<int8_t> ( packet[ 0 ] ) != ACSProtocol::ACSR_CAR_UPDATE_DELTA )
+        return -1;
+
+    cid = static_cast<int8_t> ( packet[ 1 ] );
+    mask = static_cast<uint8_t> ( packet[ 2 ] );
+
+    if ( cid < 0 || cid >= kMaxCars || !mCars[ cid ].known )
+        return -1;
+
+    for ( int i = 0; i < kFields; i++ )
+    {
+        fields[ i ] = mCars[ cid ].fields[ i ];
+
+        if ( ( mask >> i & 1 ) == 0 )
+            continue;
+
+        delta = 0;
+        shift = 0;
+
+        do
+        {
+            if ( n >= len || shift > 63 )
+                return -1;
+
+            delta |= static_cast<uint64_t> ( packet[ n ] & 0x7F ) << shift;
+            shift += 7;
+        }
+        while ( packet[ n++ ] & 0x80 );
+
+        fields[ i ] += static_cast<int64_t> ( ( delta >> 1 ) ^ ( ( delta & 1 ) ? ~static_cast<uint64_t> ( 0 ) : 0 ) );
+    }
+
+    if ( n != len )
+        return -1;
+
+    msg[ 0 ] = ACSProtocol::ACSP_CAR_UPDATE;
+    msg[ 1 ] = packet[ 1 ];
+    Restore ( fields, msg );
+
+    memcpy ( mCars[ cid ].fields, fields, sizeof ( fields ) );
+
+    return kCarUpdateSize;
+}
+
+void CarUpdateCodec::Remember ( const char* msg, const size_t len )
+{
+    int cid;
+
+    if ( len != kCarUpdateSize || static_cast<int8_t> ( msg[ 0 ] ) != ACSProtocol::ACSP_CAR_UPDATE )
+        return;
+
+    cid = static_cast<int8_t> ( msg[ 1 ] );
+
+    if ( cid < 0 || cid >= kMaxCars )
+        return;
+
+    mCars[ cid ].known = Quantize ( msg, mCars[ cid ].fields );
+}
+
+CarUpdateCodec::~CarUpdateCodec ()
+{
+}
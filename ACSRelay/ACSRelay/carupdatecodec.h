@@ -0,0 +1,121 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _carupdatecodec_h
+#define _carupdatecodec_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @class CarUpdateCodec
+ * @brief Delta encoding of ACSP_CAR_UPDATE packets for links between relays.
+ *        Position, velocity and spline position are quantized (to 1 mm,
+ *        1 mm/s and 1e-7 of a lap), then every field is encoded as the
+ *        zigzag varint of its difference with the previous update about
+ *        the same car. Fields that didn't change are left out altogether.
+ *
+ *        Each side of a link keeps its own copy of the previous update about
+ *        every car, which stays in sync since TCP delivers everything in order.
+ *        Updates that can't be encoded (the first one about a car, values out
+ *        of range) go through as they are and become the new reference.
+ */
+class CarUpdateCodec
+{
+public:
+
+    // CTOR/DCTOR
+
+    CarUpdateCodec ();
+    virtual ~CarUpdateCodec ();
+
+    // METHODS
+
+    /**
+     * @brief Encodes an ACSP_CAR_UPDATE against the previous one about the same car.
+     *        Doesn't take note of it, see Remember().
+     * @param msg Message to be encoded.
+     * @param len Size of the message.
+     * @param out Buffer of at least kMaxEncodedSize bytes, receiving the
+     *        ACSR_CAR_UPDATE_DELTA packet.
+     * @return Size of the encoded packet, or -1 if the message must be sent as it is.
+     */
+    long Encode ( const char* msg, const size_t len, char* out ) const;
+    /**
+     * @brief Decodes an ACSR_CAR_UPDATE_DELTA packet back to an ACSP_CAR_UPDATE,
+     *        which becomes the reference for the next one about the same car.
+     * @param packet ACSR_CAR_UPDATE_DELTA packet.
+     * @param len Size of the packet.
+     * @param msg Buffer of at least kCarUpdateSize bytes receiving the message.
+     * @return kCarUpdateSize, or -1 if the packet is malformed or refers to an
+     *         update we never got.
+     */
+    long Decode ( const char* packet, const size_t len, char* msg );
+    /**
+     * @brief Takes note of an ACSP_CAR_UPDATE that went through the link,
+     *        encoded or not, so that the next ones are encoded against it.
+     * @param msg Message.
+     * @param len Size of the message.
+     */
+    void Remember ( const char* msg, const size_t len );
+
+    // VARS
+
+    const static size_t kCarUpdateSize = 33;
+    const static size_t kMaxEncodedSize = 3 + 8 * 10;
+
+private:
+
+    // TYPES
+
+    const static int kFields = 8;
+
+    /**
+     * @brief Quantized fields of the latest update about a car.
+     */
+    struct Car
+    {
+        int64_t fields[ kFields ];
+        bool known;
+    };
+
+    // METHODS
+
+    /**
+     * @brief Quantizes the fields of an ACSP_CAR_UPDATE.
+     * @param msg Message of kCarUpdateSize bytes.
+     * @param fields Array of kFields values receiving the result.
+     * @return False if a value is out of range.
+     */
+    static bool Quantize ( const char* msg, int64_t* fields );
+    /**
+     * @brief Writes quantized fields back into an ACSP_CAR_UPDATE.
+     * @param fields Array of kFields values.
+     * @param msg Message of kCarUpdateSize bytes. The type and car ID are left alone.
+     */
+    static void Restore ( const int64_t* fields, char* msg );
+
+    // VARS
+
+    const static int kMaxCars = 64;
+
+    Car mCars[ kMaxCars ];
+};
+
+#endif // _carupdatecodec_h
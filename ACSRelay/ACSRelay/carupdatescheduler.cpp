@@ -0,0 +1,211 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "carupdatescheduler.h"
+#include "peerconnection.h"
+
+const int CarUpdateScheduler::kShift[ kLevels ] = { 0, 8, 14 };
+const int CarUpdateScheduler::kMask[ kLevels ] = { 255, 63, 63 };
+
+CarUpdateScheduler::CarUpdateScheduler ()
+    : mNow ( 0 ),
+      mArmed ( 0 )
+{
+    for ( int l = 0; l < kLevels; l++ )
+    {
+        for ( int s = 0; s < kSlots; s++ )
+        {
+            mWheel[ l ][ s ] = NULL;
+        }
+    }
+}
+
+void CarUpdateScheduler::Advance ( const uint64_t now )
+{
+    Timer* timer;
+
+    while ( mNow < now )
+    {
+        // Nothing to fire, so there's no point in going through every tick.
+        if ( mArmed == 0 )
+        {
+            mNow = now;
+            break;
+        }
+
+        mNow += 1;
+
+        // Entering a new block of level 0 (or level 1): bring down the
+        // timers that expire within it.
+        if ( ( mNow & kMask[ 0 ] ) == 0 )
+        {
+            if ( ( ( mNow >> kShift[ 1 ] ) & kMask[ 1 ] ) == 0 )
+                Cascade ( 2, ( mNow >> kShift[ 2 ] ) & kMask[ 2 ] );
+
+            Cascade ( 1, ( mNow >> kShift[ 1 ] ) & kMask[ 1 ] );
+        }
+
+        while ( ( timer = mWheel[ 0 ][ mNow & kMask[ 0 ] ] ) != NULL )
+        {
+            Disarm ( timer );
+            timer -> peer -> SetCarUpdateDue ( timer -> cid, true );
+        }
+    }
+}
+
+void CarUpdateScheduler::Reset ( PeerConnection* peer )
+{
+    Timer* timer;
+
+    for ( int cid = 0; cid < 64; cid++ )
+    {
+        timer = peer -> CarTimer ( cid );
+
+        Disarm ( timer );
+        timer -> due = mNow;
+        peer -> SetCarUpdateDue ( cid, true );
+    }
+}
+
+void CarUpdateScheduler::Delivered ( PeerConnection* peer, const int cid, const unsigned int tolerance )
+{
+    Timer* timer = peer -> CarTimer ( cid );
+    uint64_t interval = peer -> CarUpdateInterval ();
+
+    peer -> SetCarUpdateDue ( cid, false );
+    Disarm ( timer );
+
+    if ( interval == 0 )
+        return;
+
+    // Stay on the schedule, unless the car has been silent for a while
+    // (e.g. nobody was driving it). Catching up would only send the next
+    // few updates too soon.
+    if ( timer -> due + 2 * interval <= mNow )
+        timer -> due = mNow + interval;
+    else
+        timer -> due += interval;
+
+    timer -> expires = timer -> due > tolerance ? timer -> due - tolerance : 0;
+
+    Arm ( timer );
+}
+
+void CarUpdateScheduler::Remove ( PeerConnection* peer )
+{
+    for ( int cid = 0; cid < 64; cid++ )
+    {
+        Disarm ( peer -> CarTimer ( cid ) );
+    }
+}
+
+void CarUpdateScheduler::Arm ( Timer* timer )
+{
+    uint64_t delta;
+    Timer** slot;
+    int level;
+
+    if ( timer -> expires <= mNow )
+    {
+        timer -> peer -> SetCarUpdateDue ( timer -> cid, true );
+        return;
+    }
+
+    delta = timer -> expires - mNow;
+
+    if ( delta >> kShift[ 1 ] == 0 )
+        level = 0;
+    else if ( delta >> kShift[ 2 ] == 0 )
+        level = 1;
+    else
+    {
+        level = 2;
+
+        // Beyond the reach of the wheel. Fire as late as possible instead,
+        // the car will be checked again then.
+        if ( delta >> ( kShift[ 2 ] + 6 ) != 0 )
+            timer -> expires = mNow + ( static_cast<uint64_t> ( 1 ) << ( kShift[ 2 ] + 6 ) ) - 1;
+    }
+
+    slot = &mWheel[ level ][ ( timer -> expires >> kShift[ level ] ) & kMask[ level ] ];
+
+    timer -> prev = NULL;
+    timer -> next = *slot;
+
+    if ( *slot != NULL )
+        ( *slot ) -> prev = timer;
+
+    *slot = timer;
+    timer -> armed = true;
+    mArmed += 1;
+}
+
+void CarUpdateScheduler::Disarm ( Timer* timer )
+{
+    int level;
+
+    if ( !timer -> armed )
+        return;
+
+    if ( timer -> prev != NULL )
+        timer -> prev -> next = timer -> next;
+    else
+    {
+        // First in its slot. Find out which one.
+        for ( level = 0; level < kLevels; level++ )
+        {
+            Timer** slot = &mWheel[ level ][ ( timer -> expires >> kShift[ level ] ) & kMask[ level ] ];
+
+            if ( *slot == timer )
+            {
+                *slot = timer -> next;
+                break;
+            }
+        }
+    }
+
+    if ( timer -> next != NULL )
+        timer -> next -> prev = timer -> prev;
+
+    timer -> armed = false;
+    mArmed -= 1;
+}
+
+void CarUpdateScheduler::Cascade ( const int level, const int slot )
+{
+    Timer* timer = mWheel[ level ][ slot ];
+    Timer* next;
+
+    mWheel[ level ][ slot ] = NULL;
+
+    while ( timer != NULL )
+    {
+        next = timer -> next;
+
+        timer -> armed = false;
+        mArmed -= 1;
+        Arm ( timer );
+
+        timer = next;
+    }
+}
+
+CarUpdateScheduler::~CarUpdateScheduler ()
+{
+}
@@ -0,0 +1,127 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _carupdatescheduler_h
+#define _carupdatescheduler_h
+
+#include <stdint.h>
+
+class PeerConnection;
+
+/**
+ * @class CarUpdateScheduler
+ * @brief Decides when each peer gets its next realtime update about each car.
+ *        Every (peer, car) pair has a timer on a hierarchical timing wheel
+ *        with millisecond ticks. Expired timers mark the car as due on the
+ *        peer, so that delivering an ACSP_CAR_UPDATE only takes a bit test.
+ *        Updates are scheduled one interval after the previous one was due,
+ *        not after it arrived, so a peer gets them at the rate it asked for
+ *        with no more jitter than the server's own update period.
+ */
+class CarUpdateScheduler
+{
+public:
+
+    // TYPES
+
+    /**
+     * @brief Timer of a (peer, car) pair. Owned by the peer, linked into
+     *        the wheel while armed.
+     */
+    struct Timer
+    {
+        Timer* prev;
+        Timer* next;
+        PeerConnection* peer;
+        uint64_t due;
+        uint64_t expires;
+        int8_t cid;
+        bool armed;
+    };
+
+    // CTOR/DCTOR
+
+    CarUpdateScheduler ();
+    virtual ~CarUpdateScheduler ();
+
+    // METHODS
+
+    /**
+     * @brief Moves the wheel forward, marking as due every car whose timer expired.
+     *        Meant to be called once per batch of server messages.
+     * @param now Current time in milliseconds. Must never go backwards.
+     */
+    void Advance ( const uint64_t now );
+    /**
+     * @brief Starts over the schedule of a peer whose car update interval
+     *        changed. Every car becomes due right away.
+     * @param peer Pointer to a PeerConnection.
+     */
+    void Reset ( PeerConnection* peer );
+    /**
+     * @brief Takes note of an update sent to a peer and schedules the next one.
+     * @param peer Pointer to the PeerConnection that got the update.
+     * @param cid Car ID as represented in Assetto Corsa.
+     * @param tolerance Milliseconds an update may come early. Half the period
+     *        of the server's updates is enough to never skip one of them.
+     */
+    void Delivered ( PeerConnection* peer, const int cid, const unsigned int tolerance );
+    /**
+     * @brief Disarms every timer of a peer that is about to be destroyed.
+     * @param peer Pointer to a PeerConnection.
+     */
+    void Remove ( PeerConnection* peer );
+
+private:
+
+    // METHODS
+
+    /**
+     * @brief Links a timer into the slot matching its expiry, or marks its
+     *        car as due if it has already expired.
+     * @param timer Pointer to a disarmed Timer.
+     */
+    void Arm ( Timer* timer );
+    /**
+     * @brief Unlinks a timer from the wheel.
+     * @param timer Pointer to a Timer.
+     */
+    void Disarm ( Timer* timer );
+    /**
+     * @brief Moves every timer of a slot of an outer level to the inner levels.
+     * @param level Wheel level.
+     * @param slot Slot index within the level.
+     */
+    void Cascade ( const int level, const int slot );
+
+    // VARS
+
+    const static int kLevels = 3;
+    const static int kSlots = 256;
+    // Level 0 has 256 slots of 1 ms, levels 1 and 2 have 64 slots of 256 ms
+    // and 16384 ms, which covers the longest interval a plugin can ask for.
+    const static int kShift[ kLevels ];
+    const static int kMask[ kLevels ];
+
+    Timer* mWheel[ kLevels ][ kSlots ];
+    uint64_t mNow;
+    unsigned long mArmed;
+};
+
+#endif // _carupdatescheduler_h
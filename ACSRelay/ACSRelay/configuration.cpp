@@ -22,14 +22,18 @@
 #include "software.h"
 #include "log.h"
 
+#include <algorithm>
 #include <iostream>
 #include <getopt.h>
 #include <stdlib.h>
 #include <string.h>
 
+const long Configuration::kMaxWorkers;
+const long Configuration::kMaxShards;
+
 Configuration::Configuration ()
 	: mConfigFilename(DEFAULT_CFG_FILE),
-      mRelay {"127.0.0.1", 0, 0, 0, AUTO},
+      mRelay {"127.0.0.1", 0, 0, 0, 0, AUTO},
 #ifdef _DEBUG
       mLogLevel(Log::DEBUG_LVL)
 #else
@@ -168,9 +172,15 @@ void Configuration::ReadSettingsFile ()
 {
     std::vector< std::string > sections;
     INIReader *ir = new INIReader ();
+    std::string type;
+    std::string backend;
+    long batch;
+    long queue;
 
     ir -> parse ( mConfigFilename );
 
+    mRelay.name = "SERVER";
+
     if ( mRelay.local_port == 0 )
         mRelay.local_port = static_cast<unsigned int> ( ir -> GetInteger ( "SERVER", "RELAY_PORT", 0 ) );
 
@@ -178,34 +188,123 @@ void Configuration::ReadSettingsFile ()
         mRelay.remote_port = static_cast<unsigned int> ( ir -> GetInteger( "SERVER", "SERVER_PORT", 0 ) );
 
     if ( mRelay.server_type == AUTO )
-        mRelay.server_type = ir -> GetString ( "SERVER", "TYPE", "AC" ) == "RELAY" ? RELAY : AC;
+    {
+        type = ir -> GetString ( "SERVER", "TYPE", "AC" );
+        mRelay.server_type = type == "RELAY" ? RELAY : type == "RELAY_UDP" ? RELAY_UDP : AC;
+    }
 
     if ( mRelay.host == "" )
         mRelay.host = ir -> GetString ( "SERVER", "IP", "127.0.0.1" );
 
+    mRelay.delta_updates = ir -> GetBoolean ( "SERVER", "DELTA_UPDATES", false );
+    mRelay.compression = ir -> GetBoolean ( "SERVER", "COMPRESSION", false );
+    mRelay.compression_flush = static_cast<unsigned int> ( std::max ( 0L, ir -> GetInteger ( "RELAY", "COMPRESSION_FLUSH", 10 ) ) );
+
     if ( mRelay.relay_port == 0 )
         mRelay.relay_port = static_cast<unsigned int> ( ir -> GetInteger ( "RELAY", "LISTEN_PORT", 0 ) );
 
+    mRelay.relay_udp_port = static_cast<unsigned int> ( ir -> GetInteger ( "RELAY", "UDP_LISTEN_PORT", 0 ) );
+
+    backend = ir -> GetString ( "IO", "BACKEND", "EPOLL" );
+    mRelay.io_backend = backend == "SELECT" ? EventLoop::SELECT : ( backend == "IO_URING" ? EventLoop::IO_URING : EventLoop::EPOLL );
+    mRelay.io_trigger = ir -> GetString ( "IO", "TRIGGER", "LEVEL" ) == "EDGE" ? EventLoop::EDGE : EventLoop::LEVEL;
+    batch = ir -> GetInteger ( "IO", "RECV_BATCH", 32 );
+    mRelay.recv_batch = static_cast<unsigned int> ( batch < 1 ? 1 : ( batch > kMaxBatch ? kMaxBatch : batch ) );
+
+    queue = ir -> GetInteger ( "IO", "SEND_QUEUE_SIZE", 1024 );
+    mRelay.send_queue_size = static_cast<size_t> ( queue < 1 ? 1 : queue );
+    queue = ir -> GetInteger ( "IO", "SEND_QUEUE_HIGH_WATER", mRelay.send_queue_size * 3 / 4 );
+    mRelay.send_queue_high_water = static_cast<size_t> ( queue < 0 ? 0 : queue );
+    mRelay.send_queue_timeout = static_cast<unsigned int> ( std::max ( 0L, ir -> GetInteger ( "IO", "SEND_QUEUE_TIMEOUT", 10 ) ) );
+    mRelay.stats_interval = static_cast<unsigned int> ( std::max ( 0L, ir -> GetInteger ( "IO", "STATS_INTERVAL", 0 ) ) );
+    mRelay.workers = static_cast<unsigned int> ( std::min ( kMaxWorkers, std::max ( 0L, ir -> GetInteger ( "IO", "WORKERS", 0 ) ) ) );
+    mRelay.shards = static_cast<unsigned int> ( std::min ( kMaxShards, std::max ( 1L, ir -> GetInteger ( "IO", "SHARDS", 1 ) ) ) );
+    mRelay.affinity = ir -> GetBoolean ( "IO", "AFFINITY", false );
+
     sections = ir -> Sections ();
 
+    // Every other server shares the settings above, except for its own
+    // ports and the way it's reached.
+    for ( unsigned int i = 0; i < sections.size (); i += 1 )
+    {
+        if ( sections[ i ].substr ( 0, 7 ) == "SERVER_" )
+        {
+            RelayParams server = mRelay;
+
+            server.name = sections[ i ];
+            server.plugins.clear ();
+            ReadServerSettings ( ir, sections[ i ], server );
+            mServers.push_back ( server );
+        }
+    }
+
     for ( unsigned int i = 0; i < sections.size (); i += 1 )
     {
         if ( sections[ i ].substr ( 0, 7 ) == "PLUGIN_" )
         {
             // ADD NEW PLUGIN
 
-            mRelay.plugins.push_back(
+            std::list<PluginParams>* plugins = &mRelay.plugins;
+            std::string server = ir -> GetString ( sections[ i ], "SERVER", "SERVER" );
+
+            for ( auto s = mServers.begin (); s != mServers.end (); ++s )
+            {
+                if ( s -> name == server )
+                    plugins = &s -> plugins;
+            }
+
+            if ( plugins == &mRelay.plugins && server != "SERVER" )
+                Log::w () << "Plugin " << sections[ i ] << " is meant for [" << server << "], which doesn't exist. Attaching it to [SERVER].";
+
+            plugins -> push_back(
                PluginParams {
                    ir -> GetString ( sections[ i ], "NAME", sections[ i ] ),
                    ir -> GetString ( sections[ i ], "IP", "127.0.0.1" ),
                    static_cast<unsigned int> ( ir -> GetInteger ( sections[ i ], "PLUGIN_PORT", 0 ) ),
-                   static_cast<unsigned int> ( ir -> GetInteger ( sections[ i ], "RELAY_PORT", 0 ) )
+                   static_cast<unsigned int> ( ir -> GetInteger ( sections[ i ], "RELAY_PORT", 0 ) ),
+                   SubscriptionsFromString ( ir -> GetString ( sections[ i ], "SUBSCRIBE", "" ) ),
+                   CarsFromString ( ir -> GetString ( sections[ i ], "CARS", "" ) ),
+                   ir -> GetString ( sections[ i ], "SHARED_MEMORY", "" ),
+                   static_cast<unsigned int> ( std::max ( 0L, ir -> GetInteger ( sections[ i ], "SHARED_MEMORY_SIZE", 1024 ) ) ),
+                   static_cast<unsigned int> ( std::min ( 255L, std::max ( 0L, ir -> GetInteger ( sections[ i ], "MULTICAST_TTL", 1 ) ) ) ),
+                   ir -> GetString ( sections[ i ], "MULTICAST_INTERFACE", "" ),
+                   static_cast<unsigned int> ( std::min ( kMaxWorkers, std::max ( 1L, ir -> GetInteger ( sections[ i ], "LISTENERS", 1 ) ) ) )
                }
             );
         }
     }
 }
 
+void Configuration::ReadServerSettings ( INIReader* ir, const std::string& section, RelayParams& relay )
+{
+    std::string type;
+
+    relay.local_port = static_cast<unsigned int> ( ir -> GetInteger ( section, "RELAY_PORT", 0 ) );
+    relay.remote_port = static_cast<unsigned int> ( ir -> GetInteger( section, "SERVER_PORT", 0 ) );
+
+    type = ir -> GetString ( section, "TYPE", "AC" );
+    relay.server_type = type == "RELAY" ? RELAY : type == "RELAY_UDP" ? RELAY_UDP : AC;
+
+    relay.host = ir -> GetString ( section, "IP", "127.0.0.1" );
+    relay.delta_updates = ir -> GetBoolean ( section, "DELTA_UPDATES", false );
+    relay.compression = ir -> GetBoolean ( section, "COMPRESSION", false );
+    relay.relay_port = static_cast<unsigned int> ( ir -> GetInteger ( section, "LISTEN_PORT", 0 ) );
+    relay.relay_udp_port = static_cast<unsigned int> ( ir -> GetInteger ( section, "UDP_LISTEN_PORT", 0 ) );
+}
+
+std::list<Configuration::RelayParams> Configuration::Servers () const
+{
+    std::list<RelayParams> servers = mServers;
+
+    // [SERVER] may be left out when every server has a section of its own.
+    if ( mServers.empty () || mRelay.local_port != 0 || mRelay.remote_port != 0 )
+        servers.push_front ( mRelay );
+    else if ( !mRelay.plugins.empty () )
+        Log::w () << "[SERVER] isn't configured. Its plugins won't get any server messages.";
+
+    return servers;
+}
+
 Configuration::PluginParams Configuration::PluginParamsFromString ( const char *s )
 {
     PluginParams params;
@@ -213,6 +312,11 @@ Configuration::PluginParams Configuration::PluginParamsFromString ( const char *
 
     params.name = params.host = "";
     params.remote_port = params.local_port = 0;
+    params.subscriptions.set ();
+    params.cars = ~static_cast<uint64_t> ( 0 );
+    params.shared_memory_size = 0;
+    params.multicast_ttl = 1;
+    params.listeners = 1;
 
     strncpy ( str, s, sizeof(str) - 1 );
     str[ sizeof(str) - 1 ] = '\0';	// Make sure str is terminated (strncpy() doesn't ensure this)
@@ -247,3 +351,115 @@ Configuration::PluginParams Configuration::PluginParamsFromString ( const char *
 
     return params;
 }
+
+ACSProtocol::TypeMask Configuration::SubscriptionsFromString ( const std::string& s )
+{
+    static const struct { const char* name; char type; } types[] = {
+        { "NEW_SESSION", ACSProtocol::ACSP_NEW_SESSION },
+        { "NEW_CONNECTION", ACSProtocol::ACSP_NEW_CONNECTION },
+        { "CONNECTION_CLOSED", ACSProtocol::ACSP_CONNECTION_CLOSED },
+        { "CAR_UPDATE", ACSProtocol::ACSP_CAR_UPDATE },
+        { "CAR_INFO", ACSProtocol::ACSP_CAR_INFO },
+        { "END_SESSION", ACSProtocol::ACSP_END_SESSION },
+        { "LAP_COMPLETED", ACSProtocol::ACSP_LAP_COMPLETED },
+        { "VERSION", ACSProtocol::ACSP_VERSION },
+        { "CHAT", ACSProtocol::ACSP_CHAT },
+        { "CLIENT_LOADED", ACSProtocol::ACSP_CLIENT_LOADED },
+        { "SESSION_INFO", ACSProtocol::ACSP_SESSION_INFO },
+        { "ERROR", ACSProtocol::ACSP_ERROR },
+        { "CLIENT_EVENT", ACSProtocol::ACSP_CLIENT_EVENT }
+    };
+
+    ACSProtocol::TypeMask mask;
+    std::string name;
+    size_t start = 0, end;
+    bool found;
+
+    if ( s.find_first_not_of ( " \t," ) == std::string::npos )
+        return mask.set ();
+
+    while ( start <= s.size () )
+    {
+        end = s.find ( ',', start );
+
+        if ( end == std::string::npos )
+            end = s.size ();
+
+        name = s.substr ( start, end - start );
+        name.erase ( 0, name.find_first_not_of ( " \t" ) );
+        name.erase ( name.find_last_not_of ( " \t" ) + 1 );
+        start = end + 1;
+
+        if ( name.empty () )
+            continue;
+
+        if ( name.compare ( 0, 5, "ACSP_" ) == 0 )
+            name.erase ( 0, 5 );
+
+        found = false;
+
+        for ( unsigned int i = 0; i < sizeof ( types ) / sizeof ( types[ 0 ] ); i++ )
+        {
+            if ( name == types[ i ].name )
+            {
+                mask.set ( static_cast<uint8_t> ( types[ i ].type ) );
+                found = true;
+            }
+        }
+
+        if ( !found && name.find_first_not_of ( "0123456789" ) == std::string::npos && atoi ( name.c_str () ) < 256 )
+        {
+            mask.set ( atoi ( name.c_str () ) );
+            found = true;
+        }
+
+        if ( !found )
+            Log::w () << "Unknown server message type " << name << " in SUBSCRIBE. Ignoring it.";
+    }
+
+    return mask;
+}
+
+uint64_t Configuration::CarsFromString ( const std::string& s )
+{
+    uint64_t mask = 0;
+    std::string range;
+    size_t start = 0, end, dash;
+    long first, last;
+    char* rest;
+
+    if ( s.find_first_not_of ( " \t," ) == std::string::npos )
+        return ~static_cast<uint64_t> ( 0 );
+
+    while ( start <= s.size () )
+    {
+        end = s.find ( ',', start );
+
+        if ( end == std::string::npos )
+            end = s.size ();
+
+        range = s.substr ( start, end - start );
+        start = end + 1;
+
+        if ( range.find_first_not_of ( " \t" ) == std::string::npos )
+            continue;
+
+        dash = range.find ( '-' );
+        first = strtol ( range.c_str (), &rest, 10 );
+        last = dash == std::string::npos ? first : strtol ( range.c_str () + dash + 1, &rest, 10 );
+
+        if ( *rest != '\0' && range.find_first_not_of ( " \t", rest - range.c_str () ) != std::string::npos )
+            first = -1;
+
+        if ( first < 0 || last > 63 || first > last )
+        {
+            Log::w () << "Invalid car ID range " << range << " in CARS. Ignoring it.";
+            continue;
+        }
+
+        for ( long i = first; i <= last; i++ )
+            mask |= static_cast<uint64_t> ( 1 ) << i;
+    }
+
+    return mask;
+}
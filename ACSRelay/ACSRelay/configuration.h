@@ -23,8 +23,12 @@
 #include <string>
 #include <list>
 
+#include "ACSProtocol.h"
+#include "eventloop.h"
 #include "log.h"
 
+class INIReader;
+
 /**
  * @class Configuration
  * @brief Helper class to read configuration from INI settings file and command line arguments.
@@ -56,13 +60,21 @@ public:
         std::string host; ///< Plugin host address
         unsigned int remote_port; ///< Plugin UDP port
         unsigned int local_port; ///< Local port on which to listen for packets from the plugin.
+        ACSProtocol::TypeMask subscriptions; ///< Types of server messages broadcast to the plugin.
+        uint64_t cars; ///< Mask of the cars whose realtime updates are sent to the plugin.
+        std::string shared_memory; ///< Name of the shared memory ring the plugins read, empty to use UDP.
+        unsigned int shared_memory_size; ///< Size of the shared memory ring in KiB.
+        unsigned int multicast_ttl; ///< Number of routers datagrams sent to a multicast group may cross.
+        std::string multicast_interface; ///< Address of the interface multicast datagrams leave from, empty to let the system pick.
+        unsigned int listeners; ///< Number of sockets sharing the local port, each served by a different fan-out worker.
     };
 
     enum ServerType
     {
         AUTO,
         AC,
-        RELAY
+        RELAY,
+        RELAY_UDP
     };
 
     struct RelayParams
@@ -71,8 +83,23 @@ public:
         unsigned int local_port;
         unsigned int remote_port;
         unsigned int relay_port;
+        unsigned int relay_udp_port; ///< UDP port on which downstream relays may say hello, 0 to disable.
         ServerType server_type;
         std::list<PluginParams> plugins;
+        EventLoop::Backend io_backend; ///< Mechanism used to wait for incoming packets.
+        EventLoop::Trigger io_trigger; ///< Level or edge triggered readiness notifications.
+        unsigned int recv_batch; ///< Maximum number of datagrams read from the server at once.
+        size_t send_queue_size; ///< Maximum number of packets waiting to be sent to a peer.
+        size_t send_queue_high_water; ///< Number of waiting packets above which a peer is stalling.
+        unsigned int send_queue_timeout; ///< Seconds a peer may stall before being disconnected.
+        unsigned int stats_interval; ///< Seconds between peer statistics reports, 0 to disable.
+        unsigned int workers; ///< Number of fan-out worker threads, 0 to serve every peer from the main thread.
+        unsigned int shards; ///< Number of threads the servers are spread between, when there are several.
+        bool affinity; ///< Pin each shard's thread to a CPU of its own.
+        bool delta_updates; ///< Ask the upstream relay to delta-encode car updates.
+        bool compression; ///< Ask the upstream relay to compress the stream.
+        unsigned int compression_flush; ///< Milliseconds compressed messages may wait before being sent to downstream relays.
+        std::string name; ///< Section of the settings file describing the server.
     };
     
     // METHODS
@@ -105,6 +132,12 @@ public:
      * @return List of PluginParams structs.
      */
     std::list < PluginParams > Plugins () const { return mRelay.plugins; }
+    /**
+     * @brief Used to retrieve the configuration of every server to be relayed:
+     *        the one in [SERVER], if its ports are set, then those in [SERVER_n].
+     * @return List of RelayParams structures.
+     */
+    std::list < RelayParams > Servers () const;
     /**
      * @brief Returns the remote UDP/TCP port specified as a command line argument.
      * @return Remote UDP/TCP port as an unsigned integer or 0 if none was specified.
@@ -138,13 +171,40 @@ public:
 private:
     
     struct PluginParams PluginParamsFromString ( const char *s );
+    /**
+     * @brief Parses a comma separated list of server message types, given either
+     *        by name (CHAT or ACSP_CHAT) or by number. An empty list means all of them.
+     * @param s List of message types.
+     * @return Mask of the listed types.
+     */
+    ACSProtocol::TypeMask SubscriptionsFromString ( const std::string& s );
+    /**
+     * @brief Reads the settings of a server that may differ from one server to another.
+     * @param ir INI file reader.
+     * @param section Section describing the server.
+     * @param relay Structure receiving the settings.
+     */
+    void ReadServerSettings ( INIReader* ir, const std::string& section, RelayParams& relay );
+    /**
+     * @brief Parses a comma separated list of car IDs and ranges of car IDs (e.g.: 0-3).
+     *        An empty list means all of them.
+     * @param s List of car IDs.
+     * @return Mask with bit N set for car ID N.
+     */
+    uint64_t CarsFromString ( const std::string& s );
     
     std::string mConfigFilename;
     RelayParams mRelay;
+    // Servers described in [SERVER_n] sections.
+    std::list<RelayParams> mServers;
 
     std::string mLogFile;
 
     Log::OutputLevel mLogLevel;
+
+    const static long kMaxBatch = 1024;
+    const static long kMaxWorkers = 64;
+    const static long kMaxShards = 256;
 };
 
 #endif // _configuration_h
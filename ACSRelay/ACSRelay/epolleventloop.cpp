@@ -0,0 +1,100 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "epolleventloop.h"
+#include "log.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+EpollEventLoop::EpollEventLoop ( Trigger trigger )
+    : EventLoop ( trigger )
+{
+    mEpollFd = epoll_create1 ( EPOLL_CLOEXEC );
+}
+
+bool EpollEventLoop::Add ( const int fd, void* data )
+{
+    struct epoll_event ev;
+
+    memset ( &ev, 0, sizeof ( ev ) );
+    ev.events = EPOLLIN;
+    ev.data.ptr = data;
+
+    if ( mTrigger == EDGE )
+        ev.events |= EPOLLET;
+
+    if ( epoll_ctl ( mEpollFd, EPOLL_CTL_ADD, fd, &ev ) < 0 )
+    {
+        Log::e () << "Couldn't add file descriptor " << fd << " to epoll: " << strerror ( errno );
+        return false;
+    }
+
+    return true;
+}
+
+void EpollEventLoop::Remove ( const int fd )
+{
+    struct epoll_event ev;
+
+    // Kernels older than 2.6.9 require a non-NULL event even for EPOLL_CTL_DEL.
+    epoll_ctl ( mEpollFd, EPOLL_CTL_DEL, fd, &ev );
+}
+
+void EpollEventLoop::SetWriteInterest ( const int fd, void* data, const bool enabled )
+{
+    struct epoll_event ev;
+
+    memset ( &ev, 0, sizeof ( ev ) );
+    ev.events = EPOLLIN;
+    ev.data.ptr = data;
+
+    if ( enabled )
+        ev.events |= EPOLLOUT;
+
+    if ( mTrigger == EDGE )
+        ev.events |= EPOLLET;
+
+    epoll_ctl ( mEpollFd, EPOLL_CTL_MOD, fd, &ev );
+}
+
+int EpollEventLoop::Wait ( Event* ready, const int max, const int timeout )
+{
+    int n;
+
+    n = epoll_wait ( mEpollFd, mEvents, max < kMaxEvents ? max : kMaxEvents, timeout );
+
+    for ( int i = 0; i < n; i++ )
+    {
+        ready[ i ].data = mEvents[ i ].data.ptr;
+        // Errors and hang-ups are reported as readable so that the
+        // following read fails and the peer gets cleaned up.
+        ready[ i ].readable = ( mEvents[ i ].events & ( EPOLLIN | EPOLLERR | EPOLLHUP ) ) != 0;
+        ready[ i ].writable = ( mEvents[ i ].events & EPOLLOUT ) != 0;
+    }
+
+    return n;
+}
+
+EpollEventLoop::~EpollEventLoop ()
+{
+    if ( mEpollFd >= 0 )
+        close ( mEpollFd );
+}
@@ -0,0 +1,71 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _epolleventloop_h
+#define _epolleventloop_h
+
+#include "eventloop.h"
+
+#include <sys/epoll.h>
+
+/**
+ * @class EpollEventLoop
+ * @brief epoll based EventLoop.
+ *        Descriptors are registered with the kernel once, so the cost of
+ *        Wait() only depends on the number of readable descriptors.
+ *        Only available on Linux.
+ */
+class EpollEventLoop : public EventLoop
+{
+public:
+
+    // CTOR/DCTOR
+
+    /**
+     * @brief EpollEventLoop object constructor.
+     * @param trigger Trigger mode used for every registered descriptor.
+     */
+    EpollEventLoop ( Trigger trigger );
+    virtual ~EpollEventLoop ();
+
+    // METHODS
+
+    bool Add ( const int fd, void* data );
+    void Remove ( const int fd );
+    void SetWriteInterest ( const int fd, void* data, const bool enabled );
+    int Wait ( Event* ready, const int max, const int timeout );
+    Backend GetBackend () const { return EPOLL; }
+
+    /**
+     * @brief Retrieves the epoll file descriptor.
+     * @return File descriptor as an integer, negative if epoll_create1() failed.
+     */
+    int Fd () const { return mEpollFd; }
+
+private:
+
+    // VARS
+
+    int mEpollFd;
+
+    const static int kMaxEvents = 64;
+    struct epoll_event mEvents[ kMaxEvents ];
+};
+
+#endif // _epolleventloop_h
@@ -0,0 +1,149 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "eventloop.h"
+#include "log.h"
+
+#ifdef _WIN32
+    #include <winsock2.h>
+#else
+    #include <sys/select.h>
+#endif
+
+#ifdef __linux__
+    #include "epolleventloop.h"
+#endif
+
+#ifdef _ENABLE_IO_URING
+    #include "iouringeventloop.h"
+#endif
+
+EventLoop* EventLoop::Build ( Backend backend, Trigger trigger )
+{
+#ifdef _ENABLE_IO_URING
+    if ( backend == IO_URING )
+    {
+        IOUringEventLoop* loop = new IOUringEventLoop ( trigger );
+
+        if ( loop -> Fd () >= 0 )
+            return loop;
+
+        Log::w () << "Couldn't set up io_uring (it needs Linux 5.13 or later). Falling back to epoll.";
+        delete loop;
+        backend = EPOLL;
+    }
+#else
+    if ( backend == IO_URING )
+    {
+        Log::w () << "This build doesn't support io_uring. Falling back to epoll.";
+        backend = EPOLL;
+    }
+#endif
+
+#ifdef __linux__
+    if ( backend == EPOLL )
+    {
+        EpollEventLoop* loop = new EpollEventLoop ( trigger );
+
+        if ( loop -> Fd () >= 0 )
+            return loop;
+
+        Log::w () << "Couldn't create epoll instance. Falling back to select().";
+        delete loop;
+    }
+#else
+    if ( backend == EPOLL )
+        Log::w () << "epoll is not available on this platform. Falling back to select().";
+#endif
+
+    if ( trigger == EDGE )
+        Log::w () << "Edge triggering is not supported by select(). Using level triggering.";
+
+    return new SelectEventLoop ();
+}
+
+bool SelectEventLoop::Add ( const int fd, void* data )
+{
+    if ( fd < 0 || fd >= FD_SETSIZE )
+    {
+        Log::e () << "Can't monitor file descriptor " << fd << " with select().";
+        return false;
+    }
+
+    mSources[ fd ] = data;
+
+    return true;
+}
+
+void SelectEventLoop::Remove ( const int fd )
+{
+    mSources.erase ( fd );
+    mWriteInterest.erase ( fd );
+}
+
+void SelectEventLoop::SetWriteInterest ( const int fd, void* data, const bool enabled )
+{
+    if ( enabled )
+        mWriteInterest.insert ( fd );
+    else
+        mWriteInterest.erase ( fd );
+}
+
+int SelectEventLoop::Wait ( Event* ready, const int max, const int timeout )
+{
+    fd_set rfds, wfds;
+    struct timeval tv;
+    int max_fd = -1;
+    int n = 0;
+
+    FD_ZERO ( &rfds );
+    FD_ZERO ( &wfds );
+
+    for ( auto s = mSources.begin (); s != mSources.end (); ++s )
+    {
+        FD_SET ( s -> first, &rfds );
+
+        if ( mWriteInterest.count ( s -> first ) > 0 )
+            FD_SET ( s -> first, &wfds );
+
+        if ( s -> first > max_fd )
+            max_fd = s -> first;
+    }
+
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = ( timeout % 1000 ) * 1000;
+
+    if ( select ( max_fd + 1, &rfds, &wfds, NULL, timeout < 0 ? NULL : &tv ) < 0 )
+        return -1;
+
+    // Only the registered descriptors are tested instead of every
+    // value up to max_fd.
+    for ( auto s = mSources.begin (); s != mSources.end () && n < max; ++s )
+    {
+        if ( FD_ISSET ( s -> first, &rfds ) || FD_ISSET ( s -> first, &wfds ) )
+        {
+            ready[ n ].data = s -> second;
+            ready[ n ].readable = FD_ISSET ( s -> first, &rfds );
+            ready[ n ].writable = FD_ISSET ( s -> first, &wfds );
+            n++;
+        }
+    }
+
+    return n;
+}
@@ -0,0 +1,238 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _eventloop_h
+#define _eventloop_h
+
+#include <map>
+#include <set>
+
+#ifdef __linux__
+    #include <errno.h>
+    #include <sys/socket.h>
+#endif
+
+/**
+ * @class EventLoop
+ * @brief Waits for readable (or writable) sockets.
+ *        Abstraction over the OS readiness notification mechanism.
+ *        File descriptors are registered once, together with an opaque
+ *        pointer that is handed back when the descriptor becomes
+ *        ready, so the caller can dispatch without looking anything up.
+ *
+ *        This is a pure virtual class. Use EventLoop::Build to construct
+ *        the backend best suited for the current platform.
+ */
+class EventLoop
+{
+public:
+
+    /**
+     * @brief Mechanism used to wait for readable sockets.
+     */
+    enum Backend
+    {
+        SELECT,  ///< Portable select() backend.
+        EPOLL,   ///< Linux epoll backend.
+        IO_URING ///< Linux io_uring backend.
+    };
+
+    /**
+     * @brief How readiness is reported by the event loop.
+     */
+    enum Trigger
+    {
+        LEVEL, /*!< A descriptor is reported for as long as it has
+                    unread data. */
+        EDGE   /*!< A descriptor is reported only when new data arrives.
+                    The caller must read until the socket would block. */
+    };
+
+    /**
+     * @struct Event
+     * @brief Describes a ready file descriptor.
+     */
+    struct Event
+    {
+        void* data; ///< Pointer passed to Add() for the descriptor.
+        bool readable; ///< True if there is data to read.
+        bool writable; /*!< True if data can be written. Only reported
+                            while write interest is enabled. */
+    };
+
+    // CTOR/DCTOR
+
+    /**
+     * @brief Constructs an event loop.
+     *        Falls back to epoll if io_uring can't be used, and to the
+     *        select() backend and level triggering if the requested ones
+     *        are not available on this platform.
+     * @param backend Desired backend.
+     * @param trigger Desired trigger mode.
+     * @return Pointer to the newly constructed event loop.
+     */
+    static EventLoop* Build ( Backend backend, Trigger trigger );
+
+    virtual ~EventLoop () {}
+
+    // METHODS
+
+    /**
+     * @brief Starts monitoring a file descriptor for incoming data.
+     * @param fd File descriptor to monitor.
+     * @param data Pointer handed back by Wait() when fd is readable.
+     * @return False if the descriptor couldn't be registered.
+     */
+    virtual bool Add ( const int fd, void* data ) = 0;
+    /**
+     * @brief Stops monitoring a file descriptor.
+     *        Must be called before the descriptor is closed.
+     * @param fd File descriptor to forget about.
+     */
+    virtual void Remove ( const int fd ) = 0;
+    /**
+     * @brief Starts or stops reporting when a descriptor becomes writable.
+     *        Only enable it while there is something waiting to be sent,
+     *        otherwise Wait() would return right away.
+     * @param fd File descriptor registered with Add().
+     * @param data Pointer passed to Add() for the descriptor.
+     * @param enabled True to report the descriptor when it is writable.
+     */
+    virtual void SetWriteInterest ( const int fd, void* data, const bool enabled ) = 0;
+    /**
+     * @brief Waits until at least one of the monitored descriptors is ready.
+     * @param ready Array that will be filled with the ready descriptors.
+     * @param max Size of the ready array.
+     * @param timeout Milliseconds to wait. A negative value waits forever.
+     * @return Number of entries written to ready, or -1 on error.
+     */
+    virtual int Wait ( Event* ready, const int max, const int timeout ) = 0;
+
+    /**
+     * @brief Retrieves the backend used by the event loop.
+     * @return EventLoop::Backend value.
+     */
+    virtual Backend GetBackend () const = 0;
+    /**
+     * @brief Retrieves the trigger mode used by the event loop.
+     * @return EventLoop::Trigger value.
+     */
+    Trigger GetTrigger () const { return mTrigger; }
+
+    /**
+     * @brief Hands whatever I/O has been queued by Transmit() to the kernel.
+     *        Does nothing on backends that don't queue any.
+     */
+    virtual void Submit () {}
+
+#ifdef __linux__
+    // Backends that do the I/O themselves, instead of reporting sockets
+    // that are ready for it, override the following. UDPSocket uses them
+    // in place of recvmmsg() and sendmmsg() when they're available.
+
+    /**
+     * @brief Tells whether the event loop receives datagrams itself.
+     * @return True if UDP sockets should be registered with AddReceiver()
+     *         and read with Receive().
+     */
+    virtual bool Receives () const { return false; }
+    /**
+     * @brief Starts receiving the datagrams sent to a UDP socket. Wait()
+     *        reports the socket as readable once some have been received.
+     * @param fd File descriptor of the UDP socket.
+     * @param data Pointer handed back by Wait() when datagrams are waiting.
+     * @return False if the descriptor couldn't be registered.
+     */
+    virtual bool AddReceiver ( const int fd, void* data ) { return Add ( fd, data ); }
+    /**
+     * @brief Takes datagrams received for a socket added with AddReceiver().
+     * @param fd File descriptor of the UDP socket.
+     * @param msgs Headers filled in as recvmmsg() would.
+     * @param n Number of headers.
+     * @return Number of datagrams, or -1 with errno set (EWOULDBLOCK if
+     *         there are none waiting).
+     */
+    virtual int Receive ( const int fd, struct mmsghdr* msgs, const unsigned int n ) { errno = EOPNOTSUPP; return -1; }
+    /**
+     * @brief Tells whether the event loop sends datagrams itself.
+     * @return True if UDP sockets should send through Transmit().
+     */
+    virtual bool Transmits () const { return false; }
+    /**
+     * @brief Queues datagrams to be sent in order on a UDP socket, by the
+     *        next Submit() or Wait(). The messages are copied.
+     * @param fd File descriptor of the UDP socket.
+     * @param msgs Headers of the datagrams, as passed to sendmmsg().
+     * @param n Number of datagrams.
+     * @param flags Flags passed to sendmsg().
+     * @return Number of datagrams queued, or -1 with errno set
+     *         (EWOULDBLOCK if the socket can't take any more yet).
+     */
+    virtual int Transmit ( const int fd, struct mmsghdr* msgs, const unsigned int n, const int flags ) { errno = EOPNOTSUPP; return -1; }
+    /**
+     * @brief Connects a TCP socket, giving up after a while.
+     * @param fd File descriptor of the blocking TCP socket.
+     * @param addr Address to connect to.
+     * @param len Size of addr.
+     * @param timeout Milliseconds to wait for the connection.
+     * @return 0 once connected, -1 with errno set on error, or -2 if the
+     *         connection timed out.
+     */
+    virtual int Connect ( const int fd, const struct sockaddr* addr, const socklen_t len, const int timeout ) { errno = EOPNOTSUPP; return -1; }
+#endif
+
+protected:
+
+    // CTOR
+
+    EventLoop ( Trigger trigger ) : mTrigger ( trigger ) {}
+
+    // VARS
+
+    Trigger mTrigger;
+};
+
+/**
+ * @class SelectEventLoop
+ * @brief select() based EventLoop.
+ *        Available on every platform. It rebuilds the descriptor set on
+ *        every call to Wait(), so it is only meant as a fallback.
+ */
+class SelectEventLoop : public EventLoop
+{
+public:
+
+    SelectEventLoop () : EventLoop ( LEVEL ) {}
+    virtual ~SelectEventLoop () {}
+
+    bool Add ( const int fd, void* data );
+    void Remove ( const int fd );
+    void SetWriteInterest ( const int fd, void* data, const bool enabled );
+    int Wait ( Event* ready, const int max, const int timeout );
+    Backend GetBackend () const { return SELECT; }
+
+private:
+
+    // VARS
+
+    std::map< int, void* > mSources;
+    std::set< int > mWriteInterest;
+};
+
+#endif // _eventloop_h
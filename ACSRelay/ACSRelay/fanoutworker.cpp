@@ -0,0 +1,268 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fanoutworker.h"
+#include "ACSProtocol.h"
+#include "log.h"
+
+
+FanoutWorker::FanoutWorker ( const unsigned int id, EventLoop::Backend backend, EventLoop::Trigger trigger,
+                             const size_t send_queue_size, const size_t send_queue_high_water,
+                             const unsigned int send_queue_timeout, const unsigned int stats_interval,
+                             const unsigned int compression_flush )
+    : mId ( id ),
+      mEventLoop ( EventLoop::Build ( backend, trigger ) ),
+      mPeers ( NULL ),
+      mCommands ( kRingSize ),
+      mUpstream ( kUpstreamRingSize ),
+      mCommandsPending ( false ),
+      mUpstreamPending ( false ),
+      mAdded ( 0 ),
+      mTaken ( 0 ),
+      mRemoved ( 0 ),
+      mDropped ( 0 )
+{
+    mPeers = new PeerGroup ( mEventLoop, send_queue_size, send_queue_high_water, send_queue_timeout, stats_interval, compression_flush );
+}
+
+bool FanoutWorker::Start ()
+{
+    if ( !mCommandNotifier.Valid () || !mUpstreamNotifier.Valid () )
+        return false;
+
+    if ( !mEventLoop -> Add ( mCommandNotifier.Fd (), &mCommandNotifier ) )
+        return false;
+
+    mThread = std::thread ( &FanoutWorker::Run, this );
+
+    return true;
+}
+
+void FanoutWorker::AddPeer ( PeerConnection* peer )
+{
+    Command command;
+
+    command.packet = NULL;
+    command.peer = peer;
+    command.stop = false;
+
+    Push ( command );
+    mAdded += 1;
+}
+
+void FanoutWorker::Relay ( PacketBuffer* packet, const uint16_t set_interval )
+{
+    Command command;
+
+    command.packet = packet;
+    command.set_interval = set_interval;
+    command.peer = NULL;
+    command.stop = false;
+
+    // The worker releases it once it's done with it.
+    packet -> Retain ();
+
+    if ( mCommands.Empty () )
+        mCommandsPending = true;
+
+    if ( mCommands.Push ( command ) )
+        return;
+
+    // The worker is too far behind. Car updates will be superseded by
+    // the next ones anyway, but everything else has to get through.
+    if ( static_cast<int8_t> ( packet -> Data ()[ 0 ] ) == ACSProtocol::ACSP_CAR_UPDATE )
+    {
+        packet -> Release ();
+        mDropped += 1;
+        return;
+    }
+
+    Push ( command );
+}
+
+void FanoutWorker::Push ( const Command& command )
+{
+    if ( mCommands.Empty () )
+        mCommandsPending = true;
+
+    while ( !mCommands.Push ( command ) )
+    {
+        // Make sure the worker is awake to make room.
+        Notify ();
+        std::this_thread::yield ();
+    }
+}
+
+void FanoutWorker::Notify ()
+{
+    if ( !mCommandsPending )
+        return;
+
+    mCommandsPending = false;
+    mCommandNotifier.Notify ();
+}
+
+PacketBuffer* FanoutWorker::ReadUpstream ()
+{
+    PacketBuffer* packet;
+
+    if ( !mUpstream.Pop ( packet ) )
+        return NULL;
+
+    return packet;
+}
+
+void FanoutWorker::Run ()
+{
+    EventLoop::Event ready[ kMaxReadyEvents ];
+    PeerConnection* peer;
+    bool running = true;
+    bool edge;
+    int n;
+
+    edge = ( mEventLoop -> GetTrigger () == EventLoop::EDGE );
+
+    Log::v () << "Fan-out worker " << mId << " started.";
+
+    while ( running )
+    {
+        n = mEventLoop -> Wait ( ready, kMaxReadyEvents, mPeers -> Timeout () );
+
+        for ( int i = 0; i < n; i++ )
+        {
+            if ( ready[ i ].data == &mCommandNotifier )
+            {
+                running = ReadCommands () && running;
+                continue;
+            }
+
+            peer = static_cast<PeerConnection*> ( ready[ i ].data );
+
+            if ( ready[ i ].writable )
+                mPeers -> Writable ( peer );
+
+            if ( ready[ i ].readable )
+            {
+                while ( RelayFromPeer ( peer ) && ( edge || peer -> GetSocket () -> HasPending () ) );
+            }
+        }
+
+        mPeers -> Maintain ( Clock::now () );
+        mRemoved.store ( mTaken - mPeers -> Size (), std::memory_order_relaxed );
+
+        if ( mUpstreamPending )
+        {
+            mUpstreamPending = false;
+            mUpstreamNotifier.Notify ();
+        }
+    }
+
+    Log::v () << "Fan-out worker " << mId << " stopped.";
+}
+
+bool FanoutWorker::ReadCommands ()
+{
+    Command command;
+    bool running = true;
+
+    mCommandNotifier.Clear ();
+
+    while ( mCommands.Pop ( command ) )
+    {
+        if ( command.stop )
+        {
+            running = false;
+        }
+        else if ( command.peer != NULL )
+        {
+            mPeers -> Add ( command.peer );
+            mTaken += 1;
+        }
+        else
+        {
+            mPeers -> Deliver ( command.packet, command.set_interval );
+            command.packet -> Release ();
+        }
+    }
+
+    mPeers -> Flush ();
+
+    return running;
+}
+
+bool FanoutWorker::RelayFromPeer ( PeerConnection* peer )
+{
+    PacketBuffer* packet;
+    long n;
+
+    packet = PacketBuffer::Acquire ();
+    n = mPeers -> Receive ( peer, packet );
+
+    if ( n < 1 )
+    {
+        packet -> Release ();
+        return n == 0;
+    }
+
+    if ( mUpstream.Empty () )
+        mUpstreamPending = true;
+
+    // Never wait for the receiving thread, since it may be waiting for us.
+    if ( !mUpstream.Push ( packet ) )
+    {
+        Log::w () << "Too many messages waiting to be relayed to the server. Dropping one from " << peer -> Name () << ".";
+        packet -> Release ();
+    }
+
+    return true;
+}
+
+FanoutWorker::~FanoutWorker ()
+{
+    Command command;
+    PacketBuffer* packet;
+
+    if ( mThread.joinable () )
+    {
+        command.packet = NULL;
+        command.peer = NULL;
+        command.stop = true;
+
+        Push ( command );
+        mCommandNotifier.Notify ();
+        mThread.join ();
+    }
+
+    // Whatever is still queued in either direction.
+    while ( mCommands.Pop ( command ) )
+    {
+        if ( command.packet != NULL )
+            command.packet -> Release ();
+        else if ( command.peer != NULL )
+            delete command.peer;
+    }
+
+    while ( mUpstream.Pop ( packet ) )
+    {
+        packet -> Release ();
+    }
+
+    delete mPeers;
+    delete mEventLoop;
+}
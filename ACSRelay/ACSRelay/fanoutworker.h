@@ -0,0 +1,186 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _fanoutworker_h
+#define _fanoutworker_h
+
+#include "eventloop.h"
+#include "notifier.h"
+#include "packetbuffer.h"
+#include "peergroup.h"
+#include "spscring.h"
+
+#include <atomic>
+#include <thread>
+
+/**
+ * @class FanoutWorker
+ * @brief Thread that owns a share of the peers.
+ *        The thread receiving from the server hands it every server message
+ *        through a lock-free ring. The worker then decides which of its
+ *        peers get the message and sends it to them. Messages from its
+ *        peers travel the other way through a second ring.
+ *
+ *        Every method is meant to be called from the receiving thread.
+ */
+class FanoutWorker
+{
+public:
+
+    // CTOR/DCTOR
+
+    /**
+     * @brief FanoutWorker object constructor. The thread is only started by Start().
+     * @param id Number used to identify the worker in the log.
+     * @param backend Backend of the worker's EventLoop.
+     * @param trigger Trigger mode of the worker's EventLoop.
+     * @param send_queue_size Maximum number of packets waiting for a peer.
+     * @param send_queue_high_water Number of waiting packets above which a peer is stalling.
+     * @param send_queue_timeout Seconds a peer may stall before being dealt with.
+     * @param stats_interval Seconds between statistics reports, 0 to disable them.
+     * @param compression_flush Milliseconds compressed messages may wait on relay links.
+     */
+    FanoutWorker ( const unsigned int id, EventLoop::Backend backend, EventLoop::Trigger trigger,
+                   const size_t send_queue_size, const size_t send_queue_high_water,
+                   const unsigned int send_queue_timeout, const unsigned int stats_interval,
+                   const unsigned int compression_flush );
+    /**
+     * @brief FanoutWorker destructor. Stops the thread and destroys its peers.
+     */
+    virtual ~FanoutWorker ();
+
+    // METHODS
+
+    /**
+     * @brief Starts the worker thread.
+     * @return False if the worker can't run on this platform.
+     */
+    bool Start ();
+    /**
+     * @brief Hands a peer over to the worker, which takes ownership of it.
+     * @param peer Pointer to a PeerConnection.
+     */
+    void AddPeer ( PeerConnection* peer );
+    /**
+     * @brief Retrieves the number of peers owned by the worker.
+     * @return Number of peers, including the ones that are being handed over.
+     */
+    size_t Load () const { return mAdded - mRemoved.load ( std::memory_order_relaxed ); }
+    /**
+     * @brief Queues a server message for the worker.
+     *        Car updates are dropped if the worker is too far behind.
+     * @param packet Buffer holding the message. The worker keeps a reference
+     *        to it, and never modifies it.
+     * @param set_interval Shortest car update interval the server was asked for.
+     */
+    void Relay ( PacketBuffer* packet, const uint16_t set_interval );
+    /**
+     * @brief Wakes up the worker if something has been queued for it
+     *        since the last call.
+     */
+    void Notify ();
+    /**
+     * @brief Retrieves the file descriptor that becomes readable when the
+     *        worker has messages for the server.
+     * @return File descriptor as an integer.
+     */
+    int UpstreamFd () const { return mUpstreamNotifier.Fd (); }
+    /**
+     * @brief Makes UpstreamFd() not readable anymore. Must be called before
+     *        reading the messages with ReadUpstream().
+     */
+    void ClearUpstream () { mUpstreamNotifier.Clear (); }
+    /**
+     * @brief Retrieves a message for the server, received from one of the
+     *        worker's peers. Call it until it returns NULL once UpstreamFd()
+     *        becomes readable.
+     * @return Buffer holding the message, or NULL if there are no more
+     *         messages. The caller must release it.
+     */
+    PacketBuffer* ReadUpstream ();
+    /**
+     * @brief Retrieves the number of server messages the worker had to drop.
+     * @return Number of dropped messages.
+     */
+    unsigned long Dropped () const { return mDropped; }
+
+private:
+
+    /**
+     * @struct Command
+     * @brief Work handed from the receiving thread to the worker.
+     */
+    struct Command
+    {
+        PacketBuffer* packet; ///< Message to relay, if any.
+        uint16_t set_interval; ///< Shortest car update interval the server was asked for.
+        PeerConnection* peer; ///< Peer to take over, if any.
+        bool stop; ///< True if the worker must exit.
+    };
+
+    // METHODS
+
+    /**
+     * @brief Thread body. Serves the worker's peers until told to stop.
+     */
+    void Run ();
+    /**
+     * @brief Processes everything queued by the receiving thread.
+     * @return False if the worker must stop.
+     */
+    bool ReadCommands ();
+    /**
+     * @brief Reads a message from one of the worker's peers and passes it upstream.
+     * @param peer Pointer to the PeerConnection that is readable.
+     * @return True if a message was read and more may be waiting on the socket.
+     */
+    bool RelayFromPeer ( PeerConnection* peer );
+    /**
+     * @brief Queues a command for the worker, waiting for room if necessary.
+     * @param command Command to be queued.
+     */
+    void Push ( const Command& command );
+
+    // VARS
+
+    unsigned int mId;
+
+    EventLoop* mEventLoop;
+    PeerGroup* mPeers;
+
+    SpscRing< Command > mCommands;
+    SpscRing< PacketBuffer* > mUpstream;
+    Notifier mCommandNotifier;
+    Notifier mUpstreamNotifier;
+    bool mCommandsPending;
+    bool mUpstreamPending;
+
+    std::thread mThread;
+
+    size_t mAdded;
+    size_t mTaken;
+    std::atomic< size_t > mRemoved;
+    unsigned long mDropped;
+
+    const static size_t kRingSize = 4096;
+    const static size_t kUpstreamRingSize = 256;
+    const static int kMaxReadyEvents = 64;
+};
+
+#endif // _fanoutworker_h
@@ -0,0 +1,956 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "iouringeventloop.h"
+#include "log.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+IOUringEventLoop::IOUringEventLoop ( Trigger trigger )
+    : EventLoop ( trigger ),
+      mRingFd ( -1 ),
+      mRing ( MAP_FAILED ),
+      mRingSize ( 0 ),
+      mSqes ( static_cast<struct io_uring_sqe*> ( MAP_FAILED ) ),
+      mSqesSize ( 0 ),
+      mReceives ( false ),
+      mBufRing ( static_cast<struct io_uring_buf*> ( MAP_FAILED ) ),
+      mBufTail ( 0 ),
+      mFreeBuffers ( 0 ),
+      mCalling ( false ),
+      mCallResult ( 0 )
+{
+    struct io_uring_params params;
+    char* ring;
+
+    memset ( &params, 0, sizeof ( params ) );
+
+    // Completions of a whole burst of sends must fit.
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = kCompletionEntries;
+
+    // There's no need for liburing: the ring is set up and used through
+    // the system calls directly.
+    mRingFd = syscall ( __NR_io_uring_setup, kEntries, &params );
+
+    if ( mRingFd < 0 )
+        return;
+
+    // Multishot poll requests came with Linux 5.13, as did IORING_FEAT_RSRC_TAGS.
+    if ( ( params.features & IORING_FEAT_SINGLE_MMAP ) == 0 ||
+         ( params.features & IORING_FEAT_EXT_ARG ) == 0 ||
+         ( params.features & IORING_FEAT_RSRC_TAGS ) == 0 )
+    {
+        close ( mRingFd );
+        mRingFd = -1;
+        return;
+    }
+
+    mRingSize = std::max ( params.sq_off.array + params.sq_entries * sizeof ( unsigned int ),
+                           params.cq_off.cqes + params.cq_entries * sizeof ( struct io_uring_cqe ) );
+    mRing = mmap ( NULL, mRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQ_RING );
+    mSqesSize = params.sq_entries * sizeof ( struct io_uring_sqe );
+    mSqes = static_cast<struct io_uring_sqe*> ( mmap ( NULL, mSqesSize, PROT_READ | PROT_WRITE,
+                                                       MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQES ) );
+
+    if ( mRing == MAP_FAILED || mSqes == MAP_FAILED )
+    {
+        Log::e () << "Couldn't map the io_uring queues: " << strerror ( errno );
+        close ( mRingFd );
+        mRingFd = -1;
+        return;
+    }
+
+    ring = static_cast<char*> ( mRing );
+
+    mSqHead = reinterpret_cast<unsigned int*> ( ring + params.sq_off.head );
+    mSqTail = reinterpret_cast<unsigned int*> ( ring + params.sq_off.tail );
+    mSqFlags = reinterpret_cast<unsigned int*> ( ring + params.sq_off.flags );
+    mSqArray = reinterpret_cast<unsigned int*> ( ring + params.sq_off.array );
+    mSqMask = *reinterpret_cast<unsigned int*> ( ring + params.sq_off.ring_mask );
+    mSqEntries = params.sq_entries;
+    mSqLocalTail = *mSqTail;
+
+    mCqHead = reinterpret_cast<unsigned int*> ( ring + params.cq_off.head );
+    mCqTail = reinterpret_cast<unsigned int*> ( ring + params.cq_off.tail );
+    mCqes = reinterpret_cast<struct io_uring_cqe*> ( ring + params.cq_off.cqes );
+    mCqMask = *reinterpret_cast<unsigned int*> ( ring + params.cq_off.ring_mask );
+
+    mSlots.resize ( kSendSlots );
+
+    for ( unsigned int i = 0; i < kSendSlots; i++ )
+    {
+        mFreeSlots.push_back ( kSendSlots - 1 - i );
+    }
+
+    memset ( &mRecvHeader, 0, sizeof ( mRecvHeader ) );
+    mRecvHeader.msg_namelen = sizeof ( struct sockaddr_in );
+
+    mReceives = SetUpReceiving ();
+
+    if ( !mReceives )
+        Log::v () << "This kernel can't receive datagrams through io_uring (it needs Linux 6.0 or later). Polling UDP sockets instead.";
+}
+
+bool IOUringEventLoop::SetUpReceiving ()
+{
+    struct io_uring_buf_reg reg;
+    struct io_uring_sqe* sqe;
+    int probe;
+    int result;
+
+    mBufRing = static_cast<struct io_uring_buf*> ( mmap ( NULL, kBufferCount * sizeof ( struct io_uring_buf ), PROT_READ | PROT_WRITE,
+                                                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 ) );
+
+    if ( mBufRing == MAP_FAILED )
+        return false;
+
+    memset ( &reg, 0, sizeof ( reg ) );
+    reg.ring_addr = reinterpret_cast<uint64_t> ( mBufRing );
+    reg.ring_entries = kBufferCount;
+    reg.bgid = kBufferGroup;
+
+    // Provided buffer rings came with Linux 5.19...
+    if ( syscall ( __NR_io_uring_register, mRingFd, IORING_REGISTER_PBUF_RING, &reg, 1 ) < 0 )
+        return false;
+
+    mBuffers.resize ( kBufferCount * kBufferSize );
+
+    for ( unsigned int i = 0; i < kBufferCount; i++ )
+    {
+        Recycle ( i );
+    }
+
+    // ...and multishot receives with Linux 6.0. Older kernels reject them
+    // right away, newer ones wait for a datagram that won't come until
+    // the request is cancelled.
+    probe = socket ( AF_INET, SOCK_DGRAM, 0 );
+
+    if ( probe < 0 )
+        return false;
+
+    sqe = GetSqe ();
+    sqe -> opcode = IORING_OP_RECVMSG;
+    sqe -> fd = probe;
+    sqe -> addr = reinterpret_cast<uint64_t> ( &mRecvHeader );
+    sqe -> len = 1;
+    sqe -> ioprio = IORING_RECV_MULTISHOT;
+    sqe -> flags = IOSQE_BUFFER_SELECT;
+    sqe -> buf_group = kBufferGroup;
+    sqe -> user_data = kCall << kKindShift;
+
+    Cancel ( kCall << kKindShift );
+
+    result = Call ();
+    close ( probe );
+
+    return result == -ECANCELED;
+}
+
+bool IOUringEventLoop::Add ( const int fd, void* data )
+{
+    return Register ( fd, data, false );
+}
+
+bool IOUringEventLoop::AddReceiver ( const int fd, void* data )
+{
+    return Register ( fd, data, mReceives );
+}
+
+bool IOUringEventLoop::Register ( const int fd, void* data, const bool receiver )
+{
+    if ( fd < 0 )
+    {
+        Log::e () << "Can't monitor file descriptor " << fd << " with io_uring.";
+        return false;
+    }
+
+    if ( static_cast<size_t> ( fd ) >= mSources.size () )
+        mSources.resize ( fd + 1 );
+
+    Source& source = mSources[ fd ];
+
+    source.data = data;
+    source.active = true;
+    source.receiver = receiver;
+    source.read_armed = false;
+    source.write_armed = false;
+    source.write_interest = false;
+    source.ready_read = false;
+    source.ready_write = false;
+    source.listed = false;
+    source.error = 0;
+    source.sending = 0;
+
+    if ( receiver )
+        mReceivers.push_back ( fd );
+
+    Arm ( fd, false );
+
+    return true;
+}
+
+void IOUringEventLoop::Remove ( const int fd )
+{
+    if ( !Active ( fd ) )
+        return;
+
+    Source& source = mSources[ fd ];
+
+    if ( source.read_armed )
+        Cancel ( Key ( fd, false ) );
+
+    if ( source.write_armed )
+        Cancel ( Key ( fd, true ) );
+
+    for ( auto d = source.received.begin (); d != source.received.end (); ++d )
+    {
+        Recycle ( d -> buffer );
+    }
+
+    // Sends still in flight free their slots when they complete.
+    mFreeSlots.insert ( mFreeSlots.end (), source.retry.begin (), source.retry.end () );
+
+    if ( source.receiver )
+        mReceivers.erase ( std::remove ( mReceivers.begin (), mReceivers.end (), fd ), mReceivers.end () );
+
+    source.received.clear ();
+    source.retry.clear ();
+    source.active = false;
+    source.read_armed = false;
+    source.write_armed = false;
+    source.write_interest = false;
+    source.listed = false;
+    // Whatever the old requests still report is ignored from now on.
+    source.generation = ( source.generation + 1 ) & kGenerationMask;
+
+    // The requests keep the socket open until they're cancelled, so they
+    // are handed to the kernel before the caller closes it.
+    Enter ( 0 );
+}
+
+void IOUringEventLoop::SetWriteInterest ( const int fd, void* data, const bool enabled )
+{
+    if ( !Active ( fd ) )
+        return;
+
+    Source& source = mSources[ fd ];
+
+    // A request that's no longer wanted is left to complete and ignored,
+    // so that it's there already if writing stalls again. While datagrams
+    // are being sent, the socket is reported once they all went out.
+    source.write_interest = enabled;
+
+    if ( enabled && !source.write_armed && source.sending == 0 && source.retry.empty () )
+        Arm ( fd, true );
+}
+
+int IOUringEventLoop::Wait ( Event* ready, const int max, const int timeout )
+{
+    // One-shot requests that completed during the last call are rearmed
+    // only now, once the caller dealt with what they reported.
+    Rearm ();
+
+    // Completions already on the ring are picked up without a system call.
+    Reap ();
+
+    if ( mTrigger == LEVEL )
+    {
+        for ( auto fd = mReceivers.begin (); fd != mReceivers.end (); ++fd )
+        {
+            if ( !mSources[ *fd ].received.empty () || mSources[ *fd ].error != 0 )
+                MarkReady ( *fd, false );
+        }
+    }
+
+    if ( !mReady.empty () )
+        return Enter ( 0 ) ? Collect ( ready, max ) : -1;
+
+    // Nothing to report. Whatever completed since is rearmed before waiting.
+    Rearm ();
+
+    if ( !Enter ( timeout ) )
+        return -1;
+
+    Reap ();
+
+    return Collect ( ready, max );
+}
+
+void IOUringEventLoop::Submit ()
+{
+    if ( Enter ( 0 ) )
+        Reap ();
+}
+
+int IOUringEventLoop::Receive ( const int fd, struct mmsghdr* msgs, const unsigned int n )
+{
+    unsigned int count = 0;
+
+    if ( !Active ( fd ) )
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    Source& source = mSources[ fd ];
+
+    while ( count < n && !source.received.empty () )
+    {
+        Datagram datagram = source.received.front ();
+        struct msghdr* header = &msgs[ count ].msg_hdr;
+        char* buffer = &mBuffers[ datagram.buffer * kBufferSize ];
+        struct io_uring_recvmsg_out* out = reinterpret_cast<struct io_uring_recvmsg_out*> ( buffer );
+        // The kernel lays out the sender's address and then the payload
+        // after the header, leaving as much room for the address as the
+        // request asked for.
+        char* payload = buffer + sizeof ( *out ) + mRecvHeader.msg_namelen;
+        size_t left = std::min<size_t> ( out -> payloadlen, datagram.length - ( payload - buffer ) );
+        size_t copied = 0;
+
+        source.received.pop_front ();
+
+        for ( size_t i = 0; i < header -> msg_iovlen && copied < left; i++ )
+        {
+            size_t length = std::min ( left - copied, header -> msg_iov[ i ].iov_len );
+
+            memcpy ( header -> msg_iov[ i ].iov_base, payload + copied, length );
+            copied += length;
+        }
+
+        if ( header -> msg_name != NULL )
+        {
+            memcpy ( header -> msg_name, buffer + sizeof ( *out ), std::min ( header -> msg_namelen, std::min ( out -> namelen, mRecvHeader.msg_namelen ) ) );
+            header -> msg_namelen = out -> namelen;
+        }
+
+        header -> msg_controllen = 0;
+        header -> msg_flags = out -> flags | ( copied < out -> payloadlen ? MSG_TRUNC : 0 );
+        msgs[ count ].msg_len = copied;
+
+        Recycle ( datagram.buffer );
+        count++;
+    }
+
+    if ( count > 0 )
+        return count;
+
+    if ( source.error != 0 )
+    {
+        errno = source.error;
+        source.error = 0;
+        return -1;
+    }
+
+    errno = EWOULDBLOCK;
+    return -1;
+}
+
+int IOUringEventLoop::Transmit ( const int fd, struct mmsghdr* msgs, const unsigned int n, const int flags )
+{
+    unsigned int count;
+    unsigned int first;
+
+    if ( !Active ( fd ) )
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    Source& source = mSources[ fd ];
+
+    // Datagrams of a socket leave in order, so a new batch waits for the
+    // previous one. Sends usually complete as soon as they're submitted.
+    if ( source.sending > 0 || mFreeSlots.size () < n )
+        Submit ();
+
+    // Only the socket that is backed up waits. It holds at most one batch
+    // of slots, so the others get new ones rather than waiting for it.
+    if ( source.sending > 0 || !source.retry.empty () )
+    {
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+
+    // A batch is submitted at once, so it can't be larger than the ring.
+    count = std::min ( n, mSqEntries );
+
+    while ( mFreeSlots.size () < count )
+    {
+        mFreeSlots.push_back ( mSlots.size () );
+        mSlots.resize ( mSlots.size () + 1 );
+    }
+
+    first = mFreeSlots.size () - count;
+
+    for ( unsigned int i = 0; i < count; i++ )
+    {
+        const struct msghdr* header = &msgs[ i ].msg_hdr;
+        Slot& slot = mSlots[ mFreeSlots[ first + i ] ];
+        size_t length = 0;
+
+        for ( size_t v = 0; v < header -> msg_iovlen; v++ )
+        {
+            length += header -> msg_iov[ v ].iov_len;
+        }
+
+        if ( length > sizeof ( slot.data ) )
+        {
+            if ( i > 0 )
+            {
+                count = i;
+                break;
+            }
+
+            // Too big for a slot. Nothing else is on its way through this
+            // socket, so sending it right away keeps the order.
+            if ( sendmsg ( fd, header, flags ) < 0 )
+                return -1;
+
+            msgs[ i ].msg_len = length;
+
+            return 1;
+        }
+
+        length = 0;
+
+        for ( size_t v = 0; v < header -> msg_iovlen; v++ )
+        {
+            memcpy ( slot.data + length, header -> msg_iov[ v ].iov_base, header -> msg_iov[ v ].iov_len );
+            length += header -> msg_iov[ v ].iov_len;
+        }
+
+        slot.vector.iov_base = slot.data;
+        slot.vector.iov_len = length;
+
+        memset ( &slot.header, 0, sizeof ( slot.header ) );
+        slot.header.msg_iov = &slot.vector;
+        slot.header.msg_iovlen = 1;
+
+        if ( header -> msg_name != NULL )
+        {
+            slot.header.msg_name = &slot.address;
+            slot.header.msg_namelen = std::min<socklen_t> ( header -> msg_namelen, sizeof ( slot.address ) );
+            memcpy ( &slot.address, header -> msg_name, slot.header.msg_namelen );
+        }
+
+        slot.fd = fd;
+        slot.generation = source.generation;
+        slot.flags = flags;
+
+        msgs[ i ].msg_len = length;
+    }
+
+    // Completions reaped while submitting give slots back to mFreeSlots,
+    // so the ones being sent are taken out of it first.
+    mTaken.assign ( mFreeSlots.begin () + first, mFreeSlots.begin () + first + count );
+    mFreeSlots.erase ( mFreeSlots.begin () + first, mFreeSlots.end () );
+    Send ( fd, mTaken.data (), count );
+
+    return count;
+}
+
+int IOUringEventLoop::Connect ( const int fd, const struct sockaddr* addr, const socklen_t len, const int timeout )
+{
+    struct __kernel_timespec ts;
+    struct io_uring_sqe* sqe;
+    int res;
+
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = ( timeout % 1000 ) * 1000000L;
+
+    Reserve ( 2 );
+
+    // The timeout cancels the connection attempt if it's still going on.
+    sqe = GetSqe ();
+    sqe -> opcode = IORING_OP_CONNECT;
+    sqe -> fd = fd;
+    sqe -> addr = reinterpret_cast<uint64_t> ( addr );
+    sqe -> off = len;
+    sqe -> flags = IOSQE_IO_LINK;
+    sqe -> user_data = kCall << kKindShift;
+
+    sqe = GetSqe ();
+    sqe -> opcode = IORING_OP_LINK_TIMEOUT;
+    sqe -> fd = -1;
+    sqe -> addr = reinterpret_cast<uint64_t> ( &ts );
+    sqe -> len = 1;
+    sqe -> user_data = kIgnore;
+
+    res = Call ();
+
+    if ( res == -ECANCELED )
+        return -2;
+
+    if ( res < 0 )
+    {
+        errno = -res;
+        return -1;
+    }
+
+    return 0;
+}
+
+void IOUringEventLoop::Arm ( const int fd, const bool write )
+{
+    struct io_uring_sqe* sqe = GetSqe ();
+    Source& source = mSources[ fd ];
+
+    sqe -> fd = fd;
+    sqe -> user_data = Key ( fd, write );
+
+    if ( write )
+    {
+        sqe -> opcode = IORING_OP_POLL_ADD;
+        sqe -> poll32_events = POLLOUT;
+        source.write_armed = true;
+    }
+    else if ( source.receiver )
+    {
+        // A single request receives every datagram into the provided
+        // buffers, until they run out.
+        sqe -> opcode = IORING_OP_RECVMSG;
+        sqe -> addr = reinterpret_cast<uint64_t> ( &mRecvHeader );
+        sqe -> len = 1;
+        sqe -> ioprio = IORING_RECV_MULTISHOT;
+        sqe -> flags = IOSQE_BUFFER_SELECT;
+        sqe -> buf_group = kBufferGroup;
+        source.read_armed = true;
+    }
+    else
+    {
+        // With edge triggering a single request reports every new
+        // datagram. Level triggering rearms a one-shot request after each
+        // event, which completes right away if there's still data to read.
+        sqe -> opcode = IORING_OP_POLL_ADD;
+        sqe -> poll32_events = POLLIN;
+
+        if ( mTrigger == EDGE )
+            sqe -> len = IORING_POLL_ADD_MULTI;
+
+        source.read_armed = true;
+    }
+}
+
+void IOUringEventLoop::Cancel ( const uint64_t key )
+{
+    struct io_uring_sqe* sqe = GetSqe ();
+
+    sqe -> opcode = IORING_OP_ASYNC_CANCEL;
+    sqe -> fd = -1;
+    sqe -> addr = key;
+    sqe -> user_data = kIgnore;
+}
+
+void IOUringEventLoop::Send ( const int fd, const unsigned int* slots, const unsigned int n )
+{
+    Reserve ( n );
+
+    for ( unsigned int i = 0; i < n; i++ )
+    {
+        struct io_uring_sqe* sqe = GetSqe ();
+
+        sqe -> opcode = IORING_OP_SENDMSG;
+        sqe -> fd = fd;
+        sqe -> addr = reinterpret_cast<uint64_t> ( &mSlots[ slots[ i ] ].header );
+        sqe -> len = 1;
+        sqe -> msg_flags = mSlots[ slots[ i ] ].flags;
+        sqe -> user_data = ( kSend << kKindShift ) | slots[ i ];
+
+        // If a send fails, the ones linked after it are cancelled rather
+        // than overtaking it.
+        if ( i + 1 < n )
+            sqe -> flags = IOSQE_IO_LINK;
+    }
+
+    mSources[ fd ].sending += n;
+}
+
+void IOUringEventLoop::Rearm ()
+{
+    // Arming may reap completions that add to mRearm, so the list is
+    // taken over first.
+    mRearming.swap ( mRearm );
+
+    for ( size_t i = 0; i < mRearming.size (); i++ )
+    {
+        int fd = mRearming[ i ];
+
+        if ( !Active ( fd ) )
+            continue;
+
+        Source& source = mSources[ fd ];
+
+        if ( !source.read_armed )
+        {
+            // A receiver that ran out of buffers waits for some to come back.
+            if ( source.receiver && mFreeBuffers == 0 )
+                mRearm.push_back ( fd );
+            else
+                Arm ( fd, false );
+        }
+
+        if ( !source.write_armed && source.sending == 0 && ( source.write_interest || !source.retry.empty () ) )
+            Arm ( fd, true );
+    }
+
+    mRearming.clear ();
+}
+
+struct io_uring_sqe* IOUringEventLoop::GetSqe ()
+{
+    struct io_uring_sqe* sqe;
+    unsigned int index;
+
+    Reserve ( 1 );
+
+    index = mSqLocalTail & mSqMask;
+    sqe = &mSqes[ index ];
+    memset ( sqe, 0, sizeof ( *sqe ) );
+    mSqArray[ index ] = index;
+    mSqLocalTail++;
+
+    return sqe;
+}
+
+void IOUringEventLoop::Reserve ( const unsigned int n )
+{
+    // Entries the kernel hasn't read yet can't be reused. It may refuse to
+    // take more while the completion queue is full, so that is drained too.
+    while ( mSqLocalTail - __atomic_load_n ( mSqHead, __ATOMIC_ACQUIRE ) + n > mSqEntries )
+    {
+        if ( !Enter ( 0 ) )
+            break;
+
+        Reap ();
+    }
+}
+
+bool IOUringEventLoop::Enter ( const int timeout )
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned int submit;
+    unsigned int flags = 0;
+    unsigned int wait = 0;
+
+    __atomic_store_n ( mSqTail, mSqLocalTail, __ATOMIC_RELEASE );
+    submit = mSqLocalTail - __atomic_load_n ( mSqHead, __ATOMIC_ACQUIRE );
+
+    // Completions that didn't fit in the queue are kept by the kernel
+    // until it's asked for them.
+    if ( ( __atomic_load_n ( mSqFlags, __ATOMIC_ACQUIRE ) & IORING_SQ_CQ_OVERFLOW ) != 0 )
+        flags = IORING_ENTER_GETEVENTS;
+
+    if ( timeout != 0 )
+    {
+        memset ( &arg, 0, sizeof ( arg ) );
+        arg.sigmask_sz = _NSIG / 8;
+
+        if ( timeout > 0 )
+        {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = ( timeout % 1000 ) * 1000000L;
+            arg.ts = reinterpret_cast<uint64_t> ( &ts );
+        }
+
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        wait = 1;
+    }
+    else if ( submit == 0 && flags == 0 )
+    {
+        return true;
+    }
+
+    if ( syscall ( __NR_io_uring_enter, mRingFd, submit, wait, flags, wait ? &arg : NULL, wait ? sizeof ( arg ) : 0 ) < 0 )
+    {
+        // The timeout expiring is reported as an error.
+        if ( errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN )
+        {
+            Log::e () << "io_uring_enter() failed: " << strerror ( errno );
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void IOUringEventLoop::Reap ()
+{
+    for ( ;; )
+    {
+        unsigned int head = *mCqHead;
+
+        if ( head == __atomic_load_n ( mCqTail, __ATOMIC_ACQUIRE ) )
+        {
+            // The kernel may be holding more.
+            if ( ( __atomic_load_n ( mSqFlags, __ATOMIC_ACQUIRE ) & IORING_SQ_CQ_OVERFLOW ) == 0 || !Enter ( 0 ) ||
+                 head == __atomic_load_n ( mCqTail, __ATOMIC_ACQUIRE ) )
+                break;
+
+            continue;
+        }
+
+        struct io_uring_cqe cqe = mCqes[ head & mCqMask ];
+        int fd = static_cast<int> ( cqe.user_data & 0xFFFFFFFF );
+        uint64_t kind = cqe.user_data >> kKindShift;
+        bool write = ( ( cqe.user_data >> 32 ) & 1 ) != 0;
+        bool more = ( cqe.flags & IORING_CQE_F_MORE ) != 0;
+        bool buffered = ( cqe.flags & IORING_CQE_F_BUFFER ) != 0;
+        unsigned int buffer = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+
+        // The completion is copied, its entry can be reused. Handling it may
+        // need room to submit, which reaps from here on.
+        __atomic_store_n ( mCqHead, head + 1, __ATOMIC_RELEASE );
+
+        if ( buffered )
+            mFreeBuffers--;
+
+        if ( cqe.user_data == kIgnore )
+        {
+            if ( buffered )
+                Recycle ( buffer );
+
+            continue;
+        }
+
+        if ( kind == kSend )
+        {
+            Sent ( fd, cqe.res );
+            continue;
+        }
+
+        if ( kind == kCall )
+        {
+            mCalling = false;
+            mCallResult = cqe.res;
+            continue;
+        }
+
+        if ( !Active ( fd ) || mSources[ fd ].generation != ( ( cqe.user_data >> 33 ) & kGenerationMask ) )
+        {
+            if ( buffered )
+                Recycle ( buffer );
+
+            continue;
+        }
+
+        Source& source = mSources[ fd ];
+
+        if ( !more )
+        {
+            if ( write )
+                source.write_armed = false;
+            else
+                source.read_armed = false;
+
+            mRearm.push_back ( fd );
+        }
+
+        if ( write )
+        {
+            // Errors and hang-ups are reported as readable so that the
+            // following read fails and the peer gets cleaned up.
+            if ( cqe.res < 0 || ( cqe.res & ( POLLERR | POLLHUP ) ) != 0 )
+                MarkReady ( fd, false );
+
+            if ( cqe.res > 0 && ( cqe.res & POLLOUT ) != 0 )
+            {
+                if ( !source.retry.empty () )
+                {
+                    std::vector< unsigned int > retry;
+
+                    retry.swap ( source.retry );
+                    Send ( fd, retry.data (), retry.size () );
+                }
+                else if ( source.write_interest )
+                {
+                    MarkReady ( fd, true );
+                }
+            }
+
+            continue;
+        }
+
+        if ( source.receiver )
+        {
+            if ( buffered )
+            {
+                source.received.push_back ( Datagram { buffer, static_cast<unsigned int> ( cqe.res ) } );
+                MarkReady ( fd, false );
+            }
+            else if ( cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED )
+            {
+                source.error = -cqe.res;
+                MarkReady ( fd, false );
+            }
+
+            continue;
+        }
+
+        if ( cqe.res < 0 || ( cqe.res & ( POLLIN | POLLERR | POLLHUP ) ) != 0 )
+            MarkReady ( fd, false );
+    }
+}
+
+void IOUringEventLoop::Sent ( const unsigned int index, const int res )
+{
+    Slot& slot = mSlots[ index ];
+
+    if ( !Active ( slot.fd ) || mSources[ slot.fd ].generation != slot.generation )
+    {
+        mFreeSlots.push_back ( index );
+        return;
+    }
+
+    Source& source = mSources[ slot.fd ];
+
+    source.sending--;
+
+    // A datagram the socket couldn't take, and those cancelled behind it,
+    // are sent again once it's writable. Others are dropped, as a failed
+    // sendmmsg() would.
+    if ( res == -EAGAIN || res == -ECANCELED )
+        source.retry.push_back ( index );
+    else
+        mFreeSlots.push_back ( index );
+
+    if ( source.sending > 0 )
+        return;
+
+    if ( !source.retry.empty () )
+    {
+        if ( !source.write_armed )
+            Arm ( slot.fd, true );
+    }
+    else if ( source.write_interest )
+    {
+        MarkReady ( slot.fd, true );
+    }
+}
+
+void IOUringEventLoop::MarkReady ( const int fd, const bool write )
+{
+    Source& source = mSources[ fd ];
+
+    if ( write )
+        source.ready_write = true;
+    else
+        source.ready_read = true;
+
+    if ( !source.listed )
+    {
+        source.listed = true;
+        mReady.push_back ( fd );
+    }
+}
+
+int IOUringEventLoop::Collect ( Event* ready, const int max )
+{
+    size_t i = 0;
+    int n = 0;
+
+    while ( i < mReady.size () && n < max )
+    {
+        Source& source = mSources[ mReady[ i++ ] ];
+
+        // Removed, or listed again further on.
+        if ( !source.listed )
+            continue;
+
+        source.listed = false;
+
+        // Both requests of a descriptor are reported as a single event,
+        // as the other backends do.
+        ready[ n ].data = source.data;
+        ready[ n ].readable = source.ready_read;
+        ready[ n ].writable = source.ready_write && source.write_interest;
+        source.ready_read = false;
+        source.ready_write = false;
+
+        if ( ready[ n ].readable || ready[ n ].writable )
+            n++;
+    }
+
+    mReady.erase ( mReady.begin (), mReady.begin () + i );
+
+    return n;
+}
+
+void IOUringEventLoop::Recycle ( const unsigned int buffer )
+{
+    struct io_uring_buf* buf = &mBufRing[ mBufTail & ( kBufferCount - 1 ) ];
+
+    buf -> addr = reinterpret_cast<uint64_t> ( &mBuffers[ buffer * kBufferSize ] );
+    buf -> len = kBufferSize;
+    buf -> bid = buffer;
+
+    mBufTail++;
+    mFreeBuffers++;
+
+    // The tail takes the place of the first entry's reserved field.
+    __atomic_store_n ( &mBufRing[ 0 ].resv, static_cast<uint16_t> ( mBufTail ), __ATOMIC_RELEASE );
+}
+
+int IOUringEventLoop::Call ()
+{
+    mCalling = true;
+
+    while ( mCalling )
+    {
+        if ( !Enter ( -1 ) )
+        {
+            mCalling = false;
+            return -EIO;
+        }
+
+        Reap ();
+    }
+
+    return mCallResult;
+}
+
+uint64_t IOUringEventLoop::Key ( const int fd, const bool write ) const
+{
+    return ( static_cast<uint64_t> ( mSources[ fd ].generation ) << 33 ) |
+           ( static_cast<uint64_t> ( write ) << 32 ) | static_cast<uint32_t> ( fd );
+}
+
+IOUringEventLoop::~IOUringEventLoop ()
+{
+    if ( mRingFd >= 0 )
+        close ( mRingFd );
+
+    if ( mSqes != MAP_FAILED )
+        munmap ( mSqes, mSqesSize );
+
+    if ( mRing != MAP_FAILED )
+        munmap ( mRing, mRingSize );
+
+    if ( mBufRing != MAP_FAILED )
+        munmap ( mBufRing, kBufferCount * sizeof ( struct io_uring_buf ) );
+}
@@ -0,0 +1,313 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _iouringeventloop_h
+#define _iouringeventloop_h
+
+#include "eventloop.h"
+#include "packetbuffer.h"
+
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <vector>
+
+/**
+ * @class IOUringEventLoop
+ * @brief io_uring based EventLoop.
+ *        Rather than waiting for UDP sockets to become ready, the loop
+ *        does their I/O itself: a multishot receive request per socket
+ *        picks buffers from a ring shared with the kernel, and datagrams
+ *        are sent by requests that are all handed to the kernel together
+ *        by Submit(). Other descriptors are watched with poll requests.
+ *        Requests are queued as they come up and handed to the kernel by
+ *        the same system call that waits for the next completions.
+ *        Only available on Linux 5.13 and later. Datagrams are received
+ *        this way from Linux 6.0 on, and through poll requests before.
+ */
+class IOUringEventLoop : public EventLoop
+{
+public:
+
+    // CTOR/DCTOR
+
+    /**
+     * @brief IOUringEventLoop object constructor.
+     * @param trigger Trigger mode used for every registered descriptor.
+     */
+    IOUringEventLoop ( Trigger trigger );
+    virtual ~IOUringEventLoop ();
+
+    // METHODS
+
+    bool Add ( const int fd, void* data );
+    void Remove ( const int fd );
+    void SetWriteInterest ( const int fd, void* data, const bool enabled );
+    int Wait ( Event* ready, const int max, const int timeout );
+    Backend GetBackend () const { return IO_URING; }
+    void Submit ();
+    bool Receives () const { return mReceives; }
+    bool AddReceiver ( const int fd, void* data );
+    int Receive ( const int fd, struct mmsghdr* msgs, const unsigned int n );
+    bool Transmits () const { return true; }
+    int Transmit ( const int fd, struct mmsghdr* msgs, const unsigned int n, const int flags );
+    int Connect ( const int fd, const struct sockaddr* addr, const socklen_t len, const int timeout );
+
+    /**
+     * @brief Retrieves the io_uring file descriptor.
+     * @return File descriptor as an integer, negative if the ring couldn't
+     *         be set up or the kernel is too old.
+     */
+    int Fd () const { return mRingFd; }
+
+private:
+
+    // TYPES
+
+    /**
+     * @struct Datagram
+     * @brief A datagram received in one of the provided buffers.
+     */
+    struct Datagram
+    {
+        unsigned int buffer;
+        unsigned int length; ///< Bytes the kernel wrote to the buffer.
+    };
+
+    /**
+     * @struct Source
+     * @brief State of a registered descriptor.
+     */
+    struct Source
+    {
+        void* data;
+        uint32_t generation; ///< Tells requests for an older descriptor with the same number apart.
+        bool active;
+        bool receiver; ///< Datagrams are received by the loop.
+        bool read_armed;
+        bool write_armed;
+        bool write_interest;
+        bool ready_read;
+        bool ready_write;
+        bool listed; ///< Waiting in mReady.
+        int error; ///< Receive error to report once the queued datagrams are taken.
+        unsigned int sending; ///< Send requests handed to the kernel and not completed yet.
+        std::deque< Datagram > received;
+        std::vector< unsigned int > retry; ///< Send slots to submit again once the socket is writable.
+    };
+
+    /**
+     * @struct Slot
+     * @brief Copy of a datagram being sent, which must outlive Transmit().
+     */
+    struct Slot
+    {
+        struct msghdr header;
+        struct iovec vector;
+        struct sockaddr_in address;
+        int fd;
+        uint32_t generation;
+        int flags;
+        char data[ PACKET_BUFFER_SIZE ];
+    };
+
+    // METHODS
+
+    /**
+     * @brief Starts monitoring a descriptor.
+     * @param fd File descriptor.
+     * @param data Pointer handed back by Wait().
+     * @param receiver True if the loop receives its datagrams.
+     * @return False if the descriptor isn't valid.
+     */
+    bool Register ( const int fd, void* data, const bool receiver );
+    /**
+     * @brief Queues a poll request for a descriptor, or the multishot
+     *        receive request of a receiver.
+     * @param fd Registered file descriptor.
+     * @param write True to watch for writability instead of incoming data.
+     */
+    void Arm ( const int fd, const bool write );
+    /**
+     * @brief Queues the cancellation of a request.
+     * @param key User data of the request.
+     */
+    void Cancel ( const uint64_t key );
+    /**
+     * @brief Queues the send requests of a sequence of slots, linked so
+     *        that they complete in order.
+     * @param fd Registered file descriptor.
+     * @param slots Indexes of the slots.
+     * @param n Number of slots.
+     */
+    void Send ( const int fd, const unsigned int* slots, const unsigned int n );
+    /**
+     * @brief Rearms the requests that completed since the last Wait().
+     */
+    void Rearm ();
+    /**
+     * @brief Retrieves a free submission queue entry, handing the queued
+     *        ones to the kernel if the queue is full.
+     * @return Pointer to a cleared submission queue entry.
+     */
+    struct io_uring_sqe* GetSqe ();
+    /**
+     * @brief Makes sure a number of requests can be queued without handing
+     *        the queued ones to the kernel in between.
+     * @param n Number of requests.
+     */
+    void Reserve ( const unsigned int n );
+    /**
+     * @brief Hands the queued requests to the kernel and optionally waits
+     *        for at least one completion.
+     * @param timeout Milliseconds to wait. A negative value waits forever,
+     *        0 doesn't wait.
+     * @return False on error.
+     */
+    bool Enter ( const int timeout );
+    /**
+     * @brief Processes the completions waiting on the ring.
+     */
+    void Reap ();
+    /**
+     * @brief Processes the completion of a send request.
+     * @param index Slot the request was sending.
+     * @param res Result of the request.
+     */
+    void Sent ( const unsigned int index, const int res );
+    /**
+     * @brief Queues a descriptor to be reported by Wait().
+     * @param fd Registered file descriptor.
+     * @param write True if it's writable, false if it's readable.
+     */
+    void MarkReady ( const int fd, const bool write );
+    /**
+     * @brief Hands out the descriptors queued by MarkReady().
+     * @param ready Array that will be filled with the ready descriptors.
+     * @param max Size of the ready array.
+     * @return Number of entries written to ready.
+     */
+    int Collect ( Event* ready, const int max );
+    /**
+     * @brief Hands a provided buffer back to the kernel.
+     * @param buffer Index of the buffer.
+     */
+    void Recycle ( const unsigned int buffer );
+    /**
+     * @brief Runs a request to completion, along with whatever was queued
+     *        with it.
+     * @return Result of the request tagged with kCall.
+     */
+    int Call ();
+    /**
+     * @brief Sets up the provided buffers and checks that the kernel can
+     *        receive datagrams into them.
+     * @return True if receivers are supported.
+     */
+    bool SetUpReceiving ();
+    /**
+     * @brief Builds the user data that identifies a request for a descriptor.
+     * @param fd Registered file descriptor.
+     * @param write True for the writability request.
+     * @return Value handed back with the request's completions.
+     */
+    uint64_t Key ( const int fd, const bool write ) const;
+    /**
+     * @brief Checks that a descriptor is registered.
+     * @param fd File descriptor.
+     * @return True if it is.
+     */
+    bool Active ( const int fd ) const
+    {
+        return fd >= 0 && static_cast<size_t> ( fd ) < mSources.size () && mSources[ fd ].active;
+    }
+
+    // VARS
+
+    int mRingFd;
+
+    void* mRing;
+    size_t mRingSize;
+    struct io_uring_sqe* mSqes;
+    size_t mSqesSize;
+
+    // Submission queue.
+    unsigned int* mSqHead;
+    unsigned int* mSqTail;
+    unsigned int* mSqFlags;
+    unsigned int* mSqArray;
+    unsigned int mSqMask;
+    unsigned int mSqEntries;
+    // Entries queued but not handed to the kernel yet end here.
+    unsigned int mSqLocalTail;
+
+    // Completion queue.
+    unsigned int* mCqHead;
+    unsigned int* mCqTail;
+    struct io_uring_cqe* mCqes;
+    unsigned int mCqMask;
+
+    // Provided buffers. The ring is handled as an array of entries: in
+    // C++, struct io_uring_buf_ring doesn't start them at offset 0.
+    bool mReceives;
+    struct io_uring_buf* mBufRing;
+    std::vector< char > mBuffers;
+    unsigned int mBufTail;
+    unsigned int mFreeBuffers;
+    // Template of the receive requests: room for the sender's address.
+    struct msghdr mRecvHeader;
+
+    // A deque, so that slots the kernel is reading from stay in place as it grows.
+    std::deque< Slot > mSlots;
+    std::vector< unsigned int > mFreeSlots;
+    // Slots handed to Send () by Transmit ().
+    std::vector< unsigned int > mTaken;
+
+    std::vector< Source > mSources;
+    // Receivers, reported again while they have datagrams queued in level triggered mode.
+    std::vector< int > mReceivers;
+    // Descriptors whose one-shot requests completed since the last Wait().
+    std::vector< int > mRearm;
+    std::vector< int > mRearming;
+    // Descriptors with events not reported yet.
+    std::vector< int > mReady;
+
+    bool mCalling;
+    int mCallResult;
+
+    const static unsigned int kEntries = 1024;
+    const static unsigned int kCompletionEntries = 4096;
+    const static unsigned int kBufferCount = 256;
+    const static unsigned int kBufferSize = sizeof ( struct io_uring_recvmsg_out ) + sizeof ( struct sockaddr_in ) + PACKET_BUFFER_SIZE;
+    const static unsigned int kBufferGroup = 0;
+    const static unsigned int kSendSlots = 256;
+    // Kind of request, in the top bits of its user data.
+    const static unsigned int kKindShift = 61;
+    const static uint64_t kWatch = 0;
+    const static uint64_t kSend = 1;
+    const static uint64_t kCall = 2;
+    // User data of requests whose completion is of no interest.
+    const static uint64_t kIgnore = ~0ULL;
+    const static uint32_t kGenerationMask = 0x0FFFFFFF;
+};
+
+#endif // _iouringeventloop_h
@@ -62,138 +62,63 @@ Log::Log ()
         std::cout << " Writing to \"" << mLogFilename << "\" as well.";
 }
 
-Log& Log::d ()
+Log::Line Log::d ()
 {
-    time_t timer;
-    char buffer[26];
-    struct tm* tm_info;
-    time(&timer);
-    tm_info = localtime(&timer);
-
-    strftime(buffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
-
-    GetLogger().mRequestedLevel = DEBUG_LVL;
-    GetLogger().mOutput = &std::cout;
-
-    if ( GetLogger().mRequestedLevel <= GetLogger().mLevel )
-    {
-        *( GetLogger().mOutput ) << "\n(D): " << std::flush;
-
-        if ( GetLogger().mFileOutputEnabled )
-        {
-            *( GetLogger().mLogFile ) << "\n(" << buffer << ") D/ " << std::flush;
-        }
-    }
-
-    return GetLogger();
+#ifdef _DEBUG
+    return Begin ( DEBUG_LVL, &std::cout, 'D' );
+#else
+    return Line ();
+#endif
 }
 
-Log& Log::e ()
+Log::Line Log::e ()
 {
-    time_t timer;
-    char buffer[26];
-    struct tm* tm_info;
-    time(&timer);
-    tm_info = localtime(&timer);
-
-    strftime(buffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
-
-    GetLogger().mRequestedLevel = ERROR_LVL;
-    GetLogger().mOutput = &std::cerr;
-
-    if ( GetLogger().mRequestedLevel <= GetLogger().mLevel )
-    {
-        *( GetLogger().mOutput ) << "\n(E): ";
-
-        if ( GetLogger().mFileOutputEnabled )
-        {
-            *( GetLogger().mLogFile ) << "\n(" << buffer << ") E/ ";
-        }
-    }
-
-    return GetLogger();
+    return Begin ( ERROR_LVL, &std::cerr, 'E' );
 }
 
-Log& Log::i ()
+Log::Line Log::i ()
 {
-    time_t timer;
-    char buffer[26];
-    struct tm* tm_info;
-    time(&timer);
-    tm_info = localtime(&timer);
-
-    strftime(buffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
-
-    GetLogger().mRequestedLevel = NORMAL_LVL;
-    GetLogger().mOutput = &std::cout;
-
-    if ( GetLogger().mRequestedLevel <= GetLogger().mLevel )
-    {
-        *( GetLogger().mOutput ) << "\n(I): ";
-
-        if ( GetLogger().mFileOutputEnabled )
-        {
-            *( GetLogger().mLogFile ) << "\n(" << buffer << ") I/ ";
-        }
-    }
-
-    return GetLogger();
+    return Begin ( NORMAL_LVL, &std::cout, 'I' );
 }
 
-Log& Log::v ()
+Log::Line Log::v ()
 {
-    time_t timer;
-    char buffer[26];
-    struct tm* tm_info;
-    time(&timer);
-    tm_info = localtime(&timer);
-
-    strftime(buffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
-
-    GetLogger().mRequestedLevel = VERBOSE_LVL;
-    GetLogger().mOutput = &std::cout;
-
-    if ( GetLogger().mRequestedLevel <= GetLogger().mLevel )
-    {
-        *( GetLogger().mOutput ) << "\n(V): ";
-
-        if ( GetLogger().mFileOutputEnabled )
-        {
-            *( GetLogger().mLogFile ) << "\n(" << buffer << ") V/ ";
-        }
-    }
+    return Begin ( VERBOSE_LVL, &std::cout, 'V' );
+}
 
-    return GetLogger();
+Log::Line Log::w ()
+{
+    return Begin ( WARNING_LVL, GetLogger().mTreatWarningsAsErrors ? &std::cerr : &std::cout, 'W' );
 }
 
-Log& Log::w ()
+Log::Line Log::Begin ( const enum OutputLevel level, std::ostream* output, const char tag )
 {
-    time_t timer;
-    char buffer[26];
-    struct tm* tm_info;
-    time(&timer);
-    tm_info = localtime(&timer);
+    // Disabled messages cost a comparison, without taking the lock or
+    // reading the clock.
+    if ( !Enabled ( level ) )
+        return Line ();
 
-    strftime(buffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+    Line line ( GetLogger () );
 
-    GetLogger().mRequestedLevel = WARNING_LVL;
+    GetLogger().mRequestedLevel = level;
+    GetLogger().mOutput = output;
 
-    if ( GetLogger().mTreatWarningsAsErrors )
-        GetLogger().mOutput = &std::cerr;
-    else
-        GetLogger().mOutput = &std::cout;
+    *( GetLogger().mOutput ) << "\n(" << tag << "): ";
 
-    if ( GetLogger().mRequestedLevel <= GetLogger().mLevel )
+    if ( GetLogger().mFileOutputEnabled )
     {
-        *( GetLogger().mOutput ) << "\n(W): ";
+        time_t timer;
+        char buffer[26];
+        struct tm* tm_info;
+        time(&timer);
+        tm_info = localtime(&timer);
 
-        if ( GetLogger().mFileOutputEnabled )
-        {
-            *( GetLogger().mLogFile ) << "\n(" << buffer << ") W/ ";
-        }
+        strftime(buffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+
+        *( GetLogger().mLogFile ) << "\n(" << buffer << ") " << tag << "/ ";
     }
 
-    return GetLogger();
+    return line;
 }
 
 Log& Log::operator<< ( const char &log )
@@ -23,6 +23,7 @@
 #include <fstream>
 #include <string.h>
 #include <locale>
+#include <mutex>
 
 /**
  * @class Log
@@ -59,6 +60,40 @@ private:
     
 public:
 
+    /**
+     * @class Line
+     * @brief A single log message.
+     *        Holds the logger's lock until the end of the statement that
+     *        outputs the message, so that messages logged at the same time
+     *        by different threads don't get mixed up.
+     */
+    class Line
+    {
+    public:
+        /**
+         * @brief Line constructor. Blocks until no other message is being logged.
+         * @param log Logger that outputs the message.
+         */
+        Line ( Log& log ) : mLog ( &log ), mLock ( log.mMutex ) {}
+        /**
+         * @brief Line constructor for messages whose level is disabled.
+         *        Outputs nothing and doesn't lock the logger.
+         */
+        Line () : mLog ( NULL ) {}
+
+        /**
+         * @brief Outputs data to the log.
+         * @param log Data to output in the log.
+         * @return Line object that was used to perform the task.
+         */
+        template<class T>
+        Line& operator<< ( const T &log ) { if ( mLog != NULL ) *mLog << log; return *this; }
+
+    private:
+        Log* mLog;
+        std::unique_lock< std::recursive_mutex > mLock;
+    };
+
 #ifndef NO_WSTRING
     /**
      * @brief std::codecvt implementation with a public destructor.
@@ -109,32 +144,39 @@ public:
      * @return Log::OutputLevel value of the corresponding level.
      */
     static OutputLevel GetOutputLevel () { return GetLogger().mLevel; }
+    /**
+     * @brief Used to check whether messages of a given level are output.
+     * @param level Level of the messages.
+     * @return True if the messages are output.
+     */
+    static bool Enabled ( const enum OutputLevel level ) { return level <= GetLogger().mLevel; }
 
     /**
      * @brief Used to output debugging messages.
-     * @return Log object ready to output debugging messages.
+     *        Prefer LOG_DEBUG, which doesn't evaluate the message either.
+     * @return Line object ready to output debugging messages.
      */
-    static Log& d ();
+    static Line d ();
     /**
      * @brief Used to output error messages.
-     * @return Log object ready to output error messages.
+     * @return Line object ready to output error messages.
      */
-    static Log& e ();
+    static Line e ();
     /**
      * @brief Used to output general information messages.
-     * @return Log object ready to output general information messages.
+     * @return Line object ready to output general information messages.
      */
-    static Log& i ();
+    static Line i ();
     /**
      * @brief Used to output more verbose messages.
-     * @return Log object ready to output more verbose messages.
+     * @return Line object ready to output more verbose messages.
      */
-    static Log& v ();
+    static Line v ();
     /**
      * @brief Used to output warning messages.
-     * @return Log object ready to output warning messages.
+     * @return Line object ready to output warning messages.
      */
-    static Log& w ();
+    static Line w ();
 
     /**
      * @brief Used to output characters to the log.
@@ -256,6 +298,16 @@ private:
      * @return A standard string object.
      */
     static std::string ReadUTF32 ( char* s, int n );
+    /**
+     * @brief Starts a message, unless its level is disabled.
+     *        The time stamp is only formatted if the message is written
+     *        to the log file.
+     * @param level Level of the message.
+     * @param output Stream the message is printed to.
+     * @param tag Letter identifying the level in the output.
+     * @return Line object ready to output the message.
+     */
+    static Line Begin ( const enum OutputLevel level, std::ostream* output, const char tag );
 
     /**
      * @brief The default verbosity of the log functions.
@@ -278,6 +330,8 @@ private:
     
     std::ostream *mOutput;
     std::ofstream *mLogFile;
+
+    std::recursive_mutex mMutex;
     
     enum OutputLevel mLevel;
     enum OutputLevel mRequestedLevel;
@@ -288,4 +342,16 @@ private:
     bool mTreatWarningsAsErrors;
 };
 
+/**
+ * @brief Outputs a debugging message, e.g.: LOG_DEBUG ( "Sent " << n << " bytes." );
+ *        The message is only evaluated if debugging messages are enabled.
+ *        Only _DEBUG builds can enable them, so other builds leave the
+ *        messages out altogether.
+ */
+#ifdef _DEBUG
+    #define LOG_DEBUG(message) do { if ( Log::Enabled ( Log::DEBUG_LVL ) ) Log::d () << message; } while ( 0 )
+#else
+    #define LOG_DEBUG(message) do {} while ( 0 )
+#endif
+
 #endif // _log_h
@@ -32,6 +32,7 @@ int main(int argc, char **argv)
 {
     ACSRelay *relay;
     Configuration *config;
+    std::list<Configuration::RelayParams> servers;
 
 #ifdef _WIN32
     // If we're running on Windows we must
@@ -44,12 +45,18 @@ int main(int argc, char **argv)
     config -> ReadParameters ( argc, argv );
     config -> ReadSettingsFile ();
 
-    relay = ACSRelay::Build ( config -> RelayConfiguration() );
-    
+    servers = config -> Servers ();
+
     Log::i() << SW_NAME << " v" << SW_VERSION;
-    Log::d() << "Debug version"; // This will only get logged if we're running a debug version.
-    
+    LOG_DEBUG ( "Debug version" ); // This will only get logged if we're running a debug version.
+
     delete config;
+
+    // Many servers are served by a single thread, on a single event loop.
+    if ( servers.size () > 1 )
+        ACSRelay::Serve ( servers );
+
+    relay = ACSRelay::Build ( servers.front () );
     
     relay -> Start ();
     
@@ -0,0 +1,78 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "notifier.h"
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+Notifier::Notifier ()
+{
+    mFds[ 0 ] = mFds[ 1 ] = -1;
+
+#ifndef _WIN32
+    if ( pipe ( mFds ) < 0 )
+    {
+        mFds[ 0 ] = mFds[ 1 ] = -1;
+        return;
+    }
+
+    // Neither end may ever block: a full pipe already means the
+    // reader has been notified, and Clear() reads until it's empty.
+    for ( int i = 0; i < 2; i++ )
+    {
+        fcntl ( mFds[ i ], F_SETFL, fcntl ( mFds[ i ], F_GETFL ) | O_NONBLOCK );
+        fcntl ( mFds[ i ], F_SETFD, FD_CLOEXEC );
+    }
+#endif
+}
+
+void Notifier::Notify ()
+{
+#ifndef _WIN32
+    char c = 0;
+
+    if ( write ( mFds[ 1 ], &c, 1 ) < 0 )
+    {
+        // The pipe is full, so the reader will wake up anyway.
+    }
+#endif
+}
+
+void Notifier::Clear ()
+{
+#ifndef _WIN32
+    char buffer[ 64 ];
+
+    while ( read ( mFds[ 0 ], buffer, sizeof ( buffer ) ) > 0 );
+#endif
+}
+
+Notifier::~Notifier ()
+{
+#ifndef _WIN32
+    for ( int i = 0; i < 2; i++ )
+    {
+        if ( mFds[ i ] >= 0 )
+            close ( mFds[ i ] );
+    }
+#endif
+}
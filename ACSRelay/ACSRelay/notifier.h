@@ -0,0 +1,69 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _notifier_h
+#define _notifier_h
+
+/**
+ * @class Notifier
+ * @brief Wakes up a thread that is waiting in an EventLoop.
+ *        Its file descriptor becomes readable when Notify() is called
+ *        and stays that way until Clear() is called.
+ *        Not available on Windows, where Valid() always returns false.
+ */
+class Notifier
+{
+public:
+
+    // CTOR/DCTOR
+
+    Notifier ();
+    virtual ~Notifier ();
+
+    // METHODS
+
+    /**
+     * @brief Makes the file descriptor readable. Can be called from any thread.
+     */
+    void Notify ();
+    /**
+     * @brief Makes the file descriptor not readable anymore.
+     *        Must be called before looking for the work that Notify()
+     *        announced, so that no notification gets lost.
+     */
+    void Clear ();
+    /**
+     * @brief Retrieves the file descriptor to be monitored by an EventLoop.
+     * @return File descriptor as an integer.
+     */
+    int Fd () const { return mFds[ 0 ]; }
+    /**
+     * @brief Checks if the notifier could be created.
+     * @return False if the notifier can't be used.
+     */
+    bool Valid () const { return mFds[ 0 ] >= 0; }
+
+private:
+
+    // VARS
+
+    int mFds[ 2 ];
+};
+
+#endif // _notifier_h
@@ -0,0 +1,60 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "packetbuffer.h"
+#include "bufferpool.h"
+
+#include <new>
+#include <string.h>
+
+PacketBuffer* PacketBuffer::Acquire ( const size_t capacity )
+{
+    void* block = BufferPool::Allocate ( sizeof ( PacketBuffer ) + capacity );
+
+    return new ( block ) PacketBuffer ( capacity );
+}
+
+PacketBuffer* PacketBuffer::Fit ()
+{
+    PacketBuffer* copy;
+    size_t small = BufferPool::ClassSize ( BufferPool::SMALL ) - sizeof ( PacketBuffer );
+
+    if ( mCapacity <= small || static_cast<size_t> ( mLength ) > small )
+    {
+        Retain ();
+        return this;
+    }
+
+    copy = Acquire ( small );
+    memcpy ( copy -> Data (), Data (), mLength );
+    copy -> SetLength ( mLength );
+
+    return copy;
+}
+
+void PacketBuffer::Release ()
+{
+    // Whoever drops the last reference must see everything the other
+    // holders did with the buffer before reusing it.
+    if ( mReferences.fetch_sub ( 1, std::memory_order_acq_rel ) != 1 )
+        return;
+
+    this -> ~PacketBuffer ();
+    BufferPool::Free ( this );
+}
@@ -0,0 +1,119 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _packetbuffer_h
+#define _packetbuffer_h
+
+#include <atomic>
+#include <stddef.h>
+
+#define PACKET_BUFFER_SIZE 1024
+
+/**
+ * @class PacketBuffer
+ * @brief Reference counted buffer holding a single message.
+ *        Sockets read straight into it, and it is then handed to as many
+ *        peers as needed without being copied. Each holder calls Retain()
+ *        when it keeps the buffer and Release() when it's done with it.
+ *        The last Release() returns the buffer to the BufferPool, so buffers
+ *        are only allocated while traffic is growing.
+ *
+ *        The message is stored right after the buffer itself, in a block
+ *        from the smallest size class of the pool that can hold it.
+ *
+ *        Buffers may be retained and released from any thread.
+ */
+class PacketBuffer
+{
+public:
+
+    // CTOR
+
+    /**
+     * @brief Takes a buffer from the BufferPool.
+     * @param capacity Maximum size of the message the buffer will hold.
+     * @return Pointer to an empty buffer with a single reference, held by the caller.
+     */
+    static PacketBuffer* Acquire ( const size_t capacity = PACKET_BUFFER_SIZE );
+
+    // METHODS
+
+    /**
+     * @brief Adds a reference to the buffer.
+     */
+    void Retain () { mReferences.fetch_add ( 1, std::memory_order_relaxed ); }
+    /**
+     * @brief Drops a reference to the buffer. The buffer must not be used
+     *        by the caller anymore.
+     */
+    void Release ();
+    /**
+     * @brief Checks if somebody else holds a reference to the buffer.
+     * @return True if the buffer can't be reused by the caller.
+     */
+    bool Shared () const { return mReferences.load ( std::memory_order_acquire ) > 1; }
+    /**
+     * @brief Gets a buffer no bigger than the message needs. Messages that fit
+     *        a small buffer are copied to one, so that big buffers don't sit in
+     *        the peers' queues holding a few dozen bytes each.
+     * @return Pointer to a buffer holding the same message (this buffer, or
+     *         a copy of it) with a reference held by the caller.
+     */
+    PacketBuffer* Fit ();
+
+    /**
+     * @brief Retrieves the message held by the buffer.
+     * @return Pointer to the message's bytes.
+     */
+    char* Data () { return reinterpret_cast<char*> ( this + 1 ); }
+    const char* Data () const { return reinterpret_cast<const char*> ( this + 1 ); }
+    /**
+     * @brief Retrieves the size of the message held by the buffer.
+     * @return Size of the message.
+     */
+    long Length () const { return mLength; }
+    /**
+     * @brief Sets the size of the message held by the buffer.
+     * @param length Size of the message.
+     */
+    void SetLength ( const long length ) { mLength = length; }
+    /**
+     * @brief Retrieves the maximum size of a message.
+     * @return Size of the buffer.
+     */
+    size_t Capacity () const { return mCapacity; }
+
+private:
+
+    // CTOR
+
+    PacketBuffer ( const size_t capacity ) : mReferences ( 1 ), mLength ( 0 ), mCapacity ( capacity ) {}
+    ~PacketBuffer () {}
+
+    PacketBuffer ( PacketBuffer const& ) = delete;
+    void operator= ( PacketBuffer const& ) = delete;
+
+    // VARS
+
+    std::atomic< int > mReferences;
+    long mLength;
+    size_t mCapacity;
+};
+
+#endif // _packetbuffer_h
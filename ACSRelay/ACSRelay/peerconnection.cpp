@@ -20,6 +20,7 @@
 #include "peerconnection.h"
 
 #include "udpsocket.h"
+#include "ACSProtocol.h"
 
 PeerConnection::PeerConnection ( const std::string name, const std::string host, const unsigned int local_port, const unsigned int remote_port )
 {
@@ -27,11 +28,25 @@ PeerConnection::PeerConnection ( const std::string name, const std::string host,
     mSocket = new UDPSocket ( host, local_port, remote_port );
     
     mCarUpdateInterval = 0;
+    mSubscriptions.set ();
+    mCarFilter = ~static_cast<uint64_t> ( 0 );
+    mDueCarUpdates = 0;
     
     for ( unsigned short i = 0; i < 64; i += 1 )
     {
-        mRequestedCarInfo[ i ] = mRequestedSessionInfo[ i ] = false;
+        mRequestedCarInfo[ i ] = false;
+
+        mCarTimers[ i ].peer = this;
+        mCarTimers[ i ].cid = i;
+        mCarTimers[ i ].armed = false;
+    }
+
+    for ( unsigned short i = 0; i < 65; i += 1 )
+    {
+        mRequestedSessionInfo[ i ] = false;
     }
+
+    ResetSendQueue ();
 }
 
 PeerConnection::PeerConnection ( const std::string name, Socket* socket )
@@ -40,31 +55,284 @@ PeerConnection::PeerConnection ( const std::string name, Socket* socket )
     mSocket = socket;
     
     mCarUpdateInterval = 0;
+    mSubscriptions.set ();
+    mCarFilter = ~static_cast<uint64_t> ( 0 );
+    mDueCarUpdates = 0;
     
     for ( unsigned short i = 0; i < 64; i += 1 )
     {
-        mRequestedCarInfo[ i ] = mRequestedSessionInfo[ i ] = false;
+        mRequestedCarInfo[ i ] = false;
+
+        mCarTimers[ i ].peer = this;
+        mCarTimers[ i ].cid = i;
+        mCarTimers[ i ].armed = false;
+    }
+
+    for ( unsigned short i = 0; i < 65; i += 1 )
+    {
+        mRequestedSessionInfo[ i ] = false;
+    }
+
+    ResetSendQueue ();
+}
+
+void PeerConnection::SetCarUpdateDue ( const short cid, const bool due )
+{
+    if ( cid < 0 || cid >= 64 )
+        return;
+
+    if ( due )
+        mDueCarUpdates |= static_cast<uint64_t> ( 1 ) << cid;
+    else
+        mDueCarUpdates &= ~( static_cast<uint64_t> ( 1 ) << cid );
+}
+
+void PeerConnection::ResetSendQueue ()
+{
+    mQueuedUpdates = 0;
+    mSendQueueSize = kDefaultSendQueueSize;
+    mSendQueueHighWater = kDefaultSendQueueSize;
+    mAboveHighWaterSince = Time ();
+    mWatchingWrite = false;
+    mDroppedUpdates = mDroppedMessages = 0;
+
+    for ( unsigned short i = 0; i < 64; i += 1 )
+    {
+        mLatestUpdate[ i ] = NULL;
+    }
+}
+
+void PeerConnection::SetSendQueueLimits ( const size_t size, const size_t high_water )
+{
+    mSendQueueSize = size < 1 ? 1 : size;
+    mSendQueueHighWater = high_water < mSendQueueSize ? high_water : mSendQueueSize;
+}
+
+void PeerConnection::Send ( PacketBuffer* packet )
+{
+    packet -> Retain ();
+
+    // Once something is waiting in the send queue, everything else
+    // has to wait behind it.
+    if ( !mSendQueue.empty () )
+    {
+        Enqueue ( packet );
+        return;
+    }
+
+    if ( mSocket -> Queue ( packet -> Data (), packet -> Length () ) < 0 && Socket::WouldBlock () )
+    {
+        // Whatever the socket still holds was queued before this message.
+        ForgetSent ();
+        KeepUnsent ();
+        Enqueue ( packet );
+        return;
+    }
+
+    // The socket only refers to the buffer, so keep it alive for as
+    // long as the socket hasn't sent it.
+    mSocketQueue.push_back ( packet );
+    ForgetSent ();
+}
+
+void PeerConnection::Flush ()
+{
+    unsigned int sent;
+
+    sent = mSocket -> Flush ();
+
+    for ( unsigned int i = 0; i < sent; i++ )
+    {
+        mSocketQueue[ i ] -> Release ();
+    }
+
+    mSocketQueue.erase ( mSocketQueue.begin (), mSocketQueue.begin () + sent );
+
+    KeepUnsent ();
+}
+
+void PeerConnection::ForgetSent ()
+{
+    size_t sent;
+
+    // The socket may have sent some (or all) of its queue while queueing
+    // another message. Whatever it still holds is at the end of ours.
+    sent = mSocketQueue.size () - mSocket -> Queued ();
+
+    for ( size_t i = 0; i < sent; i++ )
+    {
+        mSocketQueue[ i ] -> Release ();
     }
+
+    mSocketQueue.erase ( mSocketQueue.begin (), mSocketQueue.begin () + sent );
 }
 
-void PeerConnection::CarUpdateArrived ( const short cid, Time time )
+void PeerConnection::KeepUnsent ()
 {
-    mLastUpdate[ cid ] = time;
+    for ( auto p = mSocketQueue.begin (); p != mSocketQueue.end (); ++p )
+    {
+        Enqueue ( *p );
+    }
+
+    mSocketQueue.clear ();
+    mSocket -> ClearQueue ();
 }
 
-bool PeerConnection::IsWaitingCarUpdate ( const short cid, Time time )
+bool PeerConnection::SendQueued ()
 {
-    if ( mCarUpdateInterval == 0 )
+    PacketBuffer* packet;
+
+    if ( !mSocket -> SendUnsent () )
         return false;
-    
-    Ms time_since_update;
-    
-    time_since_update = std::chrono::duration_cast< Ms > ( time - mLastUpdate[ cid ] );
-    
-    return ( time_since_update.count () >= kUpdateIntervalPrecision * mCarUpdateInterval );
+
+    while ( !mSendQueue.empty () )
+    {
+        packet = QueuedPacket ( mSendQueue.front () );
+
+        if ( mSocket -> Send ( packet -> Data (), packet -> Length () ) < 0 )
+        {
+            if ( Socket::WouldBlock () )
+                break;
+
+            // The message can't be sent at all. Don't let it block the rest.
+            mDroppedMessages += 1;
+        }
+
+        Dequeued ( mSendQueue.front () );
+        mSendQueue.pop_front ();
+    }
+
+    if ( mSendQueue.size () <= mSendQueueHighWater )
+        mAboveHighWaterSince = Time ();
+
+    return !WantsWrite ();
+}
+
+void PeerConnection::Preload ( PacketBuffer* packet )
+{
+    packet -> Retain ();
+    Enqueue ( packet );
+}
+
+void PeerConnection::Enqueue ( PacketBuffer* packet )
+{
+    bool update = ( packet -> Length () > 0 && static_cast<int8_t> ( packet -> Data ()[ 0 ] ) == ACSProtocol::ACSP_CAR_UPDATE );
+    QueuedMessage message;
+
+    message.packet = packet;
+    message.cid = -1;
+
+    if ( update && packet -> Length () >= 2 )
+    {
+        message.cid = static_cast<int8_t> ( packet -> Data ()[ 1 ] );
+
+        // Updates about a car nobody could be driving aren't worth a slot.
+        if ( message.cid < 0 || message.cid >= 64 )
+            message.cid = -1;
+    }
+
+    // The previous update about the car is stale, and still waiting.
+    // Take its place so the peer gets the freshest position once it
+    // catches up.
+    if ( message.cid >= 0 && mLatestUpdate[ message.cid ] != NULL )
+    {
+        mLatestUpdate[ message.cid ] -> Release ();
+        mLatestUpdate[ message.cid ] = packet;
+        mDroppedUpdates += 1;
+        mDroppedMessages += 1;
+        return;
+    }
+
+    if ( mSendQueue.size () >= mSendQueueSize )
+    {
+        // Car updates are the only messages we're allowed to lose, and the
+        // oldest ones are the least useful. Chat, session and connection
+        // events always get through; a peer that can't keep up with those
+        // will stay above the high-water mark and end up disconnected.
+        if ( mQueuedUpdates > 0 )
+        {
+            for ( auto m = mSendQueue.begin (); m != mSendQueue.end (); ++m )
+            {
+                if ( static_cast<int8_t> ( QueuedPacket ( *m ) -> Data ()[ 0 ] ) == ACSProtocol::ACSP_CAR_UPDATE )
+                {
+                    Dequeued ( *m );
+                    mSendQueue.erase ( m );
+                    mDroppedUpdates += 1;
+                    mDroppedMessages += 1;
+                    break;
+                }
+            }
+        }
+        else if ( update )
+        {
+            packet -> Release ();
+            mDroppedUpdates += 1;
+            mDroppedMessages += 1;
+            return;
+        }
+
+        // Otherwise there's nothing we may drop, so the queue grows
+        // past its limit.
+    }
+
+    if ( message.cid >= 0 )
+    {
+        mLatestUpdate[ message.cid ] = packet;
+        message.packet = NULL;
+    }
+
+    mSendQueue.push_back ( message );
+
+    if ( update )
+        mQueuedUpdates += 1;
+
+    if ( mSendQueue.size () > mSendQueueHighWater && mAboveHighWaterSince == Time () )
+        mAboveHighWaterSince = Clock::now ();
+}
+
+void PeerConnection::Dequeued ( const QueuedMessage& message )
+{
+    QueuedPacket ( message ) -> Release ();
+
+    if ( message.packet == NULL )
+        mLatestUpdate[ message.cid ] = NULL;
+
+    if ( message.packet == NULL || ( message.packet -> Length () > 0 && static_cast<int8_t> ( message.packet -> Data ()[ 0 ] ) == ACSProtocol::ACSP_CAR_UPDATE ) )
+        mQueuedUpdates -= 1;
+}
+
+bool PeerConnection::IsStalled ( const Time now, const unsigned int timeout ) const
+{
+    if ( mSendQueue.size () >= 2 * mSendQueueSize )
+        return true;
+
+    if ( timeout == 0 || mAboveHighWaterSince == Time () )
+        return false;
+
+    return std::chrono::duration_cast< std::chrono::seconds > ( now - mAboveHighWaterSince ).count () >= timeout;
+}
+
+void PeerConnection::ClearSendQueue ()
+{
+    mDroppedMessages += mSendQueue.size ();
+
+    for ( auto p = mSendQueue.begin (); p != mSendQueue.end (); ++p )
+    {
+        Dequeued ( *p );
+    }
+
+    mSendQueue.clear ();
+    mAboveHighWaterSince = Time ();
 }
 
 PeerConnection::~PeerConnection()
 {
+    for ( auto p = mSocketQueue.begin (); p != mSocketQueue.end (); ++p )
+    {
+        ( *p ) -> Release ();
+    }
+
+    ClearSendQueue ();
+
     delete mSocket;
 }
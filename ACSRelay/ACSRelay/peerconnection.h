@@ -21,9 +21,14 @@
 #define _peerconnection_h
 
 #include <chrono>
+#include <deque>
 #include <string>
+#include <vector>
 
 #include <socket.h>
+#include "ACSProtocol.h"
+#include "carupdatescheduler.h"
+#include "packetbuffer.h"
 
 typedef std::chrono::high_resolution_clock Clock;
 typedef std::chrono::time_point<Clock> Time;
@@ -59,7 +64,7 @@ public:
     /**
      * @brief Implicit PluginHandler object constructor
      */
-    PeerConnection () { mSocket = NULL; mCarUpdateInterval = 0; }
+    PeerConnection () { mSocket = NULL; mCarUpdateInterval = 0; mDueCarUpdates = 0; ResetSendQueue (); }
     virtual ~PeerConnection();
     
     /**
@@ -90,65 +95,248 @@ public:
      */
     void SetCarUpdateInterval ( const long ri ) { mCarUpdateInterval = ri; }
     
+    /**
+     * @brief Checks if the peer wants server messages of a type that every peer may get.
+     * @param type Packet type.
+     * @return True if the peer subscribed to that type.
+     */
+    bool IsSubscribed ( const uint8_t type ) const { return mSubscriptions.test ( type ); }
+    /**
+     * @brief Retrieves the types of server messages the peer subscribed to.
+     * @return Mask of packet types.
+     */
+    const ACSProtocol::TypeMask& Subscriptions () const { return mSubscriptions; }
+    /**
+     * @brief Sets the types of server messages the peer subscribed to. Only
+     *        applies to messages that aren't answers to the peer's requests.
+     *        Peers subscribe to every type by default.
+     * @param subscriptions Mask of packet types.
+     */
+    void SetSubscriptions ( const ACSProtocol::TypeMask& subscriptions ) { mSubscriptions = subscriptions; }
+
+    /**
+     * @brief Checks if the peer wants realtime updates about a car.
+     * @param cid Car ID as represented in Assetto Corsa.
+     * @return True if the car is in the peer's car filter.
+     */
+    bool WantsCar ( const short cid ) const { return cid >= 0 && cid < 64 && ( mCarFilter >> cid & 1 ); }
+    /**
+     * @brief Restricts the realtime car updates sent to the peer to a set of cars.
+     *        Peers get updates about every car by default.
+     * @param filter Mask with bit N set for car ID N.
+     */
+    void SetCarFilter ( const uint64_t filter ) { mCarFilter = filter; }
+
     /**
      * @brief Checks if the plugin is waiting for an ACSP_CAR_INFO packet.
      * @param cid Car ID as represented in Assetto Corsa.
      * @return Boolean telling if the plugin expects a new packet.
      */
-    bool IsWaitingCarInfo ( const short cid ) const { return mRequestedCarInfo[ cid ]; }
+    bool IsWaitingCarInfo ( const short cid ) const { return cid >= 0 && cid < 64 && mRequestedCarInfo[ cid ]; }
     /**
      * @brief Requests an ACSP_CAR_INFO packet for the specified car ID.
      * @param cid Car ID as represented in Assetto Corsa.
      */
-    void RequestCarInfo ( const short cid ) { mRequestedCarInfo[ cid ] = true; }
+    void RequestCarInfo ( const short cid ) { if ( cid >= 0 && cid < 64 ) mRequestedCarInfo[ cid ] = true; }
     /**
      * @brief Notifies the arrival of an ACSP_CAR_INFO packet.
      * @param cid Car ID as represented in Assetto Corsa.
      */
-    void CarInfoArrived ( const short cid ) { mRequestedCarInfo[ cid ] = false; }
+    void CarInfoArrived ( const short cid ) { if ( cid >= 0 && cid < 64 ) mRequestedCarInfo[ cid ] = false; }
     
     /**
      * @brief Checks if the plugin is waiting for an ACSP_SESSION_INFO packet.
-     * @param sid Session ID as represented in Assetto Corsa.
+     * @param sid Session index as represented in Assetto Corsa, -1 for the current session.
      * @return Boolean telling if the plugin expects a new packet.
      */
-    bool IsWaitingSessionInfo ( const short sid ) const { return mRequestedSessionInfo[ sid ]; }
+    bool IsWaitingSessionInfo ( const short sid ) const { return sid >= -1 && sid < 64 && mRequestedSessionInfo[ sid + 1 ]; }
     /**
-     * @brief Requests an ACSP_SESSION_INFO packet for the specified car ID.
-     * @param sid Session ID as represented in Assetto Corsa.
+     * @brief Requests an ACSP_SESSION_INFO packet for the specified session.
+     * @param sid Session index as represented in Assetto Corsa, -1 for the current session.
      */
-    void RequestSessionInfo ( const short sid ) { mRequestedSessionInfo[ sid ] = true; }
+    void RequestSessionInfo ( const short sid ) { if ( sid >= -1 && sid < 64 ) mRequestedSessionInfo[ sid + 1 ] = true; }
     /**
      * @brief Notifies the arrival of an ACSP_SESSION_INFO packet.
-     * @param sid Session ID as represented in Assetto Corsa.
+     * @param sid Session index as represented in Assetto Corsa, -1 for the current session.
      */
-    void SessionInfoArrived ( const short sid ) { mRequestedSessionInfo[ sid ] = false; }
+    void SessionInfoArrived ( const short sid ) { if ( sid >= -1 && sid < 64 ) mRequestedSessionInfo[ sid + 1 ] = false; }
     
     /**
-     * @brief Checks if the plugin is waiting for an ACSP_CAR_UPDATE packet.
+     * @brief Checks if the plugin is due an ACSP_CAR_UPDATE packet about a car.
      * @param cid Car ID as represented in Assetto Corsa.
      * @return Boolean telling if the plugin expects a new update.
      */
-    bool IsWaitingCarUpdate ( const short cid, Time time );
+    bool IsCarUpdateDue ( const short cid ) const { return cid >= 0 && cid < 64 && ( mDueCarUpdates >> cid & 1 ); }
     /**
-     * @brief Notifies the arrival of an ACSP_CAR_UPDATE packet.
+     * @brief Marks a car as due (or not) an update. Set by the CarUpdateScheduler.
      * @param cid Car ID as represented in Assetto Corsa.
+     * @param due True if the plugin expects a new update.
+     */
+    void SetCarUpdateDue ( const short cid, const bool due );
+    /**
+     * @brief Retrieves the timer scheduling the updates about a car.
+     * @param cid Car ID between 0 and 63.
+     * @return Pointer to the timer.
      */
-    void CarUpdateArrived ( const short cid, Time time );
+    CarUpdateScheduler::Timer* CarTimer ( const short cid ) { return &mCarTimers[ cid ]; }
+
+    /**
+     * @brief Sends a message to the peer without ever blocking.
+     *        Datagram sockets only queue the message until Flush() is
+     *        called. Messages the socket can't take right away are kept in
+     *        the peer's send queue, subject to the overflow policy.
+     *        The peer holds a reference to the buffer for as long as it
+     *        needs it, so the message is never copied.
+     * @param packet Pointer to the buffer holding the message.
+     */
+    void Send ( PacketBuffer* packet );
+    /**
+     * @brief Adds a message to the send queue of a peer that isn't served yet.
+     *        It's sent as soon as the peer's PeerGroup takes it.
+     * @param packet Pointer to the buffer holding the message. The peer keeps
+     *        its own reference to it.
+     */
+    void Preload ( PacketBuffer* packet );
+    /**
+     * @brief Sends the messages queued on the socket by Send().
+     *        Those that would block are moved to the send queue.
+     */
+    void Flush ();
+    /**
+     * @brief Sends as much of the send queue as the socket will take.
+     * @return True if everything was sent.
+     */
+    bool SendQueued ();
+    /**
+     * @brief Checks if anything is waiting for the socket to become writable.
+     * @return True if the send queue (or a partially sent message) isn't empty.
+     */
+    bool WantsWrite () const { return !mSendQueue.empty () || mSocket -> HasUnsent (); }
+    /**
+     * @brief Checks if the event loop reports when the socket is writable.
+     * @return True if write interest is enabled for the peer's socket.
+     */
+    bool IsWatchingWrite () const { return mWatchingWrite; }
+    /**
+     * @brief Takes note of the event loop's write interest for the peer's socket.
+     * @param watching True if write interest is enabled.
+     */
+    void SetWatchingWrite ( const bool watching ) { mWatchingWrite = watching; }
+    /**
+     * @brief Sets the limits of the send queue.
+     * @param size Maximum number of queued messages. Only messages that
+     *        may never be dropped can go beyond it.
+     * @param high_water Number of queued messages above which the peer is
+     *        considered to be stalling.
+     */
+    void SetSendQueueLimits ( const size_t size, const size_t high_water );
+    /**
+     * @brief Checks if the peer has been above the high-water mark for too long.
+     * @param now Current time.
+     * @param timeout Number of seconds allowed above the high-water mark.
+     *        Zero means the peer only stalls if the send queue reaches
+     *        twice its maximum size.
+     * @return True if the peer should be disconnected.
+     */
+    bool IsStalled ( const Time now, const unsigned int timeout ) const;
+    /**
+     * @brief Drops every message in the send queue.
+     */
+    void ClearSendQueue ();
+    /**
+     * @brief Retrieves the number of messages waiting in the send queue.
+     * @return Number of messages.
+     */
+    size_t QueueDepth () const { return mSendQueue.size (); }
+    /**
+     * @brief Retrieves the number of ACSP_CAR_UPDATE packets dropped because the send queue was
+     *        full or a newer update about the same car replaced them.
+     * @return Number of dropped packets.
+     */
+    unsigned long DroppedUpdates () const { return mDroppedUpdates; }
+    /**
+     * @brief Retrieves the number of packets dropped for any reason.
+     * @return Number of dropped packets.
+     */
+    unsigned long DroppedMessages () const { return mDroppedMessages; }
 private:
+    // TYPES
+
+    /**
+     * @brief Entry of the send queue. Car updates don't hold a buffer:
+     *        they stand for whatever is in the car's latest-update slot.
+     */
+    struct QueuedMessage
+    {
+        PacketBuffer* packet;
+        short cid;
+    };
+
+    // METHODS
+
+    /**
+     * @brief Sets the initial state of the send queue.
+     */
+    void ResetSendQueue ();
+    /**
+     * @brief Adds a message to the send queue, applying the overflow policy.
+     *        A car update replaces the one still waiting for the same car,
+     *        keeping its place in the queue.
+     *        The send queue takes over the caller's reference to the buffer.
+     * @param packet Pointer to the buffer holding the message.
+     */
+    void Enqueue ( PacketBuffer* packet );
+    /**
+     * @brief Retrieves the buffer a send queue entry stands for.
+     * @param message Send queue entry.
+     * @return Pointer to the buffer holding the message.
+     */
+    PacketBuffer* QueuedPacket ( const QueuedMessage& message ) const { return message.packet != NULL ? message.packet : mLatestUpdate[ message.cid ]; }
+    /**
+     * @brief Drops the buffer of a send queue entry that is being removed.
+     * @param message Send queue entry.
+     */
+    void Dequeued ( const QueuedMessage& message );
+    /**
+     * @brief Drops the references to the messages the socket has sent, so
+     *        that only the ones still queued on the socket are kept.
+     */
+    void ForgetSent ();
+    /**
+     * @brief Moves the messages still queued on the socket to the send queue.
+     */
+    void KeepUnsent ();
+
     // VARS
     
     std::string mName;
     
     Socket* mSocket;
     long mCarUpdateInterval;
+    ACSProtocol::TypeMask mSubscriptions;
+    uint64_t mCarFilter;
     
     bool mRequestedCarInfo[ 64 ];
-    bool mRequestedSessionInfo[ 64 ];
+    bool mRequestedSessionInfo[ 65 ];
     
-    Time mLastUpdate[ 64 ];
+    uint64_t mDueCarUpdates;
+    CarUpdateScheduler::Timer mCarTimers[ 64 ];
+
+    // Messages queued on the socket, in the same order, and the ones
+    // waiting for the socket to become writable. Only the latest update
+    // about each car is kept.
+    std::vector< PacketBuffer* > mSocketQueue;
+    std::deque< QueuedMessage > mSendQueue;
+    PacketBuffer* mLatestUpdate[ 64 ];
+    size_t mQueuedUpdates;
+    size_t mSendQueueSize;
+    size_t mSendQueueHighWater;
+    Time mAboveHighWaterSince;
+    bool mWatchingWrite;
+    unsigned long mDroppedUpdates;
+    unsigned long mDroppedMessages;
 
-    constexpr static float kUpdateIntervalPrecision = 0.9f;
+    const static size_t kDefaultSendQueueSize = 1024;
 };
 
 #endif // _peerconnection_h
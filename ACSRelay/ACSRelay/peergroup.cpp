@@ -0,0 +1,500 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "peergroup.h"
+#include "ACSProtocol.h"
+#include "relayudpsocket.h"
+#include "tcpsocket.h"
+#include "udpsocket.h"
+#include "log.h"
+
+#include <algorithm>
+
+const int PeerGroup::kMaintenanceInterval;
+
+PeerGroup::PeerGroup ( EventLoop* loop, const size_t send_queue_size, const size_t send_queue_high_water,
+                       const unsigned int send_queue_timeout, const unsigned int stats_interval,
+                       const unsigned int compression_flush )
+    : mEventLoop ( loop ),
+      mSendQueueSize ( send_queue_size ),
+      mSendQueueHighWater ( send_queue_high_water ),
+      mSendQueueTimeout ( send_queue_timeout ),
+      mStatsInterval ( stats_interval ),
+      mCompressionFlush ( compression_flush ),
+      mWatchingWrite ( 0 ),
+      mScheduleCurrent ( false )
+{
+    mStart = mLastStats = mNextMaintenance = Clock::now ();
+}
+
+bool PeerGroup::Add ( PeerConnection* peer )
+{
+    UDPSocket* udp_socket = dynamic_cast<UDPSocket*> ( peer -> GetSocket () );
+    bool added;
+
+    // Plugins' datagrams may be received and sent by the loop itself.
+    if ( udp_socket != NULL )
+        added = udp_socket -> Attach ( mEventLoop, peer );
+    else
+        added = mEventLoop -> Add ( peer -> GetSocket () -> Fd (), peer );
+
+    if ( !added )
+    {
+        Log::e () << "Couldn't monitor " << peer -> Name () << ". Dropping it.";
+        delete peer;
+        return false;
+    }
+
+    // A slow peer must never stall the relay. Whatever it can't take
+    // right away waits in its send queue.
+    peer -> GetSocket () -> SetBlocking ( false );
+    peer -> SetSendQueueLimits ( mSendQueueSize, mSendQueueHighWater );
+
+    // No realtime car updates until the peer asks for them.
+    peer -> SetCarUpdateInterval ( 0 );
+
+    mPeers[ peer -> GetSocket () -> Fd () ] = peer;
+
+    if ( dynamic_cast<RelayUDPSocket*> ( peer -> GetSocket () ) != NULL )
+        mUDPRelays.push_back ( peer );
+
+    for ( int i = 0; i < 256; i++ )
+    {
+        if ( peer -> IsSubscribed ( i ) )
+            mSubscribers[ i ].push_back ( peer );
+    }
+
+    // Send whatever was preloaded for the peer before it got here.
+    if ( peer -> WantsWrite () )
+        Writable ( peer );
+
+    return true;
+}
+
+void PeerGroup::Remove ( PeerConnection* peer )
+{
+    auto p = mPeers.find ( peer -> GetSocket () -> Fd () );
+
+    if ( p == mPeers.end () || p -> second != peer )
+        return;
+
+    // Stop monitoring the socket before it gets closed by the
+    // PeerConnection destructor.
+    mEventLoop -> Remove ( p -> first );
+    mPeers.erase ( p );
+
+    for ( int i = 0; i < 256; i++ )
+    {
+        if ( peer -> IsSubscribed ( i ) )
+            mSubscribers[ i ].erase ( std::remove ( mSubscribers[ i ].begin (), mSubscribers[ i ].end (), peer ), mSubscribers[ i ].end () );
+    }
+
+    if ( peer -> IsWatchingWrite () )
+        mWatchingWrite -= 1;
+
+    mPendingFlush.erase ( std::remove ( mPendingFlush.begin (), mPendingFlush.end (), peer ), mPendingFlush.end () );
+    mCompressed.erase ( std::remove ( mCompressed.begin (), mCompressed.end (), peer ), mCompressed.end () );
+    mUDPRelays.erase ( std::remove ( mUDPRelays.begin (), mUDPRelays.end (), peer ), mUDPRelays.end () );
+    mScheduler.Remove ( peer );
+
+    delete peer;
+}
+
+long PeerGroup::Receive ( PeerConnection* peer, PacketBuffer* packet )
+{
+    char* msg = packet -> Data ();
+    long n;
+
+    n = peer -> GetSocket () -> Read ( msg, packet -> Capacity () );
+    packet -> SetLength ( n );
+
+    if ( n < 0 && Socket::WouldBlock () )
+    {
+        // Nothing left to read.
+        return -1;
+    }
+
+    if ( n < 1 )
+    {
+        // We'll get here only if the peer's TCP socket has been disconnected,
+        // or the other end of its UDP link said goodbye.
+        // Destroy the PeerConnection to make sure we close the socket on our side.
+        Log::v () << "Read error from " << peer -> Name () << ". Closing connection and removing downstream relay.";
+        Remove ( peer );
+        return -1;
+    }
+
+    LOG_DEBUG ( "Caught message from " << peer -> Name () << "!" << Log::Packet ( msg, n ) );
+
+    // Only relay packets that can actually be sent by a plugin.
+    // Everything else must be bogus.
+
+    switch ( static_cast<int8_t> ( msg[ 0 ] ) )
+    {
+        case ACSProtocol::ACSP_REALTIMEPOS_INTERVAL:
+        case ACSProtocol::ACSP_GET_CAR_INFO:
+        case ACSProtocol::ACSP_SEND_CHAT:
+        case ACSProtocol::ACSP_BROADCAST_CHAT:
+        case ACSProtocol::ACSP_GET_SESSION_INFO:
+        case ACSProtocol::ACSP_SET_SESSION_INFO:
+        case ACSProtocol::ACSP_KICK_USER:
+        case ACSProtocol::ACSP_NEXT_SESSION:
+        case ACSProtocol::ACSP_RESTART_SESSION:
+        case ACSProtocol::ACSP_ADMIN_COMMAND:
+            break;
+        case ACSProtocol::ACSR_SET_CAR_FILTER:
+            // Meant for us, the server wouldn't know what to do with it.
+            if ( n >= 9 )
+            {
+                uint64_t filter = 0;
+
+                for ( int i = 8; i >= 1; i-- )
+                    filter = ( filter << 8 ) | static_cast<uint8_t> ( msg[ i ] );
+
+                peer -> SetCarFilter ( filter );
+                Log::v () << peer -> Name () << " changed the cars it wants updates about.";
+            }
+            return 0;
+        case ACSProtocol::ACSR_CAR_UPDATE_CODEC:
+            // A downstream relay that can decode delta-encoded car updates.
+            if ( dynamic_cast<TCPSocket*> ( peer -> GetSocket () ) != NULL )
+            {
+                static_cast<TCPSocket*> ( peer -> GetSocket () ) -> EnableCarUpdateEncoding ();
+                Log::v () << "Delta-encoding car updates sent to " << peer -> Name () << ".";
+            }
+            return 0;
+        case ACSProtocol::ACSR_COMPRESSION:
+            // A downstream relay that wants the whole stream compressed.
+            if ( dynamic_cast<TCPSocket*> ( peer -> GetSocket () ) != NULL )
+            {
+                if ( static_cast<TCPSocket*> ( peer -> GetSocket () ) -> EnableCompression ( mCompressionFlush ) )
+                {
+                    mCompressed.push_back ( peer );
+                    Log::v () << "Compressing messages sent to " << peer -> Name () << ".";
+                }
+                else
+                {
+                    Log::w () << "Couldn't compress messages sent to " << peer -> Name () << ". Sending them as they are.";
+                }
+
+                UpdateWriteInterest ( peer );
+            }
+            return 0;
+        default:
+            Log::v () << "Received an invalid packet from plugin " << peer -> Name () << ". Dropping.";
+            return 0;
+    }
+
+    if ( static_cast<int8_t> ( msg[ 0 ] ) == ACSProtocol::ACSP_REALTIMEPOS_INTERVAL )
+    {
+        if ( n >= 2 )
+        {
+            // A plugin must not slow down the updates another one reading
+            // the same socket asked for.
+            if ( peer -> GetSocket () -> HasManyReaders () && peer -> CarUpdateInterval () != 0 &&
+                 ( static_cast<uint8_t> ( msg[ 1 ] ) == 0 || static_cast<uint8_t> ( msg[ 1 ] ) > peer -> CarUpdateInterval () ) )
+                return n;
+
+            peer -> SetCarUpdateInterval ( static_cast<uint8_t> ( msg[ 1 ] ) );
+
+            AdvanceSchedule ( Clock::now () );
+            mScheduler.Reset ( peer );
+        }
+    }
+    // This plugin is requesting info about a car. Take notice and make sure to
+    // relay the server's response to this plugin.
+    else if ( static_cast<int8_t> ( msg[ 0 ] ) == ACSProtocol::ACSP_GET_CAR_INFO )
+    {
+        peer -> RequestCarInfo ( static_cast<int8_t> ( msg[ 1 ] ) );
+    }
+    // This plugin is requesting info about a session. Take notice and make sure to relay the server's response to this plugin.
+    else if ( static_cast<int8_t> ( msg[ 0 ] ) == ACSProtocol::ACSP_GET_SESSION_INFO )
+    {
+        peer -> RequestSessionInfo ( static_cast<int8_t> ( msg[ 1 ] ) );
+    }
+
+    return n;
+}
+
+void PeerGroup::Deliver ( PacketBuffer* packet, const uint16_t set_interval )
+{
+    const char* msg = packet -> Data ();
+
+    // Send realtime position update to subscribed plugins
+    if ( static_cast<int8_t> ( msg[ 0 ] ) == ACSProtocol::ACSP_CAR_UPDATE )
+    {
+        int8_t cid = static_cast<int8_t> ( msg[ 1 ] );
+
+        if ( !mScheduleCurrent )
+        {
+            AdvanceSchedule ( Clock::now () );
+            mScheduleCurrent = true;
+        }
+
+        for ( auto p = mPeers.begin (); p != mPeers.end (); ++p )
+        {
+            // Send ACSP_CAR_UPDATE packets to any plugin that is interested
+            // and due an update about the car, according to the schedule.
+            //
+            // Also, if the plugin has the minimum car update interval make
+            // sure to send it the packet.
+
+            // Plugins watching only some of the cars never see the others.
+            if ( !p -> second -> WantsCar ( cid ) )
+                continue;
+
+            if ( p -> second -> CarUpdateInterval () == set_interval || p -> second -> IsCarUpdateDue ( cid ) )
+            {
+                LOG_DEBUG ( "Relaying packet to " << p -> second -> Name () );
+                QueueToPeer ( p -> second, packet );
+                mScheduler.Delivered ( p -> second, cid, set_interval / 2 );
+            }
+        }
+    }
+    // One or more of the plugins requested ACSP_CAR_INFO. Send it to interested plugin(s).
+    else if ( static_cast<int8_t> ( msg[ 0 ] ) == ACSProtocol::ACSP_CAR_INFO )
+    {
+        for ( auto p = mPeers.begin (); p != mPeers.end (); ++p )
+        {
+            if ( p -> second -> IsWaitingCarInfo ( static_cast<int8_t> ( msg[ 1 ] ) ) )
+            {
+                LOG_DEBUG ( "Relaying packet to " << p -> second -> Name () );
+                QueueToPeer ( p -> second, packet );
+                p -> second -> CarInfoArrived ( static_cast<int8_t> ( msg[ 1 ] ) );
+            }
+        }
+    }
+    // One or more of the plugins requested ACSP_SESSION_INFO. Send it to interested plugin(s).
+    else if ( static_cast<int8_t> ( msg[ 0 ] ) == ACSProtocol::ACSP_SESSION_INFO )
+    {
+        // The session index follows the protocol version. Plugins that
+        // asked for the current session (-1) are waiting for it as well.
+        int8_t sid = packet -> Length () >= 4 ? static_cast<int8_t> ( msg[ 2 ] ) : -2;
+        bool current = packet -> Length () >= 4 && msg[ 2 ] == msg[ 3 ];
+
+        for ( auto p = mPeers.begin (); p != mPeers.end (); ++p )
+        {
+            if ( p -> second -> IsWaitingSessionInfo ( sid ) || ( current && p -> second -> IsWaitingSessionInfo ( -1 ) ) )
+            {
+                LOG_DEBUG ( "Relaying packet to " << p -> second -> Name () );
+                QueueToPeer ( p -> second, packet );
+                p -> second -> SessionInfoArrived ( sid );
+
+                if ( current )
+                    p -> second -> SessionInfoArrived ( -1 );
+            }
+        }
+    }
+    // For other types of packets just relay the message to all plugins
+    // that subscribed to it.
+    else
+    {
+        std::vector< PeerConnection* >& subscribers = mSubscribers[ static_cast<uint8_t> ( msg[ 0 ] ) ];
+
+        for ( auto p = subscribers.begin (); p != subscribers.end (); ++p )
+        {
+            LOG_DEBUG ( "Relaying packet to " << ( *p ) -> Name () );
+            QueueToPeer ( *p, packet );
+        }
+    }
+}
+
+void PeerGroup::QueueToPeer ( PeerConnection* peer, PacketBuffer* packet )
+{
+    Socket* socket = peer -> GetSocket ();
+    bool first = !socket -> HasQueued ();
+
+    peer -> Send ( packet );
+
+    if ( first && socket -> HasQueued () )
+        mPendingFlush.push_back ( peer );
+    else
+        UpdateWriteInterest ( peer );
+}
+
+void PeerGroup::Flush ()
+{
+    for ( auto p = mPendingFlush.begin (); p != mPendingFlush.end (); ++p )
+    {
+        ( *p ) -> Flush ();
+        UpdateWriteInterest ( *p );
+    }
+
+    // Loops that send the datagrams themselves get them all in one go.
+    mEventLoop -> Submit ();
+
+    mPendingFlush.clear ();
+    mScheduleCurrent = false;
+}
+
+void PeerGroup::AdvanceSchedule ( const Time now )
+{
+    mScheduler.Advance ( std::chrono::duration_cast< Ms > ( now - mStart ).count () );
+}
+
+void PeerGroup::Writable ( PeerConnection* peer )
+{
+    // The peer caught up. Send what's been waiting for it.
+    peer -> SendQueued ();
+    UpdateWriteInterest ( peer );
+    mEventLoop -> Submit ();
+}
+
+void PeerGroup::UpdateWriteInterest ( PeerConnection* peer )
+{
+    if ( peer -> WantsWrite () == peer -> IsWatchingWrite () )
+        return;
+
+    peer -> SetWatchingWrite ( peer -> WantsWrite () );
+    mEventLoop -> SetWriteInterest ( peer -> GetSocket () -> Fd (), peer, peer -> WantsWrite () );
+
+    mWatchingWrite += peer -> WantsWrite () ? 1 : -1;
+}
+
+int PeerGroup::Timeout () const
+{
+    int timeout = -1;
+    int flush;
+
+    // Compressed messages must not wait longer than they're allowed to.
+    for ( auto p = mCompressed.begin (); p != mCompressed.end (); ++p )
+    {
+        flush = static_cast<TCPSocket*> ( ( *p ) -> GetSocket () ) -> FlushTimeout ();
+
+        if ( flush >= 0 && ( timeout < 0 || flush < timeout ) )
+            timeout = flush;
+    }
+
+    // So must retransmissions and keepalives on UDP links.
+    for ( auto p = mUDPRelays.begin (); p != mUDPRelays.end (); ++p )
+    {
+        flush = static_cast<RelayUDPSocket*> ( ( *p ) -> GetSocket () ) -> Timeout ();
+
+        if ( flush >= 0 && ( timeout < 0 || flush < timeout ) )
+            timeout = flush;
+    }
+
+    // Only wake up for housekeeping if some peer is behind or
+    // statistics have to be reported.
+    if ( mWatchingWrite == 0 && mStatsInterval == 0 )
+        return timeout;
+
+    flush = static_cast<int> ( std::chrono::duration_cast< Ms > ( mNextMaintenance - Clock::now () ).count () );
+
+    if ( flush < 0 )
+        flush = 0;
+
+    return timeout < 0 || flush < timeout ? flush : timeout;
+}
+
+void PeerGroup::Maintain ( const Time now )
+{
+    std::vector< PeerConnection* > stalled;
+    TCPSocket* socket;
+    RelayUDPSocket* link;
+
+    for ( auto p = mCompressed.begin (); p != mCompressed.end (); ++p )
+    {
+        socket = static_cast<TCPSocket*> ( ( *p ) -> GetSocket () );
+
+        if ( socket -> FlushTimeout () == 0 )
+        {
+            socket -> FlushCompressed ();
+            UpdateWriteInterest ( *p );
+        }
+    }
+
+    for ( auto p = mUDPRelays.begin (); p != mUDPRelays.end (); ++p )
+    {
+        link = static_cast<RelayUDPSocket*> ( ( *p ) -> GetSocket () );
+        link -> Maintain ();
+
+        if ( link -> Closed () )
+            stalled.push_back ( *p );
+    }
+
+    for ( auto p = stalled.begin (); p != stalled.end (); ++p )
+    {
+        Log::v () << "Lost the UDP link with " << ( *p ) -> Name () << ". Removing downstream relay.";
+        Remove ( *p );
+    }
+
+    stalled.clear ();
+
+    if ( now < mNextMaintenance )
+        return;
+
+    mNextMaintenance = now + std::chrono::milliseconds ( kMaintenanceInterval );
+
+    for ( auto p = mPeers.begin (); p != mPeers.end (); ++p )
+    {
+        if ( p -> second -> IsStalled ( now, mSendQueueTimeout ) )
+            stalled.push_back ( p -> second );
+    }
+
+    for ( auto p = stalled.begin (); p != stalled.end (); ++p )
+    {
+        // Downstream relays get disconnected. They'll reconnect once they're
+        // able to keep up. UDP plugins have no connection to drop, so they
+        // just lose what's been waiting for them.
+        if ( dynamic_cast<UDPSocket*> ( ( *p ) -> GetSocket () ) == NULL )
+        {
+            Log::w () << ( *p ) -> Name () << " can't keep up (" << static_cast<unsigned long> ( ( *p ) -> QueueDepth () ) << " queued packets). Disconnecting.";
+            Remove ( *p );
+        }
+        else
+        {
+            Log::w () << ( *p ) -> Name () << " can't keep up (" << static_cast<unsigned long> ( ( *p ) -> QueueDepth () ) << " queued packets). Dropping them.";
+            ( *p ) -> ClearSendQueue ();
+            UpdateWriteInterest ( *p );
+        }
+    }
+
+    if ( mStatsInterval != 0 && now - mLastStats >= std::chrono::seconds ( mStatsInterval ) )
+    {
+        mLastStats = now;
+
+        for ( auto p = mPeers.begin (); p != mPeers.end (); ++p )
+        {
+            Log::i () << p -> second -> Name () << ": " << static_cast<unsigned long> ( p -> second -> QueueDepth () ) << " queued, "
+                      << p -> second -> DroppedUpdates () << " car updates dropped, "
+                      << p -> second -> DroppedMessages () << " packets dropped in total.";
+        }
+
+        for ( auto p = mCompressed.begin (); p != mCompressed.end (); ++p )
+        {
+            Log::i () << ( *p ) -> Name () << ": " << static_cast<TCPSocket*> ( ( *p ) -> GetSocket () ) -> Compression () -> Summary ();
+        }
+
+        for ( auto p = mUDPRelays.begin (); p != mUDPRelays.end (); ++p )
+        {
+            Log::i () << ( *p ) -> Name () << ": " << static_cast<RelayUDPSocket*> ( ( *p ) -> GetSocket () ) -> Summary ();
+        }
+    }
+}
+
+PeerGroup::~PeerGroup ()
+{
+    for ( auto p = mPeers.begin (); p != mPeers.end (); ++p )
+    {
+        mEventLoop -> Remove ( p -> first );
+        mScheduler.Remove ( p -> second );
+        delete p -> second;
+    }
+}
@@ -0,0 +1,174 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _peergroup_h
+#define _peergroup_h
+
+#include "carupdatescheduler.h"
+#include "eventloop.h"
+#include "packetbuffer.h"
+#include "peerconnection.h"
+
+#include <map>
+#include <vector>
+
+/**
+ * @class PeerGroup
+ * @brief Set of peers (UDP plugins and downstream relays) served by the
+ *        same thread and monitored by the same EventLoop.
+ *        It decides which server messages each peer gets, sends them and
+ *        keeps an eye on peers that can't keep up.
+ */
+class PeerGroup
+{
+public:
+
+    // CTOR/DCTOR
+
+    /**
+     * @brief PeerGroup object constructor.
+     * @param loop EventLoop used to monitor the peers' sockets.
+     * @param send_queue_size Maximum number of packets waiting for a peer.
+     * @param send_queue_high_water Number of waiting packets above which a peer is stalling.
+     * @param send_queue_timeout Seconds a peer may stall before being dealt with.
+     * @param stats_interval Seconds between statistics reports, 0 to disable them.
+     * @param compression_flush Milliseconds compressed messages may wait on relay links.
+     */
+    PeerGroup ( EventLoop* loop, const size_t send_queue_size, const size_t send_queue_high_water,
+                const unsigned int send_queue_timeout, const unsigned int stats_interval,
+                const unsigned int compression_flush );
+    /**
+     * @brief PeerGroup destructor. Destroys every peer still in the group.
+     */
+    virtual ~PeerGroup ();
+
+    // METHODS
+
+    /**
+     * @brief Starts monitoring a peer. The group takes ownership of it.
+     * @param peer Pointer to a PeerConnection.
+     * @return False if the peer couldn't be monitored, in which case it's destroyed.
+     */
+    bool Add ( PeerConnection* peer );
+    /**
+     * @brief Stops monitoring a peer, removes it from the group and destroys it.
+     * @param peer Pointer to the PeerConnection to be removed.
+     */
+    void Remove ( PeerConnection* peer );
+    /**
+     * @brief Retrieves the number of peers in the group.
+     * @return Number of peers.
+     */
+    size_t Size () const { return mPeers.size (); }
+    /**
+     * @brief Reads a message from a peer and takes note of what it asks for.
+     *        Messages that a plugin isn't allowed to send are dropped.
+     *        The peer is removed if its connection has been closed.
+     * @param peer Pointer to the PeerConnection that is readable.
+     * @param packet Buffer that will hold the message.
+     * @return Size of the message to be relayed to the server, 0 if it was
+     *         dropped, or -1 if there's nothing left to read from the peer.
+     */
+    long Receive ( PeerConnection* peer, PacketBuffer* packet );
+    /**
+     * @brief Queues a server message for every peer that should get it.
+     *        Every peer that gets it keeps a reference to the buffer.
+     * @param packet Buffer holding the message.
+     * @param set_interval Shortest car update interval the server was asked for.
+     */
+    void Deliver ( PacketBuffer* packet, const uint16_t set_interval );
+    /**
+     * @brief Sends every message queued by Deliver(), one batch per socket.
+     *        Ends the batch: the next Deliver() reads the clock again.
+     */
+    void Flush ();
+    /**
+     * @brief Sends whatever has been waiting for a peer that became writable.
+     * @param peer Pointer to the PeerConnection that is writable.
+     */
+    void Writable ( PeerConnection* peer );
+    /**
+     * @brief Computes how long the owner of the group may wait for events.
+     * @return Milliseconds until the next Maintain() is due, or -1 if
+     *         there's no housekeeping to be done.
+     */
+    int Timeout () const;
+    /**
+     * @brief Periodic housekeeping: deals with stalled peers and reports statistics.
+     *        Does nothing if the last run was less than a second ago, except
+     *        sending compressed messages that have waited long enough and
+     *        keeping the UDP links to downstream relays going.
+     * @param now Current time.
+     */
+    void Maintain ( const Time now );
+
+private:
+
+    // METHODS
+
+    /**
+     * @brief Queues a message for a peer.
+     * @param peer Pointer to the destination PeerConnection.
+     * @param packet Buffer holding the message.
+     */
+    void QueueToPeer ( PeerConnection* peer, PacketBuffer* packet );
+    /**
+     * @brief Asks the event loop to report when a peer's socket is writable,
+     *        for as long as the peer has something waiting to be sent.
+     * @param peer Pointer to a PeerConnection.
+     */
+    void UpdateWriteInterest ( PeerConnection* peer );
+    /**
+     * @brief Brings the car update schedule up to date.
+     * @param now Current time.
+     */
+    void AdvanceSchedule ( const Time now );
+
+    // VARS
+
+    EventLoop* mEventLoop;
+
+    std::map< int, PeerConnection* > mPeers;
+    // Peers subscribed to each type of server message, so that messages
+    // every peer may get only go through the interested ones.
+    std::vector< PeerConnection* > mSubscribers[ 256 ];
+    std::vector< PeerConnection* > mPendingFlush;
+    // Relays whose link is compressed.
+    std::vector< PeerConnection* > mCompressed;
+    // Relays linked over UDP, whose links need looking after.
+    std::vector< PeerConnection* > mUDPRelays;
+
+    size_t mSendQueueSize;
+    size_t mSendQueueHighWater;
+    unsigned int mSendQueueTimeout;
+    unsigned int mStatsInterval;
+    unsigned int mCompressionFlush;
+    int mWatchingWrite;
+    Time mLastStats;
+    Time mNextMaintenance;
+
+    CarUpdateScheduler mScheduler;
+    Time mStart;
+    // The clock is read once per batch of server messages.
+    bool mScheduleCurrent;
+
+    const static int kMaintenanceInterval = 1000;
+};
+
+#endif // _peergroup_h
@@ -0,0 +1,171 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pendingrequests.h"
+#include "ACSProtocol.h"
+#include "log.h"
+
+#include <string.h>
+
+const int PendingRequests::kTimeout;
+
+PendingRequests::PendingRequests ()
+{
+    Clear ();
+}
+
+PendingRequests::Request* PendingRequests::Find ( const char* msg, const long n )
+{
+    int id;
+
+    if ( static_cast<int8_t> ( msg[ 0 ] ) == ACSProtocol::ACSP_GET_CAR_INFO && n >= 2 )
+    {
+        id = static_cast<int8_t> ( msg[ 1 ] );
+
+        if ( id >= 0 && id < 64 )
+            return &mRequests[ id ];
+    }
+    else if ( static_cast<int8_t> ( msg[ 0 ] ) == ACSProtocol::ACSP_GET_SESSION_INFO && n >= 3 )
+    {
+        // Little endian 16 bit session index, -1 meaning the current session.
+        id = static_cast<int16_t> ( static_cast<uint8_t> ( msg[ 1 ] ) | ( static_cast<uint8_t> ( msg[ 2 ] ) << 8 ) );
+
+        if ( id >= -1 && id < 64 )
+            return &mRequests[ kCarSlots + id + 1 ];
+    }
+
+    return NULL;
+}
+
+bool PendingRequests::Forward ( const char* msg, const long n, const Time now )
+{
+    Request* request = Find ( msg, n );
+
+    if ( request == NULL )
+        return true;
+
+    if ( request -> pending )
+    {
+        LOG_DEBUG ( "The same request is already waiting for the server's answer. Not sending it again." );
+        return false;
+    }
+
+    request -> pending = true;
+    request -> attempts = 1;
+    request -> sent = now;
+    request -> length = n < 3 ? n : 3;
+    memcpy ( request -> msg, msg, request -> length );
+
+    return true;
+}
+
+void PendingRequests::Update ( PacketBuffer* packet )
+{
+    const char* msg = packet -> Data ();
+    long n = packet -> Length ();
+    int id;
+
+    switch ( static_cast<int8_t> ( msg[ 0 ] ) )
+    {
+        case ACSProtocol::ACSP_CAR_INFO:
+            if ( n < 2 )
+                return;
+
+            id = static_cast<int8_t> ( msg[ 1 ] );
+
+            if ( id >= 0 && id < 64 )
+                mRequests[ id ].pending = false;
+            break;
+        case ACSProtocol::ACSP_SESSION_INFO:
+            // The session index follows the protocol version, then
+            // comes the index of the current session.
+            if ( n < 4 )
+                return;
+
+            id = static_cast<int8_t> ( msg[ 2 ] );
+
+            if ( id >= 0 && id < 64 )
+                mRequests[ kCarSlots + id + 1 ].pending = false;
+
+            if ( msg[ 2 ] == msg[ 3 ] )
+                mRequests[ kCarSlots ].pending = false;
+            break;
+        case ACSProtocol::ACSP_VERSION:
+            // The server has just started and forgot about our requests.
+            // Plugins asking again must get through.
+            Clear ();
+            break;
+        default:
+            break;
+    }
+}
+
+void PendingRequests::Reissue ( const Time now, Socket* server )
+{
+    for ( int i = 0; i < kSlots; i++ )
+    {
+        Request& request = mRequests[ i ];
+
+        if ( !request.pending || now - request.sent < std::chrono::milliseconds ( kTimeout ) )
+            continue;
+
+        if ( request.attempts >= kMaxAttempts )
+        {
+            Log::w () << "The server didn't answer a request after " << request.attempts << " attempts. Giving up.";
+            request.pending = false;
+            continue;
+        }
+
+        Log::v () << "The server didn't answer a request in time. Sending it again.";
+        server -> Send ( request.msg, request.length );
+
+        request.attempts += 1;
+        request.sent = now;
+    }
+}
+
+int PendingRequests::Timeout ( const Time now ) const
+{
+    int timeout = -1;
+    int t;
+
+    for ( int i = 0; i < kSlots; i++ )
+    {
+        if ( !mRequests[ i ].pending )
+            continue;
+
+        t = static_cast<int> ( std::chrono::duration_cast< Ms > ( mRequests[ i ].sent + std::chrono::milliseconds ( kTimeout ) - now ).count () );
+
+        if ( t < 0 )
+            t = 0;
+
+        if ( timeout < 0 || t < timeout )
+            timeout = t;
+    }
+
+    return timeout;
+}
+
+void PendingRequests::Clear ()
+{
+    for ( int i = 0; i < kSlots; i++ )
+    {
+        mRequests[ i ].pending = false;
+    }
+}
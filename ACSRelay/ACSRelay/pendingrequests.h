@@ -0,0 +1,115 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _pendingrequests_h
+#define _pendingrequests_h
+
+#include "packetbuffer.h"
+#include "peerconnection.h"
+#include "socket.h"
+
+/**
+ * @class PendingRequests
+ * @brief Keeps track of the ACSP_GET_CAR_INFO and ACSP_GET_SESSION_INFO requests
+ *        the server hasn't answered yet. While one is on its way, identical
+ *        requests from other plugins aren't sent again: those plugins are
+ *        already waiting for the answer, which reaches all of them.
+ *        Requests that the server doesn't answer in time are sent again a
+ *        few times before giving up.
+ */
+class PendingRequests
+{
+public:
+
+    // CTOR
+
+    PendingRequests ();
+
+    // METHODS
+
+    /**
+     * @brief Decides whether a plugin's message has to be sent to the server.
+     * @param msg Message as a byte array.
+     * @param n Size of the message.
+     * @param now Current time.
+     * @return False if the same request is already waiting for an answer.
+     */
+    bool Forward ( const char* msg, const long n, const Time now );
+    /**
+     * @brief Takes note of a message from the server, which may answer some requests.
+     * @param packet Buffer holding a valid server message.
+     */
+    void Update ( PacketBuffer* packet );
+    /**
+     * @brief Sends again the requests that have been waiting for too long.
+     * @param now Current time.
+     * @param server Socket connected to the server.
+     */
+    void Reissue ( const Time now, Socket* server );
+    /**
+     * @brief Computes how long until a request has to be sent again.
+     * @param now Current time.
+     * @return Milliseconds until the next Reissue() is due, or -1 if nothing is pending.
+     */
+    int Timeout ( const Time now ) const;
+    /**
+     * @brief Forgets every request.
+     */
+    void Clear ();
+
+private:
+
+    // TYPES
+
+    /**
+     * @brief A request that may be waiting for an answer.
+     */
+    struct Request {
+        bool pending;
+        unsigned int attempts;
+        Time sent;
+        char msg[ 3 ];
+        long length;
+    };
+
+    // METHODS
+
+    /**
+     * @brief Finds the slot tracking a request.
+     * @param msg Message as a byte array.
+     * @param n Size of the message.
+     * @return Pointer to the Request, or NULL if the message isn't tracked.
+     */
+    Request* Find ( const char* msg, const long n );
+
+    // VARS
+
+    // Car info requests come first, one per car, followed by
+    // session info requests for the current session and then
+    // one per session index.
+    const static int kCarSlots = 64;
+    const static int kSlots = kCarSlots + 65;
+
+    Request mRequests[ kSlots ];
+
+    const static int kTimeout = 1000;
+    const static unsigned int kMaxAttempts = 3;
+};
+
+#endif // _pendingrequests_h
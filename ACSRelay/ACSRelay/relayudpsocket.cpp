@@ -0,0 +1,728 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ACSProtocol.h"
+#include "log.h"
+#include "relayudpsocket.h"
+
+#ifdef _WIN32
+    #include <ws2tcpip.h>
+#else
+    #include <sys/select.h>
+#endif
+
+#include <algorithm>
+#include <random>
+#include <sstream>
+#include <string.h>
+#include <unistd.h>
+
+const int RelayUDPSocket::kHandshakeInterval;
+const int RelayUDPSocket::kKeepAliveInterval;
+const int RelayUDPSocket::kLinkTimeout;
+const int RelayUDPSocket::kInitialRetransmit;
+const int RelayUDPSocket::kMinRetransmit;
+const int RelayUDPSocket::kMaxRetransmit;
+
+// Kinds of datagram exchanged by the two ends of a link.
+static const char kHello = 1;      ///< Followed by the downstream relay's token.
+static const char kWelcome = 2;    ///< Followed by the token of the HELLO it answers.
+static const char kReliable = 3;   ///< Followed by a sequence number and the message.
+static const char kUnreliable = 4; ///< Followed by a sequence number and a car update.
+static const char kAck = 5;        ///< Followed by the sequence number of the next reliable message expected.
+static const char kPing = 6;
+static const char kBye = 7;
+
+/**
+ * @brief Writes a 32 bit number in little endian order.
+ * @param p Where to write it.
+ * @param value Number to write.
+ */
+static void PutUint32 ( char* p, const uint32_t value )
+{
+    for ( int i = 0; i < 4; i++ )
+        p[ i ] = static_cast<char> ( value >> ( 8 * i ) );
+}
+
+/**
+ * @brief Reads a 32 bit number written by PutUint32().
+ * @param p Where to read it from.
+ * @return The number.
+ */
+static uint32_t GetUint32 ( const char* p )
+{
+    uint32_t value = 0;
+
+    for ( int i = 3; i >= 0; i-- )
+        value = ( value << 8 ) | static_cast<uint8_t> ( p[ i ] );
+
+    return value;
+}
+
+/**
+ * @brief Compares sequence numbers, which eventually wrap around.
+ * @return True if a comes after b.
+ */
+static bool After ( const uint32_t a, const uint32_t b )
+{
+    return static_cast<int32_t> ( a - b ) > 0;
+}
+
+/**
+ * @brief Picks the token of a new link, so that the upstream relay tells
+ *        it apart from the previous ones of the same downstream relay.
+ * @return Random token.
+ */
+static uint32_t NewToken ()
+{
+    std::random_device random;
+
+    return static_cast<uint32_t> ( random () );
+}
+
+RelayUDPSocket::RelayUDPSocket ( const unsigned int listen_port )
+{
+    mRole = LISTENER;
+    mListenPort = listen_port;
+    mHost = "0.0.0.0";
+    mRemotePort = 0;
+    memset ( &mCa, 0, sizeof ( mCa ) );
+
+    Open ( listen_port );
+}
+
+RelayUDPSocket::RelayUDPSocket ( const std::string host, const unsigned int remote_port )
+{
+    mRole = DOWNSTREAM;
+    mListenPort = remote_port;
+    mHost = host;
+    mRemotePort = remote_port;
+
+    Open ( 0 );
+
+    memset ( &mCa, 0, sizeof ( mCa ) );
+    mCa.sin_family = AF_INET;
+    inet_pton ( AF_INET, host.c_str (), &( mCa.sin_addr ) );
+    mCa.sin_port = htons ( mRemotePort );
+}
+
+RelayUDPSocket::RelayUDPSocket ( const struct sockaddr_in& peer, const uint32_t token )
+{
+    mRole = UPSTREAM;
+    mListenPort = 0;
+
+    Open ( 0 );
+
+    mCa = peer;
+    mHost = inet_ntoa ( mCa.sin_addr );
+    mRemotePort = ntohs ( mCa.sin_port );
+    mToken = token;
+
+    mLinked = true;
+    mLinks = 1;
+    SendControl ( kWelcome, mToken, true );
+}
+
+void RelayUDPSocket::Open ( const unsigned int local_port )
+{
+    struct sockaddr_in sa;
+    socklen_t l = sizeof ( sa );
+
+    mLinked = mConfirmed = mClosed = mReconnected = false;
+    mToken = 0;
+    mNextSeq = mNextExpected = mNextUnreliableSeq = 0;
+    mCarUpdateSeen = 0;
+    mLastSent = mLastReceived = mLastHandshake = Clock::now ();
+    mSmoothedRtt = Clock::duration::zero ();
+    mSentReliable = mRetransmitted = mStaleUpdates = mLinks = 0;
+
+    memset ( &sa, 0, sizeof ( sa ) );
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl ( INADDR_ANY );
+    sa.sin_port = htons ( local_port );
+
+    mSockFd = socket ( AF_INET, SOCK_DGRAM, 0 );
+
+    if ( bind ( mSockFd, reinterpret_cast<const struct sockaddr*>( &sa ), sizeof ( sa ) ) < 0 )
+    {
+        Log::e () << "Failed to bind UDP socket on port " << local_port << " for relay " << mHost << ".";
+    }
+
+    // Links use whatever port the system picked.
+    if ( getsockname ( mSockFd, reinterpret_cast<struct sockaddr*>( &sa ), &l ) == 0 )
+        mLocalPort = ntohs ( sa.sin_port );
+    else
+        mLocalPort = local_port;
+}
+
+long RelayUDPSocket::SendDatagram ( const char* data, const size_t len )
+{
+    long n;
+
+    n = sendto ( mSockFd, data, len, SOCKET_SEND_FLAGS, reinterpret_cast<const struct sockaddr*>( &mCa ), sizeof ( mCa ) );
+
+    if ( n >= 0 )
+        mLastSent = Clock::now ();
+
+    return n;
+}
+
+void RelayUDPSocket::SendControl ( const char kind, const uint32_t value, const bool has_value )
+{
+    char datagram[ kHeaderSize ];
+
+    datagram[ 0 ] = kind;
+
+    if ( has_value )
+        PutUint32 ( datagram + 1, value );
+
+    SendDatagram ( datagram, has_value ? kHeaderSize : 1 );
+}
+
+long RelayUDPSocket::Send ( const char* msg, const size_t len )
+{
+    char datagram[ kHeaderSize + PACKET_BUFFER_SIZE ];
+    PacketBuffer* packet;
+    Unacked unacked;
+
+    if ( mRole == LISTENER || len < 1 || len > PACKET_BUFFER_SIZE )
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if ( len >= 2 && static_cast<int8_t> ( msg[ 0 ] ) == ACSProtocol::ACSP_CAR_UPDATE )
+    {
+        // By the time the link is back up, a newer update will be there.
+        if ( !mLinked )
+            return len;
+
+        datagram[ 0 ] = kUnreliable;
+        PutUint32 ( datagram + 1, mNextUnreliableSeq );
+        memcpy ( datagram + kHeaderSize, msg, len );
+
+        // If the socket would block, the peer keeps the latest update
+        // about the car until it's writable again.
+        if ( SendDatagram ( datagram, len + kHeaderSize ) < 0 )
+            return -1;
+
+        mNextUnreliableSeq += 1;
+        return len;
+    }
+
+    if ( mUnacked.size () >= kMaxUnacked )
+    {
+        // The other end hasn't acknowledged anything for ages.
+        if ( mRole == UPSTREAM && !mClosed )
+        {
+            Log::w () << "Relay " << mHost << ":" << mRemotePort << " stopped acknowledging messages. Closing the link.";
+            mClosed = true;
+        }
+
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    packet = PacketBuffer::Acquire ( len + kHeaderSize );
+    packet -> Data ()[ 0 ] = kReliable;
+    PutUint32 ( packet -> Data () + 1, mNextSeq );
+    memcpy ( packet -> Data () + kHeaderSize, msg, len );
+    packet -> SetLength ( len + kHeaderSize );
+
+    unacked.seq = mNextSeq;
+    unacked.datagram = packet;
+    unacked.sent = Clock::now ();
+    unacked.retries = 0;
+
+    mUnacked.push_back ( unacked );
+    mNextSeq += 1;
+    mSentReliable += 1;
+
+    // A datagram the socket didn't take is retransmitted like a lost one.
+    if ( mLinked )
+        SendDatagram ( packet -> Data (), packet -> Length () );
+
+    return len;
+}
+
+long RelayUDPSocket::Read ( char *msg, const size_t len )
+{
+    struct sockaddr_in from;
+    socklen_t l;
+    uint32_t seq;
+    long n;
+    int cid;
+    PacketBuffer* early;
+
+    if ( HasPending () )
+        return DeliverPending ( msg, len );
+
+    while ( true )
+    {
+        l = sizeof ( from );
+        n = recvfrom ( mSockFd, mDatagram, sizeof ( mDatagram ), SOCKET_READ_FLAGS, reinterpret_cast<struct sockaddr*>( &from ), &l );
+
+        if ( n < 0 )
+            return -1;
+
+        // Only the other end of the link is listened to. The upstream
+        // relay says WELCOME from a port of its own.
+        if ( n < 1 || mRole == LISTENER || from.sin_addr.s_addr != mCa.sin_addr.s_addr )
+            continue;
+
+        if ( from.sin_port != mCa.sin_port && ( mRole != DOWNSTREAM || mLinked || mDatagram[ 0 ] != kWelcome ) )
+            continue;
+
+        mLastReceived = Clock::now ();
+        mConfirmed = true;
+
+        switch ( mDatagram[ 0 ] )
+        {
+            case kWelcome:
+                if ( mRole != DOWNSTREAM || n < static_cast<long> ( kHeaderSize ) || GetUint32 ( mDatagram + 1 ) != mToken )
+                    break;
+
+                // Tell the upstream relay its WELCOME got here, even if
+                // it's a repeated one.
+                if ( mLinked )
+                {
+                    SendControl ( kPing, 0, false );
+                    break;
+                }
+
+                mCa.sin_port = from.sin_port;
+                mRemotePort = ntohs ( from.sin_port );
+                Linked ();
+                SendControl ( kPing, 0, false );
+
+                // Whatever comes next belongs to the new link. Let the
+                // caller know it's up before reading it.
+                SetWouldBlock ();
+                return -1;
+            case kAck:
+                if ( n >= static_cast<long> ( kHeaderSize ) )
+                    Acknowledged ( GetUint32 ( mDatagram + 1 ) );
+                break;
+            case kBye:
+                if ( mRole == UPSTREAM )
+                {
+                    mClosed = true;
+                    mLinked = false;
+                    return 0;
+                }
+
+                if ( mLinked )
+                {
+                    Log::w () << "The upstream relay (" << mHost << ":" << mListenPort << ") closed the link. Reconnecting...";
+                    Reconnect ();
+                }
+                break;
+            case kReliable:
+                if ( n < static_cast<long> ( kHeaderSize ) || !mLinked )
+                    break;
+
+                seq = GetUint32 ( mDatagram + 1 );
+                n -= kHeaderSize;
+
+                if ( seq == mNextExpected )
+                {
+                    mNextExpected += 1;
+                    SendControl ( kAck, mNextExpected, true );
+
+                    if ( n > static_cast<long> ( len ) )
+                    {
+                        errno = EMSGSIZE;
+                        return -1;
+                    }
+
+                    memcpy ( msg, mDatagram + kHeaderSize, n );
+                    return n;
+                }
+
+                // Keep messages that arrived before the ones they follow,
+                // as long as there's room. The rest is sent again.
+                if ( After ( seq, mNextExpected ) && mEarly.size () < kMaxEarly && mEarly.find ( seq ) == mEarly.end () )
+                {
+                    early = PacketBuffer::Acquire ( n );
+                    memcpy ( early -> Data (), mDatagram + kHeaderSize, n );
+                    early -> SetLength ( n );
+                    mEarly[ seq ] = early;
+                }
+
+                // Duplicates are acknowledged too, as the acknowledgement
+                // may be what got lost.
+                SendControl ( kAck, mNextExpected, true );
+                break;
+            case kUnreliable:
+                if ( n < static_cast<long> ( kHeaderSize ) + 2 || !mLinked )
+                    break;
+
+                seq = GetUint32 ( mDatagram + 1 );
+                cid = static_cast<int8_t> ( mDatagram[ kHeaderSize + 1 ] );
+                n -= kHeaderSize;
+
+                if ( cid >= 0 && cid < 64 )
+                {
+                    // A newer update about the car overtook this one.
+                    if ( ( mCarUpdateSeen >> cid & 1 ) && !After ( seq, mCarUpdateSeq[ cid ] ) )
+                    {
+                        mStaleUpdates += 1;
+                        break;
+                    }
+
+                    mCarUpdateSeq[ cid ] = seq;
+                    mCarUpdateSeen |= static_cast<uint64_t> ( 1 ) << cid;
+                }
+
+                if ( n > static_cast<long> ( len ) )
+                {
+                    errno = EMSGSIZE;
+                    return -1;
+                }
+
+                memcpy ( msg, mDatagram + kHeaderSize, n );
+                return n;
+            default:
+                // PING only tells the link is alive.
+                break;
+        }
+    }
+}
+
+bool RelayUDPSocket::HasPending () const
+{
+    return !mEarly.empty () && mEarly.find ( mNextExpected ) != mEarly.end ();
+}
+
+long RelayUDPSocket::DeliverPending ( char* msg, const size_t len )
+{
+    auto e = mEarly.find ( mNextExpected );
+    PacketBuffer* packet = e -> second;
+    long n = packet -> Length ();
+
+    mEarly.erase ( e );
+    mNextExpected += 1;
+
+    if ( !HasPending () )
+        SendControl ( kAck, mNextExpected, true );
+
+    if ( n > static_cast<long> ( len ) )
+    {
+        packet -> Release ();
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    memcpy ( msg, packet -> Data (), n );
+    packet -> Release ();
+
+    return n;
+}
+
+void RelayUDPSocket::Acknowledged ( const uint32_t next )
+{
+    Clock::time_point now = Clock::now ();
+    Clock::duration rtt = Clock::duration::zero ();
+    bool sample = true;
+
+    while ( !mUnacked.empty () && After ( next, mUnacked.front ().seq ) )
+    {
+        // Only acknowledgements of messages that were all sent once tell
+        // how long a round trip takes. The others waited for a retransmission.
+        if ( mUnacked.front ().retries > 0 )
+            sample = false;
+
+        rtt = now - mUnacked.front ().sent;
+
+        mUnacked.front ().datagram -> Release ();
+        mUnacked.pop_front ();
+    }
+
+    if ( !sample || rtt == Clock::duration::zero () )
+        return;
+
+    if ( mSmoothedRtt == Clock::duration::zero () )
+        mSmoothedRtt = rtt;
+    else
+        mSmoothedRtt = ( 7 * mSmoothedRtt + rtt ) / 8;
+}
+
+RelayUDPSocket::Clock::duration RelayUDPSocket::RetransmitTimeout ( const unsigned int retries ) const
+{
+    Clock::duration timeout = 2 * mSmoothedRtt;
+
+    // No round trip measured yet.
+    if ( mSmoothedRtt == Clock::duration::zero () )
+        timeout = std::chrono::milliseconds ( kInitialRetransmit );
+
+    if ( timeout < std::chrono::milliseconds ( kMinRetransmit ) )
+        timeout = std::chrono::milliseconds ( kMinRetransmit );
+
+    // Back off while the other end doesn't answer.
+    timeout *= 1 << ( retries < 4 ? retries : 4 );
+
+    return std::min ( timeout, Clock::duration ( std::chrono::milliseconds ( kMaxRetransmit ) ) );
+}
+
+RelayUDPSocket* RelayUDPSocket::Accept ()
+{
+    struct sockaddr_in from;
+    socklen_t l;
+    long n;
+    Clock::time_point now = Clock::now ();
+    std::pair< uint64_t, uint32_t > hello;
+
+    if ( mRole != LISTENER )
+        return NULL;
+
+    // By now, the links of these HELLOs are either up or gone.
+    for ( auto a = mAccepted.begin (); a != mAccepted.end (); )
+    {
+        if ( now - a -> second >= std::chrono::milliseconds ( kLinkTimeout ) )
+            a = mAccepted.erase ( a );
+        else
+            ++a;
+    }
+
+    while ( true )
+    {
+        l = sizeof ( from );
+        n = recvfrom ( mSockFd, mDatagram, sizeof ( mDatagram ), SOCKET_READ_FLAGS, reinterpret_cast<struct sockaddr*>( &from ), &l );
+
+        if ( n < 0 )
+            return NULL;
+
+        if ( n < static_cast<long> ( kHeaderSize ) || mDatagram[ 0 ] != kHello )
+            continue;
+
+        hello = std::make_pair ( static_cast<uint64_t> ( from.sin_addr.s_addr ) << 16 | from.sin_port, GetUint32 ( mDatagram + 1 ) );
+
+        if ( mAccepted.find ( hello ) != mAccepted.end () )
+            continue;
+
+        mAccepted[ hello ] = now;
+
+        return new RelayUDPSocket ( from, hello.second );
+    }
+}
+
+int RelayUDPSocket::Connect ( unsigned short timeout )
+{
+    Clock::time_point deadline = Clock::now () + std::chrono::seconds ( timeout );
+    char msg[ PACKET_BUFFER_SIZE ];
+    struct timeval tv;
+    fd_set rd;
+
+    if ( mRole != DOWNSTREAM )
+        return -1;
+
+    mToken = NewToken ();
+
+    while ( !mLinked && Clock::now () < deadline )
+    {
+        SendControl ( kHello, mToken, true );
+        mLastHandshake = Clock::now ();
+
+        FD_ZERO ( &rd );
+        FD_SET ( mSockFd, &rd );
+        tv.tv_sec = 0;
+        tv.tv_usec = kHandshakeInterval * 1000;
+
+        // Nothing but the WELCOME matters before the link is up.
+        if ( select ( mSockFd + 1, &rd, NULL, NULL, &tv ) > 0 )
+            Read ( msg, sizeof ( msg ) );
+    }
+
+    return mLinked ? 0 : -1;
+}
+
+void RelayUDPSocket::Linked ()
+{
+    Clock::time_point now = Clock::now ();
+
+    mLinked = true;
+    mLinks += 1;
+    mReconnected = ( mLinks > 1 );
+    mLastReceived = now;
+
+    // Messages kept from the previous link go first, numbered from the start.
+    mNextSeq = 0;
+
+    for ( auto u = mUnacked.begin (); u != mUnacked.end (); ++u )
+    {
+        u -> seq = mNextSeq++;
+        PutUint32 ( u -> datagram -> Data () + 1, u -> seq );
+        u -> sent = now;
+        u -> retries = 0;
+
+        SendDatagram ( u -> datagram -> Data (), u -> datagram -> Length () );
+    }
+}
+
+void RelayUDPSocket::Reconnect ()
+{
+    mLinked = false;
+    mToken = NewToken ();
+
+    mCa.sin_port = htons ( mListenPort );
+    mRemotePort = mListenPort;
+
+    mNextExpected = 0;
+    mNextUnreliableSeq = 0;
+    mCarUpdateSeen = 0;
+
+    for ( auto e = mEarly.begin (); e != mEarly.end (); ++e )
+    {
+        e -> second -> Release ();
+    }
+
+    mEarly.clear ();
+
+    SendControl ( kHello, mToken, true );
+    mLastHandshake = Clock::now ();
+}
+
+bool RelayUDPSocket::Reconnected ()
+{
+    bool reconnected = mReconnected;
+
+    mReconnected = false;
+
+    return reconnected;
+}
+
+void RelayUDPSocket::Maintain ()
+{
+    Clock::time_point now = Clock::now ();
+
+    if ( mRole == LISTENER || mClosed )
+        return;
+
+    if ( mLinked && now - mLastReceived >= std::chrono::milliseconds ( kLinkTimeout ) )
+    {
+        if ( mRole == UPSTREAM )
+        {
+            mClosed = true;
+            return;
+        }
+
+        Log::w () << "Nothing heard from the upstream relay (" << mHost << ":" << mListenPort << ") for "
+                  << kLinkTimeout / 1000 << " seconds. Reconnecting...";
+        Reconnect ();
+    }
+
+    if ( !mLinked )
+    {
+        if ( now - mLastHandshake >= std::chrono::milliseconds ( kHandshakeInterval ) )
+        {
+            SendControl ( kHello, mToken, true );
+            mLastHandshake = now;
+        }
+
+        return;
+    }
+
+    // The downstream relay may not know about the link until it says something.
+    if ( mRole == UPSTREAM && !mConfirmed && now - mLastHandshake >= std::chrono::milliseconds ( kHandshakeInterval ) )
+    {
+        SendControl ( kWelcome, mToken, true );
+        mLastHandshake = now;
+    }
+
+    for ( auto u = mUnacked.begin (); u != mUnacked.end (); ++u )
+    {
+        if ( now - u -> sent < RetransmitTimeout ( u -> retries ) )
+            continue;
+
+        if ( SendDatagram ( u -> datagram -> Data (), u -> datagram -> Length () ) < 0 && WouldBlock () )
+            break;
+
+        u -> sent = now;
+        u -> retries += 1;
+        mRetransmitted += 1;
+    }
+
+    if ( now - mLastSent >= std::chrono::milliseconds ( kKeepAliveInterval ) )
+        SendControl ( kPing, 0, false );
+}
+
+int RelayUDPSocket::Timeout () const
+{
+    Clock::time_point now = Clock::now ();
+    Clock::time_point due;
+    long timeout;
+
+    if ( mRole == LISTENER || mClosed )
+        return -1;
+
+    if ( !mLinked )
+    {
+        due = mLastHandshake + std::chrono::milliseconds ( kHandshakeInterval );
+    }
+    else
+    {
+        due = std::min ( mLastSent + std::chrono::milliseconds ( kKeepAliveInterval ),
+                         mLastReceived + std::chrono::milliseconds ( kLinkTimeout ) );
+
+        if ( mRole == UPSTREAM && !mConfirmed )
+            due = std::min ( due, mLastHandshake + std::chrono::milliseconds ( kHandshakeInterval ) );
+
+        for ( auto u = mUnacked.begin (); u != mUnacked.end (); ++u )
+        {
+            due = std::min ( due, u -> sent + RetransmitTimeout ( u -> retries ) );
+        }
+    }
+
+    // Round up, so that nothing is early when the wait is over.
+    timeout = std::chrono::duration_cast< std::chrono::milliseconds > ( due - now + std::chrono::microseconds ( 999 ) ).count ();
+
+    return timeout < 0 ? 0 : static_cast<int> ( timeout );
+}
+
+std::string RelayUDPSocket::Summary () const
+{
+    std::ostringstream summary;
+
+    summary << mSentReliable << " reliable messages sent, " << mRetransmitted << " retransmitted, "
+            << static_cast<unsigned long> ( mUnacked.size () ) << " waiting for acknowledgement, "
+            << mStaleUpdates << " stale car updates dropped, round trip "
+            << static_cast<long> ( std::chrono::duration_cast< std::chrono::milliseconds > ( mSmoothedRtt ).count () ) << " ms, "
+            << mLinks << ( mLinks == 1 ? " link." : " links." );
+
+    return summary.str ();
+}
+
+RelayUDPSocket::~RelayUDPSocket ()
+{
+    // Spare the other end the wait before it notices.
+    if ( mRole != LISTENER && mLinked )
+        SendControl ( kBye, 0, false );
+
+    for ( auto u = mUnacked.begin (); u != mUnacked.end (); ++u )
+    {
+        u -> datagram -> Release ();
+    }
+
+    for ( auto e = mEarly.begin (); e != mEarly.end (); ++e )
+    {
+        e -> second -> Release ();
+    }
+
+    close ( mSockFd );
+}
@@ -0,0 +1,284 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _relayudpsocket_h
+#define _relayudpsocket_h
+
+#include "packetbuffer.h"
+#include "socket.h"
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <utility>
+
+/**
+ * @class RelayUDPSocket
+ * @brief Link between two relays over UDP, for chains of relays where a
+ *        lost TCP segment would hold back every car update behind it.
+ *        Subclass of the Socket virtual class.
+ *
+ *        Every datagram starts with a kind byte. Messages are either:
+ *
+ *         - reliable (everything but car updates): numbered, acknowledged,
+ *           retransmitted until they are, and handed to the reader in the
+ *           order they were sent.
+ *
+ *         - unreliable (ACSP_CAR_UPDATE): numbered, never retransmitted,
+ *           and handed to the reader as soon as they arrive, unless a newer
+ *           update about the same car already got there.
+ *
+ *        The downstream relay sends HELLO datagrams to the upstream relay's
+ *        listening socket, which answers with WELCOME from a socket made
+ *        for that link alone. Each end sends PING when it has been quiet for
+ *        a while. A downstream relay that hears nothing for too long, or
+ *        gets BYE, says hello again and starts a new link, which the
+ *        upstream relay brings up to date like any new downstream relay.
+ */
+class RelayUDPSocket : public Socket
+{
+
+public:
+
+    // CTOR/DCTOR
+
+    /**
+     * @brief Constructs the socket on which the upstream relay listens for HELLO.
+     * @param listen_port UDP port on which to listen.
+     */
+    RelayUDPSocket ( const unsigned int listen_port );
+    /**
+     * @brief Constructs the downstream relay's end of a link.
+     *        Nothing is sent until Connect() is called.
+     * @param host Address of the upstream relay.
+     * @param remote_port UDP port on which the upstream relay listens.
+     */
+    RelayUDPSocket ( const std::string host, const unsigned int remote_port );
+    /**
+     * @brief RelayUDPSocket destructor. Says BYE to the other end of the link.
+     */
+    virtual ~RelayUDPSocket ();
+
+    // METHODS
+
+    /**
+     * @brief Sends a message to the other end of the link.
+     *        Reliable messages are kept until they're acknowledged.
+     *        Car updates are dropped while the link is down.
+     * @param msg Array containing bytes.
+     * @param len Number of bytes in the array.
+     * @return -1 on error or if the socket would block (see Socket::WouldBlock),
+     *         otherwise the number of sent (or kept) bytes.
+     */
+    long Send ( const char* msg, const size_t len );
+    /**
+     * @brief Reads one message. Control datagrams (acknowledgements, PING,
+     *        handshake) are dealt with along the way.
+     * @param msg Pointer to a byte array to hold the incoming message.
+     * @param len Maximum number of bytes to read.
+     * @return 0 if the other end said BYE to an upstream relay's link, -1 on
+     *         error or if no message is available yet (see Socket::WouldBlock),
+     *         otherwise the size of the message.
+     */
+    long Read ( char *msg, const size_t len );
+    /**
+     * @brief Checks if a reliable message that arrived early is next in line.
+     * @return True if the next Read() will return it without touching the network.
+     */
+    bool HasPending () const;
+    /**
+     * @brief Reads a HELLO from the listening socket, and makes the socket
+     *        of the link it asks for. Repeated HELLOs are ignored: the
+     *        link's socket says WELCOME until it hears from the other end.
+     * @return Pointer to the new link's socket, or NULL once there's no HELLO
+     *         left to read (see Socket::WouldBlock).
+     */
+    RelayUDPSocket* Accept ();
+    /**
+     * @brief Says HELLO to the upstream relay until it answers.
+     * @param timeout Number of seconds after which to give up.
+     * @return Negative value if the upstream relay didn't answer, 0 once the link is up.
+     */
+    int Connect ( unsigned short timeout );
+    /**
+     * @brief Retransmits what hasn't been acknowledged in time, says PING
+     *        when the link has been quiet and notices when the other end
+     *        hasn't been heard of for too long.
+     */
+    void Maintain ();
+    /**
+     * @brief Computes how long Maintain() may wait.
+     * @return Milliseconds until Maintain() has something to do.
+     */
+    int Timeout () const;
+    /**
+     * @brief Checks if an upstream relay's link is over, because the other
+     *        end said BYE, went quiet, or fell too far behind.
+     * @return True if the link's peer should be removed.
+     */
+    bool Closed () const { return mClosed; }
+    /**
+     * @brief Checks if the downstream relay's link was started again since
+     *        the last call. The upstream relay has forgotten everything the
+     *        downstream relay asked for by then.
+     * @return True once after every new link.
+     */
+    bool Reconnected ();
+    /**
+     * @brief Describes the link's counters, for the statistics reports.
+     * @return Message, retransmission and loss counts, as text.
+     */
+    std::string Summary () const;
+
+private:
+
+    // TYPES
+
+    typedef std::chrono::high_resolution_clock Clock;
+
+    /**
+     * @brief Which end of the link the socket is.
+     */
+    enum Role {
+        LISTENER,   /*!< Upstream relay, waiting for HELLO. */
+        UPSTREAM,   /*!< Upstream relay's end of a link. */
+        DOWNSTREAM  /*!< Downstream relay's end of a link. */
+    };
+
+    /**
+     * @brief Reliable message waiting to be acknowledged.
+     */
+    struct Unacked
+    {
+        uint32_t seq;
+        PacketBuffer* datagram;
+        Clock::time_point sent;
+        unsigned int retries;
+    };
+
+    // CTOR
+
+    /**
+     * @brief Constructs the upstream relay's end of a link, which says WELCOME right away.
+     * @param peer Address of the downstream relay.
+     * @param token Token of the downstream relay's HELLO.
+     */
+    RelayUDPSocket ( const struct sockaddr_in& peer, const uint32_t token );
+
+    // METHODS
+
+    /**
+     * @brief Creates the UDP socket and binds it.
+     * @param local_port UDP port to bind, 0 for any.
+     */
+    void Open ( const unsigned int local_port );
+    /**
+     * @brief Sends a datagram to the other end of the link.
+     * @param data Array containing the datagram.
+     * @param len Size of the datagram.
+     * @return Same values as sendto().
+     */
+    long SendDatagram ( const char* data, const size_t len );
+    /**
+     * @brief Sends a datagram made of a kind byte and, optionally, a number.
+     * @param kind Kind of datagram.
+     * @param value Number following the kind byte.
+     * @param has_value False to send the kind byte alone.
+     */
+    void SendControl ( const char kind, const uint32_t value, const bool has_value );
+    /**
+     * @brief Takes note of an acknowledgement, dropping the messages it covers.
+     * @param next Sequence number of the first reliable message the other end hasn't got.
+     */
+    void Acknowledged ( const uint32_t next );
+    /**
+     * @brief Copies a reliable message that is next in line to the reader.
+     * @param msg Byte array receiving the message.
+     * @param len Size of the byte array.
+     * @return Size of the message, or -1 if it doesn't fit.
+     */
+    long DeliverPending ( char* msg, const size_t len );
+    /**
+     * @brief Forgets the link's state and says HELLO again, keeping the
+     *        reliable messages that weren't acknowledged for the next link.
+     */
+    void Reconnect ();
+    /**
+     * @brief Starts a new link after the upstream relay said WELCOME.
+     *        Reliable messages kept from the previous link are numbered
+     *        again and sent right away.
+     */
+    void Linked ();
+    /**
+     * @brief Computes how long a reliable message may wait for its acknowledgement.
+     * @param retries Number of times it's been retransmitted.
+     * @return Retransmission timeout.
+     */
+    Clock::duration RetransmitTimeout ( const unsigned int retries ) const;
+
+    // VARS
+
+    Role mRole;
+    bool mLinked;
+    bool mConfirmed;
+    bool mClosed;
+    bool mReconnected;
+    uint32_t mToken;
+    unsigned int mListenPort;
+
+    // Reliable messages going out and coming in.
+    uint32_t mNextSeq;
+    std::deque< Unacked > mUnacked;
+    uint32_t mNextExpected;
+    std::map< uint32_t, PacketBuffer* > mEarly;
+
+    // Car updates: only the freshest update about each car is handed over.
+    uint32_t mNextUnreliableSeq;
+    uint32_t mCarUpdateSeq[ 64 ];
+    uint64_t mCarUpdateSeen;
+
+    Clock::time_point mLastSent;
+    Clock::time_point mLastReceived;
+    Clock::time_point mLastHandshake;
+    Clock::duration mSmoothedRtt;
+
+    // HELLOs the listener answered lately, by address, port and token.
+    std::map< std::pair< uint64_t, uint32_t >, Clock::time_point > mAccepted;
+
+    char mDatagram[ PACKET_BUFFER_SIZE + 8 ];
+
+    unsigned long mSentReliable;
+    unsigned long mRetransmitted;
+    unsigned long mStaleUpdates;
+    unsigned long mLinks;
+
+    const static size_t kHeaderSize = 5;
+    const static size_t kMaxUnacked = 1024;
+    const static size_t kMaxEarly = 256;
+    const static int kHandshakeInterval = 250;
+    const static int kKeepAliveInterval = 1000;
+    const static int kLinkTimeout = 5000;
+    const static int kInitialRetransmit = 200;
+    const static int kMinRetransmit = 20;
+    const static int kMaxRetransmit = 1000;
+};
+
+#endif // _relayudpsocket_h
@@ -0,0 +1,150 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sessionsnapshot.h"
+#include "ACSProtocol.h"
+#include "log.h"
+
+SessionSnapshot::SessionSnapshot ()
+    : mVersion ( NULL ),
+      mSession ( NULL )
+{
+    for ( int i = 0; i < kMaxCars; i++ )
+    {
+        mConnection[ i ] = mLoaded[ i ] = mCarUpdate[ i ] = NULL;
+    }
+}
+
+void SessionSnapshot::Keep ( PacketBuffer*& slot, PacketBuffer* packet )
+{
+    if ( packet != NULL )
+        packet -> Retain ();
+
+    if ( slot != NULL )
+        slot -> Release ();
+
+    slot = packet;
+}
+
+void SessionSnapshot::Update ( PacketBuffer* packet )
+{
+    const char* msg = packet -> Data ();
+    long n = packet -> Length ();
+    int cid;
+
+    switch ( static_cast<int8_t> ( msg[ 0 ] ) )
+    {
+        case ACSProtocol::ACSP_VERSION:
+            // The server has just started, so whatever we knew is gone.
+            Clear ();
+            Keep ( mVersion, packet );
+            break;
+        case ACSProtocol::ACSP_NEW_SESSION:
+            Keep ( mSession, packet );
+            break;
+        case ACSProtocol::ACSP_SESSION_INFO:
+            // Only the current session's info, which follows the protocol
+            // version and the session index.
+            if ( n >= 4 && msg[ 2 ] == msg[ 3 ] )
+                Keep ( mSession, packet );
+            break;
+        case ACSProtocol::ACSP_NEW_CONNECTION:
+            cid = ACSProtocol::ConnectionCarId ( msg, n );
+
+            if ( cid >= 0 && cid < kMaxCars )
+            {
+                ForgetCar ( cid );
+                Keep ( mConnection[ cid ], packet );
+            }
+            break;
+        case ACSProtocol::ACSP_CONNECTION_CLOSED:
+            cid = ACSProtocol::ConnectionCarId ( msg, n );
+
+            if ( cid >= 0 && cid < kMaxCars )
+                ForgetCar ( cid );
+            break;
+        case ACSProtocol::ACSP_CLIENT_LOADED:
+            cid = n >= 2 ? static_cast<int8_t> ( msg[ 1 ] ) : -1;
+
+            if ( cid >= 0 && cid < kMaxCars )
+                Keep ( mLoaded[ cid ], packet );
+            break;
+        case ACSProtocol::ACSP_CAR_UPDATE:
+            cid = n >= 2 ? static_cast<int8_t> ( msg[ 1 ] ) : -1;
+
+            if ( cid >= 0 && cid < kMaxCars )
+                Keep ( mCarUpdate[ cid ], packet );
+            break;
+        default:
+            break;
+    }
+}
+
+void SessionSnapshot::Replay ( PeerConnection* peer, const CarInfoCache& car_info ) const
+{
+    PacketBuffer* packets[ 2 + 4 * kMaxCars ];
+    int n = 0;
+    int replayed = 0;
+
+    packets[ n++ ] = mVersion;
+    packets[ n++ ] = mSession;
+
+    for ( int i = 0; i < kMaxCars; i++ )
+    {
+        packets[ n++ ] = mConnection[ i ];
+        packets[ n++ ] = car_info.Get ( i );
+        packets[ n++ ] = mLoaded[ i ];
+        packets[ n++ ] = peer -> WantsCar ( i ) ? mCarUpdate[ i ] : NULL;
+    }
+
+    for ( int i = 0; i < n; i++ )
+    {
+        if ( packets[ i ] == NULL || !peer -> IsSubscribed ( static_cast<uint8_t> ( packets[ i ] -> Data ()[ 0 ] ) ) )
+            continue;
+
+        peer -> Preload ( packets[ i ] );
+        replayed += 1;
+    }
+
+    if ( replayed > 0 )
+        Log::v () << "Replaying " << replayed << " messages about the current session to " << peer -> Name () << ".";
+}
+
+void SessionSnapshot::ForgetCar ( const int cid )
+{
+    Keep ( mConnection[ cid ], NULL );
+    Keep ( mLoaded[ cid ], NULL );
+    Keep ( mCarUpdate[ cid ], NULL );
+}
+
+void SessionSnapshot::Clear ()
+{
+    Keep ( mVersion, NULL );
+    Keep ( mSession, NULL );
+
+    for ( int i = 0; i < kMaxCars; i++ )
+    {
+        ForgetCar ( i );
+    }
+}
+
+SessionSnapshot::~SessionSnapshot ()
+{
+    Clear ();
+}
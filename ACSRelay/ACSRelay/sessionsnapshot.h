@@ -0,0 +1,93 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _sessionsnapshot_h
+#define _sessionsnapshot_h
+
+#include "carinfocache.h"
+#include "packetbuffer.h"
+#include "peerconnection.h"
+
+/**
+ * @class SessionSnapshot
+ * @brief What a plugin would know about the current session had it been
+ *        listening all along: the server's version, the session, the
+ *        connected cars and the latest update of each of them.
+ *        The snapshot is replayed to every new peer, so downstream relays
+ *        that (re)connect don't have to ask the server for all of it.
+ *
+ *        Only the latest message of each kind is kept, as a reference to
+ *        the buffer the server message was delivered in.
+ */
+class SessionSnapshot
+{
+public:
+
+    // CTOR/DCTOR
+
+    SessionSnapshot ();
+    virtual ~SessionSnapshot ();
+
+    // METHODS
+
+    /**
+     * @brief Takes note of a message from the server.
+     * @param packet Buffer holding a valid server message.
+     */
+    void Update ( PacketBuffer* packet );
+    /**
+     * @brief Queues the snapshot on a peer that isn't served yet. It's sent
+     *        as soon as the peer is added to a PeerGroup.
+     * @param peer Pointer to the new PeerConnection.
+     * @param car_info Cache holding the latest ACSP_CAR_INFO of each car.
+     */
+    void Replay ( PeerConnection* peer, const CarInfoCache& car_info ) const;
+    /**
+     * @brief Forgets everything.
+     */
+    void Clear ();
+
+private:
+
+    // METHODS
+
+    /**
+     * @brief Replaces the message kept in a slot.
+     * @param slot Slot to be updated.
+     * @param packet Buffer holding the new message, or NULL to empty the slot.
+     */
+    static void Keep ( PacketBuffer*& slot, PacketBuffer* packet );
+    /**
+     * @brief Forgets everything about a car.
+     * @param cid Car ID as represented in Assetto Corsa.
+     */
+    void ForgetCar ( const int cid );
+
+    // VARS
+
+    const static int kMaxCars = 64;
+
+    PacketBuffer* mVersion;
+    PacketBuffer* mSession;
+    PacketBuffer* mConnection[ kMaxCars ];
+    PacketBuffer* mLoaded[ kMaxCars ];
+    PacketBuffer* mCarUpdate[ kMaxCars ];
+};
+
+#endif // _sessionsnapshot_h
@@ -0,0 +1,131 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shard.h"
+
+#include "acsrelay.h"
+#include "log.h"
+#include "sharedeventloop.h"
+
+#ifdef __linux__
+    #include <pthread.h>
+    #include <sched.h>
+#endif
+
+Shard::Shard ( const unsigned int id, EventLoop::Backend backend, EventLoop::Trigger trigger )
+    : mId ( id ),
+      mEventLoop ( EventLoop::Build ( backend, trigger ) )
+{
+    mMetrics.wakeups = 0;
+    mMetrics.events = 0;
+    mMetrics.busy_us = 0;
+}
+
+Shard::~Shard ()
+{
+    for ( auto r = mRelays.begin (); r != mRelays.end (); ++r )
+    {
+        delete *r;
+    }
+
+    delete mEventLoop;
+}
+
+bool Shard::Add ( const Configuration::RelayParams params )
+{
+    ACSRelay* relay = ACSRelay::Build ( params, mEventLoop );
+
+    if ( !relay -> Open () )
+    {
+        delete relay;
+        return false;
+    }
+
+    mRelays.push_back ( relay );
+
+    return true;
+}
+
+void Shard::Start ( const int cpu )
+{
+    mThread = std::thread ( &Shard::Run, this );
+
+    if ( cpu < 0 )
+        return;
+
+#ifdef __linux__
+    cpu_set_t set;
+
+    CPU_ZERO ( &set );
+    CPU_SET ( cpu, &set );
+
+    if ( pthread_setaffinity_np ( mThread.native_handle (), sizeof ( set ), &set ) != 0 )
+        Log::w () << "Couldn't pin shard " << mId << " to CPU " << cpu << ".";
+    else
+        Log::v () << "Shard " << mId << " pinned to CPU " << cpu << ".";
+#else
+    Log::w () << "Pinning shards to CPUs is not supported on this platform.";
+#endif
+}
+
+__attribute__((__noreturn__)) void Shard::Run ()
+{
+    EventLoop::Event ready[ kMaxReadyEvents ];
+    ACSRelay* relay;
+    Time woken, now;
+    int timeout, t;
+    int n;
+
+    while ( 1 )
+    {
+        timeout = -1;
+
+        for ( auto r = mRelays.begin (); r != mRelays.end (); ++r )
+        {
+            t = ( *r ) -> Timeout ();
+
+            if ( t >= 0 && ( timeout < 0 || t < timeout ) )
+                timeout = t;
+        }
+
+        n = mEventLoop -> Wait ( ready, kMaxReadyEvents, timeout );
+        woken = Clock::now ();
+
+        for ( int i = 0; i < n; i++ )
+        {
+            relay = static_cast<ACSRelay*> ( SharedEventLoop::Route ( ready[ i ] ) );
+            relay -> Dispatch ( ready[ i ] );
+        }
+
+        now = Clock::now ();
+
+        for ( auto r = mRelays.begin (); r != mRelays.end (); ++r )
+        {
+            ( *r ) -> Maintain ( now );
+        }
+
+        now = Clock::now ();
+
+        // Nobody else writes them, so there's no need for read-modify-write.
+        mMetrics.wakeups.store ( mMetrics.wakeups.load ( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+        mMetrics.events.store ( mMetrics.events.load ( std::memory_order_relaxed ) + ( n > 0 ? n : 0 ), std::memory_order_relaxed );
+        mMetrics.busy_us.store ( mMetrics.busy_us.load ( std::memory_order_relaxed ) +
+                                 std::chrono::duration_cast< std::chrono::microseconds > ( now - woken ).count (), std::memory_order_relaxed );
+    }
+}
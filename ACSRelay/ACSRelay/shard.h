@@ -0,0 +1,118 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _shard_h
+#define _shard_h
+
+#include "configuration.h"
+#include "eventloop.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+class ACSRelay;
+
+/**
+ * @class Shard
+ * @brief Set of AC servers relayed by the same thread, on the same EventLoop.
+ *        Nothing a shard changes is shared with the other shards, except
+ *        for its metrics, which any thread may read without locking.
+ *        Relays are added and opened before the shard is started. From then
+ *        on the shard's thread owns them, until the process exits.
+ */
+class Shard
+{
+public:
+
+    // TYPES
+
+    /**
+     * @struct Metrics
+     * @brief Counters updated by the shard's thread alone.
+     */
+    struct Metrics
+    {
+        std::atomic< unsigned long > wakeups; ///< Times the event loop returned.
+        std::atomic< unsigned long > events;  ///< Ready sockets dealt with.
+        std::atomic< unsigned long > busy_us; ///< Microseconds spent dealing with them.
+    };
+
+    // CTOR/DCTOR
+
+    /**
+     * @brief Shard object constructor.
+     * @param id Number used to identify the shard in the log.
+     * @param backend Backend of the shard's EventLoop.
+     * @param trigger Trigger mode of the shard's EventLoop.
+     */
+    Shard ( const unsigned int id, EventLoop::Backend backend, EventLoop::Trigger trigger );
+    /**
+     * @brief Shard destructor. Destroys the shard's relays.
+     *        Must not be called once the shard has been started.
+     */
+    virtual ~Shard ();
+
+    // METHODS
+
+    /**
+     * @brief Builds the relay of an AC server, opens it and hands it to the shard.
+     * @param params Configuration of the server and its plugins.
+     * @return False if the relay couldn't be opened, in which case it's destroyed.
+     */
+    bool Add ( const Configuration::RelayParams params );
+    /**
+     * @brief Retrieves the number of servers relayed by the shard.
+     * @return Number of servers.
+     */
+    size_t Size () const { return mRelays.size (); }
+    /**
+     * @brief Retrieves the number used to identify the shard in the log.
+     * @return Shard number.
+     */
+    unsigned int Id () const { return mId; }
+    /**
+     * @brief Starts the shard's thread.
+     * @param cpu CPU the thread is pinned to, or -1 to let the system move it around.
+     */
+    void Start ( const int cpu );
+    /**
+     * @brief Relays the shard's servers from the calling thread. Never returns.
+     */
+    void Run ();
+    /**
+     * @brief Retrieves the shard's counters.
+     * @return Reference to the counters, safe to read from any thread.
+     */
+    const Metrics& GetMetrics () const { return mMetrics; }
+
+private:
+
+    // VARS
+
+    unsigned int mId;
+    EventLoop* mEventLoop;
+    std::vector< ACSRelay* > mRelays;
+    std::thread mThread;
+    Metrics mMetrics;
+
+    const static int kMaxReadyEvents = 64;
+};
+
+#endif // _shard_h
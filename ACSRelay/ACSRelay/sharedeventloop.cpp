@@ -0,0 +1,102 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sharedeventloop.h"
+
+SharedEventLoop::SharedEventLoop ( EventLoop* loop, void* owner )
+    : EventLoop ( loop -> GetTrigger () ),
+      mLoop ( loop ),
+      mOwner ( owner )
+{
+}
+
+SharedEventLoop::~SharedEventLoop ()
+{
+    for ( auto s = mSources.begin (); s != mSources.end (); ++s )
+    {
+        mLoop -> Remove ( s -> first );
+        delete s -> second;
+    }
+}
+
+bool SharedEventLoop::Add ( const int fd, void* data )
+{
+    Source* source = new Source { this, data };
+
+    if ( !mLoop -> Add ( fd, source ) )
+    {
+        delete source;
+        return false;
+    }
+
+    mSources[ fd ] = source;
+
+    return true;
+}
+
+#ifdef __linux__
+bool SharedEventLoop::AddReceiver ( const int fd, void* data )
+{
+    Source* source = new Source { this, data };
+
+    if ( !mLoop -> AddReceiver ( fd, source ) )
+    {
+        delete source;
+        return false;
+    }
+
+    mSources[ fd ] = source;
+
+    return true;
+}
+#endif
+
+void SharedEventLoop::Remove ( const int fd )
+{
+    auto s = mSources.find ( fd );
+
+    if ( s == mSources.end () )
+        return;
+
+    mLoop -> Remove ( fd );
+    delete s -> second;
+    mSources.erase ( s );
+}
+
+void SharedEventLoop::SetWriteInterest ( const int fd, void* data, const bool enabled )
+{
+    auto s = mSources.find ( fd );
+
+    if ( s != mSources.end () )
+        mLoop -> SetWriteInterest ( fd, s -> second, enabled );
+}
+
+int SharedEventLoop::Wait ( Event* ready, const int max, const int timeout )
+{
+    return -1;
+}
+
+void* SharedEventLoop::Route ( Event& event )
+{
+    Source* source = static_cast<Source*> ( event.data );
+
+    event.data = source -> data;
+
+    return source -> loop -> mOwner;
+}
@@ -0,0 +1,101 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _sharedeventloop_h
+#define _sharedeventloop_h
+
+#include "eventloop.h"
+
+#include <map>
+
+/**
+ * @class SharedEventLoop
+ * @brief One user's share of an EventLoop that several users wait on together.
+ *        Descriptors are registered with the underlying loop, each with a
+ *        small record telling which user it belongs to and what it stands
+ *        for. Whoever waits on the underlying loop hands every ready
+ *        descriptor to Route() to find out who should deal with it.
+ */
+class SharedEventLoop : public EventLoop
+{
+public:
+
+    // CTOR/DCTOR
+
+    /**
+     * @brief SharedEventLoop object constructor.
+     * @param loop Underlying event loop. It isn't owned by the share.
+     * @param owner Pointer handed back by Route() for this share's descriptors.
+     */
+    SharedEventLoop ( EventLoop* loop, void* owner );
+    /**
+     * @brief SharedEventLoop destructor. Stops monitoring every descriptor
+     *        registered through the share.
+     */
+    virtual ~SharedEventLoop ();
+
+    // METHODS
+
+    bool Add ( const int fd, void* data );
+    void Remove ( const int fd );
+    void SetWriteInterest ( const int fd, void* data, const bool enabled );
+    /**
+     * @brief Not available: the underlying loop reports every share's
+     *        descriptors. Wait on it and use Route() instead.
+     * @return Always -1.
+     */
+    int Wait ( Event* ready, const int max, const int timeout );
+    Backend GetBackend () const { return mLoop -> GetBackend (); }
+    void Submit () { mLoop -> Submit (); }
+#ifdef __linux__
+    bool Receives () const { return mLoop -> Receives (); }
+    bool AddReceiver ( const int fd, void* data );
+    int Receive ( const int fd, struct mmsghdr* msgs, const unsigned int n ) { return mLoop -> Receive ( fd, msgs, n ); }
+    bool Transmits () const { return mLoop -> Transmits (); }
+    int Transmit ( const int fd, struct mmsghdr* msgs, const unsigned int n, const int flags ) { return mLoop -> Transmit ( fd, msgs, n, flags ); }
+    int Connect ( const int fd, const struct sockaddr* addr, const socklen_t len, const int timeout ) { return mLoop -> Connect ( fd, addr, len, timeout ); }
+#endif
+
+    /**
+     * @brief Finds out which share a descriptor reported by the underlying
+     *        loop belongs to, and what it was registered for.
+     * @param event Event reported by the underlying loop. Its data is
+     *        replaced by the pointer passed to the share's Add().
+     * @return Owner of the share the descriptor was registered through.
+     */
+    static void* Route ( Event& event );
+
+private:
+
+    // TYPES
+
+    struct Source
+    {
+        SharedEventLoop* loop;
+        void* data;
+    };
+
+    // VARS
+
+    EventLoop* mLoop;
+    void* mOwner;
+    std::map< int, Source* > mSources;
+};
+
+#endif // _sharedeventloop_h
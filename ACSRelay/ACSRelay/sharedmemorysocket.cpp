@@ -0,0 +1,188 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sharedmemorysocket.h"
+
+#include "acsrelay_shm.h"
+#include "log.h"
+
+#include <string.h>
+
+SharedMemorySocket::SharedMemorySocket ( const std::string name, const unsigned int size, const unsigned int local_port )
+    : UDPSocket ( local_port ),
+      mName ( name ),
+      mHeader ( NULL ),
+      mRing ( NULL ),
+      mSize ( kMinSize ),
+      mMapped ( 0 ),
+      mQueued ( 0 )
+{
+    acsr_shm_header* old;
+    struct stat st;
+    void* mem;
+    int fd;
+
+    while ( mSize < size && mSize < kMaxSize )
+        mSize *= 2;
+
+    mSize *= 1024;
+
+    // A ring left behind (by a relay that crashed, or still running with
+    // the same name). Its readers must open the new one.
+    fd = shm_open ( mName.c_str (), O_RDWR, 0 );
+
+    if ( fd >= 0 )
+    {
+        if ( fstat ( fd, &st ) == 0 && static_cast<size_t> ( st.st_size ) >= sizeof ( acsr_shm_header ) )
+        {
+            mem = mmap ( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+
+            if ( mem != MAP_FAILED )
+            {
+                old = static_cast<acsr_shm_header*> ( mem );
+
+                if ( __atomic_load_n ( &old -> magic, __ATOMIC_ACQUIRE ) == ACSR_SHM_MAGIC )
+                    Close ( old );
+
+                munmap ( mem, st.st_size );
+            }
+        }
+
+        close ( fd );
+        shm_unlink ( mName.c_str () );
+        Log::w () << "Replaced the shared memory ring " << mName << " left by another relay.";
+    }
+
+    fd = shm_open ( mName.c_str (), O_RDWR | O_CREAT | O_EXCL, 0660 );
+
+    if ( fd < 0 )
+    {
+        Log::e () << "Failed to create the shared memory ring " << mName << ": " << strerror ( errno );
+        return;
+    }
+
+    mMapped = sizeof ( acsr_shm_header ) + mSize;
+
+    if ( ftruncate ( fd, mMapped ) < 0 ||
+         ( mem = mmap ( NULL, mMapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 ) ) == MAP_FAILED )
+    {
+        Log::e () << "Failed to map the shared memory ring " << mName << ": " << strerror ( errno );
+        close ( fd );
+        shm_unlink ( mName.c_str () );
+        return;
+    }
+
+    close ( fd );
+
+    mHeader = static_cast<acsr_shm_header*> ( mem );
+    mRing = reinterpret_cast<char*> ( mHeader + 1 );
+
+    mHeader -> version = ACSR_SHM_VERSION;
+    mHeader -> size = mSize;
+
+    // Readers don't touch the ring until it's marked as ready.
+    __atomic_store_n ( &mHeader -> magic, ACSR_SHM_MAGIC, __ATOMIC_RELEASE );
+}
+
+SharedMemorySocket::~SharedMemorySocket ()
+{
+    if ( mHeader == NULL )
+        return;
+
+    Close ( mHeader );
+    munmap ( mHeader, mMapped );
+    shm_unlink ( mName.c_str () );
+}
+
+void SharedMemorySocket::Close ( acsr_shm_header* header )
+{
+    __atomic_store_n ( &header -> closed, 1, __ATOMIC_SEQ_CST );
+    __atomic_add_fetch ( &header -> futex, 1, __ATOMIC_SEQ_CST );
+    syscall ( SYS_futex, &header -> futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0 );
+}
+
+long SharedMemorySocket::Send ( const char* msg, const size_t len )
+{
+    if ( Queue ( msg, len ) < 0 )
+        return -1;
+
+    Flush ();
+    return len;
+}
+
+long SharedMemorySocket::Queue ( const char* msg, const size_t len )
+{
+    uint64_t reserve, offset, skip, record;
+    uint32_t length;
+
+    record = acsr_shm_record_size ( len );
+
+    if ( mHeader == NULL || record > mSize / 2 )
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    reserve = mHeader -> reserve;
+    offset = reserve & ( mSize - 1 );
+
+    // Records never wrap. If this one doesn't fit before the end of the
+    // ring, tell the readers to start over from the beginning.
+    skip = offset + record > mSize ? mSize - offset : 0;
+
+    // Claim the space before overwriting it, so that readers who were
+    // still reading the old records find out they've been overrun.
+    __atomic_store_n ( &mHeader -> reserve, reserve + skip + record, __ATOMIC_RELAXED );
+    __atomic_thread_fence ( __ATOMIC_RELEASE );
+
+    if ( skip > 0 )
+    {
+        length = ACSR_SHM_WRAP;
+        memcpy ( mRing + offset, &length, sizeof ( length ) );
+        offset = 0;
+    }
+
+    length = static_cast<uint32_t> ( len );
+    memcpy ( mRing + offset, &length, sizeof ( length ) );
+    memcpy ( mRing + offset + sizeof ( length ), msg, len );
+
+    mQueued++;
+
+    return len;
+}
+
+unsigned int SharedMemorySocket::Flush ()
+{
+    unsigned int published = mQueued;
+
+    if ( mHeader == NULL || mQueued == 0 )
+        return published;
+
+    __atomic_store_n ( &mHeader -> write, mHeader -> reserve, __ATOMIC_SEQ_CST );
+    __atomic_add_fetch ( &mHeader -> futex, 1, __ATOMIC_SEQ_CST );
+
+    // Most of the time the plugins are busy, or poll the ring themselves.
+    // Only pay for the system call when somebody is asleep.
+    if ( __atomic_load_n ( &mHeader -> waiters, __ATOMIC_SEQ_CST ) > 0 )
+        syscall ( SYS_futex, &mHeader -> futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0 );
+
+    mQueued = 0;
+
+    return published;
+}
@@ -0,0 +1,139 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _sharedmemorysocket_h
+#define _sharedmemorysocket_h
+
+#include "udpsocket.h"
+
+#include <stdint.h>
+
+struct acsr_shm_header;
+
+/**
+ * @class SharedMemorySocket
+ * @brief Sends server messages to every plugin on this machine at once,
+ *        through a ring in shared memory (Linux only).
+ *        Each message is written to the ring once, however many plugins
+ *        read it. The plugins read the ring with the functions in
+ *        acsrelay_shm.h, and send their commands as UDP datagrams to the
+ *        port the socket is bound to, just like any other plugin.
+ *        Writing never blocks: plugins that fall too far behind skip
+ *        the messages they missed.
+ */
+class SharedMemorySocket : public UDPSocket
+{
+
+public:
+
+    // CTOR/DCTOR
+
+    /**
+     * @brief SharedMemorySocket object constructor.
+     *        Creates the ring, replacing any ring left with the same name.
+     *        Plugins still reading the old ring are told it's closed.
+     * @param name Name of the shared memory object (e.g.: /acsrelay).
+     * @param size Size of the ring in KiB. Rounded up to a power of two, 64 at least.
+     * @param local_port Port on which to listen for the plugins' commands.
+     */
+    SharedMemorySocket ( const std::string name, const unsigned int size, const unsigned int local_port );
+    /**
+     * @brief SharedMemorySocket destructor. Tells the plugins the ring is
+     *        closed and removes it.
+     */
+    virtual ~SharedMemorySocket ();
+
+    // METHODS
+
+    /**
+     * @brief Checks if the ring was created.
+     * @return True if messages can be written to the ring.
+     */
+    bool Ready () const { return mHeader != NULL; }
+    /**
+     * @brief Retrieves the name of the ring.
+     * @return Name of the shared memory object.
+     */
+    std::string Name () const { return mName; }
+    /**
+     * @brief Retrieves the size of the ring.
+     * @return Size in bytes.
+     */
+    uint64_t Size () const { return mSize; }
+    /**
+     * @brief Writes a message to the ring and wakes the plugins waiting for it.
+     * @param msg Array containing bytes.
+     * @param len Number of bytes in the array.
+     * @return -1 if the message can't be written at all, otherwise len.
+     */
+    long Send ( const char* msg, const size_t len );
+    /**
+     * @brief Writes a message to the ring. The plugins don't see it until
+     *        the next Flush() call. The message is copied.
+     * @param msg Array containing bytes.
+     * @param len Number of bytes in the array.
+     * @return -1 if the message can't be written at all, otherwise len.
+     */
+    long Queue ( const char* msg, const size_t len );
+    /**
+     * @brief Lets the plugins see the messages written by Queue(), and
+     *        wakes the ones waiting for them. Never blocks.
+     * @return Number of messages made visible, i.e. every queued one.
+     */
+    unsigned int Flush ();
+    /**
+     * @brief Retrieves the number of messages the plugins can't see yet.
+     * @return Number of messages.
+     */
+    unsigned int Queued () const { return mQueued; }
+    /**
+     * @brief Forgets the messages written by Queue(). They are still in
+     *        the ring and become visible on the next Flush().
+     */
+    void ClearQueue () { mQueued = 0; }
+    /**
+     * @brief Every plugin reading the ring gets every message written to it.
+     * @return Always true.
+     */
+    bool HasManyReaders () const { return true; }
+
+private:
+
+    // METHODS
+
+    /**
+     * @brief Tells the plugins reading a ring that it's closed.
+     * @param header Pointer to the start of the ring.
+     */
+    static void Close ( struct acsr_shm_header* header );
+
+    // VARS
+
+    std::string mName;
+    struct acsr_shm_header* mHeader;
+    char* mRing;
+    uint64_t mSize;
+    size_t mMapped;
+    unsigned int mQueued;
+
+    const static unsigned int kMinSize = 64;
+    const static unsigned int kMaxSize = 1024 * 1024;
+};
+
+#endif // _sharedmemorysocket_h
@@ -0,0 +1,44 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "socket.h"
+
+#ifndef _WIN32
+    #include <fcntl.h>
+#endif
+
+void Socket::SetBlocking( const bool blocking )
+{
+#ifdef _WIN32
+    unsigned long nonblocking;
+    nonblocking = blocking ? 0 : 1;
+    ioctlsocket ( mSockFd, FIONBIO, &nonblocking );
+#else
+    int opts;
+
+    opts = fcntl ( mSockFd, F_GETFL );
+
+    if ( blocking )
+        opts = opts & ( ~O_NONBLOCK );
+    else
+        opts = opts | O_NONBLOCK;
+
+    fcntl ( mSockFd, F_SETFL, opts );
+#endif
+}
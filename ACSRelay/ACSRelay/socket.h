@@ -35,6 +35,24 @@
     #include <arpa/inet.h>
 #endif
 
+#include <errno.h>
+
+// Reads are only issued once the event loop reports a socket as readable,
+// so they never have to block. Where the platform allows it, ask for that
+// explicitly so that draining an edge-triggered socket stops at EAGAIN.
+#ifdef MSG_DONTWAIT
+    #define SOCKET_READ_FLAGS MSG_DONTWAIT
+#else
+    #define SOCKET_READ_FLAGS 0
+#endif
+
+// A peer closing its connection must not kill the relay with SIGPIPE.
+#ifdef MSG_NOSIGNAL
+    #define SOCKET_SEND_FLAGS MSG_NOSIGNAL
+#else
+    #define SOCKET_SEND_FLAGS 0
+#endif
+
 /**
  * @brief Provides abstraction over socket communication.
  *        Class that provides basic abstraction over socket communcation.
@@ -107,7 +125,49 @@ public:
      * @param len Number of bytes in the array.
      * @return -1 on error, otherwise the number of sent bytes.
      */
-    virtual long Send ( const char* msg, const size_t len ) const = 0;
+    virtual long Send ( const char* msg, const size_t len ) = 0;
+    /**
+     * @brief Queue bytes to be sent by the next Flush() call.
+     *        The bytes are not copied, so they must stay valid until then.
+     *        Sockets that can't send in batches send the bytes right away.
+     * @param msg Array containing bytes.
+     * @param len Number of bytes in the array.
+     * @return -1 on error, otherwise the number of queued (or sent) bytes.
+     */
+    virtual long Queue ( const char* msg, const size_t len ) { return Send ( msg, len ); }
+    /**
+     * @brief Sends the messages queued by Queue(), until the socket would block.
+     *        Messages that couldn't be sent stay queued until ClearQueue()
+     *        is called, so that the caller can keep them for later.
+     * @return Index of the first message that couldn't be sent.
+     */
+    virtual unsigned int Flush () { return 0; }
+    /**
+     * @brief Retrieves the number of messages queued by Queue().
+     * @return Number of messages.
+     */
+    virtual unsigned int Queued () const { return 0; }
+    /**
+     * @brief Forgets every message queued by Queue().
+     */
+    virtual void ClearQueue () {}
+    /**
+     * @brief Checks if there are queued bytes waiting for Flush().
+     * @return True if Flush() has something to send.
+     */
+    bool HasQueued () const { return Queued () > 0; }
+    /**
+     * @brief Tries to send what's left of a partially sent message.
+     *        Stream sockets may accept only part of a message when they
+     *        are non-blocking. The rest must go out before anything else.
+     * @return True if nothing is left to send.
+     */
+    virtual bool SendUnsent () { return true; }
+    /**
+     * @brief Checks if part of a message is still waiting to be sent.
+     * @return True if SendUnsent() has something to send.
+     */
+    virtual bool HasUnsent () const { return false; }
     /**
      * @brief Read bytes from the socket (if any available).
      * @param msg Pointer to a byte array to hold the incoming data.
@@ -115,7 +175,55 @@ public:
      * @return -1 on error, otherwise the number of read bytes.
      */
     virtual long Read ( char *msg, const size_t len ) = 0;
+    /**
+     * @brief Checks if the socket already holds a complete message that
+     *        can be read without touching the network.
+     *        Stream sockets may receive several messages at once. Since the
+     *        event loop only knows about the underlying descriptor, the
+     *        remaining messages must be read before waiting again.
+     * @return True if the next Read() will return a buffered message.
+     */
+    virtual bool HasPending () const { return false; }
+    /**
+     * @brief Checks if several plugins read what's sent through the socket.
+     *        They then share every message, including car updates at the
+     *        shortest interval any of them asked for.
+     * @return True if the socket has more than one reader.
+     */
+    virtual bool HasManyReaders () const { return false; }
+    /**
+     * @brief Switches the socket between blocking and non-blocking mode.
+     * @param blocking True to make the socket blocking.
+     */
+    void SetBlocking ( const bool blocking );
+    /**
+     * @brief Checks if the last failed Read() or Send() call failed only
+     *        because the operation would have blocked.
+     * @return True if there was simply nothing to do on the socket.
+     */
+    static bool WouldBlock ()
+    {
+#ifdef _WIN32
+        return WSAGetLastError () == WSAEWOULDBLOCK;
+#else
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+    }
 protected:
+
+    // METHODS
+
+    /**
+     * @brief Makes WouldBlock() return true for the current operation.
+     */
+    static void SetWouldBlock ()
+    {
+#ifdef _WIN32
+        WSASetLastError ( WSAEWOULDBLOCK );
+#else
+        errno = EWOULDBLOCK;
+#endif
+    }
     
     // VARS
     
@@ -0,0 +1,127 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _spscring_h
+#define _spscring_h
+
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+
+/**
+ * @class SpscRing
+ * @brief Fixed size lock-free queue between exactly two threads.
+ *        One thread (the producer) only calls Push(), the other one
+ *        (the consumer) only calls Pop(). Neither of them ever waits
+ *        for the other.
+ */
+template <class T>
+class SpscRing
+{
+public:
+
+    // CTOR
+
+    /**
+     * @brief SpscRing object constructor.
+     * @param size Minimum number of elements the ring can hold. It is
+     *             rounded up to a power of two.
+     */
+    SpscRing ( const size_t size )
+        : mHead ( 0 ),
+          mTail ( 0 )
+    {
+        mMask = 1;
+
+        while ( mMask < size )
+            mMask <<= 1;
+
+        mSlots.resize ( mMask );
+        mMask -= 1;
+    }
+
+    // METHODS
+
+    /**
+     * @brief Adds an element at the end of the ring. Producer only.
+     * @param element Element to copy into the ring.
+     * @return False if the ring is full.
+     */
+    bool Push ( const T& element )
+    {
+        size_t head = mHead.load ( std::memory_order_relaxed );
+
+        if ( head - mTail.load ( std::memory_order_acquire ) > mMask )
+            return false;
+
+        mSlots[ head & mMask ] = element;
+        mHead.store ( head + 1, std::memory_order_release );
+
+        return true;
+    }
+
+    /**
+     * @brief Removes the element at the front of the ring. Consumer only.
+     * @param element Will be set to the removed element.
+     * @return False if the ring is empty.
+     */
+    bool Pop ( T& element )
+    {
+        size_t tail = mTail.load ( std::memory_order_relaxed );
+
+        if ( tail == mHead.load ( std::memory_order_acquire ) )
+            return false;
+
+        // Moving out of the slot releases whatever the element holds
+        // right away, instead of when the slot gets reused.
+        element = std::move ( mSlots[ tail & mMask ] );
+        mTail.store ( tail + 1, std::memory_order_release );
+
+        return true;
+    }
+
+    /**
+     * @brief Checks if the ring is empty.
+     *        The other thread may change the answer right after it's been
+     *        given. The producer uses it to decide whether the consumer
+     *        has to be woken up.
+     * @return True if there is nothing to Pop().
+     */
+    bool Empty () const
+    {
+        return mTail.load ( std::memory_order_acquire ) == mHead.load ( std::memory_order_acquire );
+    }
+
+private:
+
+    // VARS
+
+    std::vector< T > mSlots;
+    size_t mMask;
+
+    // Each index is only written by one of the threads. Keep them on
+    // separate cache lines so that the threads don't slow each other down.
+    char mPadding0[ 64 ];
+    std::atomic< size_t > mHead;
+    char mPadding1[ 64 ];
+    std::atomic< size_t > mTail;
+    char mPadding2[ 64 ];
+};
+
+#endif // _spscring_h
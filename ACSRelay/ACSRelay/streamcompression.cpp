@@ -0,0 +1,172 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "streamcompression.h"
+
+#include <chrono>
+#include <sstream>
+#include <string.h>
+
+typedef std::chrono::high_resolution_clock Clock;
+
+StreamCompression::StreamCompression ( const Direction direction )
+    : mDirection ( direction ),
+      mValid ( false ),
+      mInputStart ( 0 ),
+      mFull ( false ),
+      mPlainBytes ( 0 ),
+      mCompressedBytes ( 0 ),
+      mMicros ( 0 )
+{
+#ifdef _ENABLE_COMPRESSION
+    memset ( &mStream, 0, sizeof ( mStream ) );
+
+    if ( mDirection == DEFLATE )
+        mValid = deflateInit ( &mStream, Z_DEFAULT_COMPRESSION ) == Z_OK;
+    else
+        mValid = inflateInit ( &mStream ) == Z_OK;
+#endif
+}
+
+bool StreamCompression::Deflate ( const char* data, const size_t len, std::vector< char >& out, const bool flush )
+{
+#ifdef _ENABLE_COMPRESSION
+    Clock::time_point start = Clock::now ();
+    size_t before = out.size ();
+    int status;
+
+    if ( !mValid || mDirection != DEFLATE )
+        return false;
+
+    mStream.next_in = reinterpret_cast<Bytef*> ( const_cast<char*> ( data ) );
+    mStream.avail_in = static_cast<uInt> ( len );
+
+    // zlib tells it has nothing more to output by leaving room in the
+    // output buffer.
+    do
+    {
+        out.resize ( out.size () + kChunkSize );
+
+        mStream.next_out = reinterpret_cast<Bytef*> ( out.data () + out.size () - kChunkSize );
+        mStream.avail_out = kChunkSize;
+
+        status = deflate ( &mStream, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH );
+
+        out.resize ( out.size () - mStream.avail_out );
+
+        if ( status != Z_OK && status != Z_BUF_ERROR )
+        {
+            mValid = false;
+            return false;
+        }
+    }
+    while ( mStream.avail_out == 0 );
+
+    mPlainBytes += len;
+    mCompressedBytes += out.size () - before;
+    mMicros += std::chrono::duration_cast< std::chrono::microseconds > ( Clock::now () - start ).count ();
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+void StreamCompression::Input ( const char* data, const size_t len )
+{
+    // Drop what's been decompressed already before making room.
+    if ( mInputStart > 0 )
+    {
+        mInput.erase ( mInput.begin (), mInput.begin () + mInputStart );
+        mInputStart = 0;
+    }
+
+    mInput.insert ( mInput.end (), data, data + len );
+    mCompressedBytes += len;
+}
+
+long StreamCompression::Inflate ( char* out, const size_t len )
+{
+#ifdef _ENABLE_COMPRESSION
+    Clock::time_point start = Clock::now ();
+    long n;
+    int status;
+
+    if ( !mValid || mDirection != INFLATE )
+        return -1;
+
+    mStream.next_in = reinterpret_cast<Bytef*> ( mInput.data () + mInputStart );
+    mStream.avail_in = static_cast<uInt> ( mInput.size () - mInputStart );
+    mStream.next_out = reinterpret_cast<Bytef*> ( out );
+    mStream.avail_out = static_cast<uInt> ( len );
+
+    status = inflate ( &mStream, Z_SYNC_FLUSH );
+
+    if ( status != Z_OK && status != Z_BUF_ERROR )
+    {
+        mValid = false;
+        return -1;
+    }
+
+    n = len - mStream.avail_out;
+
+    mInputStart = mInput.size () - mStream.avail_in;
+    mFull = ( mStream.avail_out == 0 );
+
+    if ( mInputStart == mInput.size () )
+    {
+        mInput.clear ();
+        mInputStart = 0;
+    }
+
+    mPlainBytes += n;
+    mMicros += std::chrono::duration_cast< std::chrono::microseconds > ( Clock::now () - start ).count ();
+
+    return n;
+#else
+    return -1;
+#endif
+}
+
+std::string StreamCompression::Summary () const
+{
+    std::ostringstream summary;
+
+    summary << static_cast<unsigned long long> ( mPlainBytes ) << " bytes "
+            << ( mDirection == DEFLATE ? "compressed to " : "decompressed from " )
+            << static_cast<unsigned long long> ( mCompressedBytes );
+
+    if ( mPlainBytes > 0 )
+        summary << " (" << static_cast<unsigned long long> ( mCompressedBytes * 100 / mPlainBytes ) << "%)";
+
+    summary << ", " << static_cast<unsigned long long> ( mMicros / 1000 ) << " ms spent "
+            << ( mDirection == DEFLATE ? "compressing." : "decompressing." );
+
+    return summary.str ();
+}
+
+StreamCompression::~StreamCompression ()
+{
+#ifdef _ENABLE_COMPRESSION
+    if ( mDirection == DEFLATE )
+        deflateEnd ( &mStream );
+    else
+        inflateEnd ( &mStream );
+#endif
+}
@@ -0,0 +1,138 @@
+/*
+ Copyright 2015 Victor Nicolae.
+
+ This file is part of ACSRelay.
+
+ ACSRelay is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ACSRelay is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _streamcompression_h
+#define _streamcompression_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#ifdef _ENABLE_COMPRESSION
+    #include <zlib.h>
+#endif
+
+/**
+ * @class StreamCompression
+ * @brief One direction of a compressed (zlib) byte stream. Keeps counters
+ *        of the bytes on both sides and of the time spent (de)compressing,
+ *        which tell whether it's worth it for a given link.
+ *
+ *        Without zlib at build time, Valid() is always false.
+ */
+class StreamCompression
+{
+public:
+
+    /**
+     * @brief What the stream does to the bytes it's given.
+     */
+    enum Direction {
+        DEFLATE, /*!< Compresses. */
+        INFLATE  /*!< Decompresses. */
+    };
+
+    // CTOR/DCTOR
+
+    /**
+     * @brief StreamCompression object constructor.
+     * @param direction Whether the stream compresses or decompresses.
+     */
+    StreamCompression ( const Direction direction );
+    virtual ~StreamCompression ();
+
+    // METHODS
+
+    /**
+     * @brief Checks if the stream is usable.
+     * @return False if zlib isn't available or couldn't be initialized.
+     */
+    bool Valid () const { return mValid; }
+    /**
+     * @brief Compresses bytes. Whatever zlib outputs is appended to out.
+     * @param data Bytes to compress. May be NULL if len is 0.
+     * @param len Number of bytes.
+     * @param out Vector receiving the compressed bytes.
+     * @param flush True to output everything compressed so far, so that
+     *        the other end can decompress it right away.
+     * @return False on error.
+     */
+    bool Deflate ( const char* data, const size_t len, std::vector< char >& out, const bool flush );
+    /**
+     * @brief Adds compressed bytes to the ones waiting to be decompressed.
+     * @param data Compressed bytes.
+     * @param len Number of bytes.
+     */
+    void Input ( const char* data, const size_t len );
+    /**
+     * @brief Decompresses as much of the waiting input as fits.
+     * @param out Buffer receiving the decompressed bytes.
+     * @param len Size of the buffer.
+     * @return Number of decompressed bytes, or -1 if the stream is corrupt.
+     */
+    long Inflate ( char* out, const size_t len );
+    /**
+     * @brief Checks if Inflate() may output something without more input.
+     * @return True if there's input left, or the last Inflate() ran out of room.
+     */
+    bool HasPending () const { return mInputStart < mInput.size () || mFull; }
+    /**
+     * @brief Retrieves the number of uncompressed bytes that went through the stream.
+     * @return Number of bytes.
+     */
+    uint64_t PlainBytes () const { return mPlainBytes; }
+    /**
+     * @brief Retrieves the number of compressed bytes that went through the stream.
+     * @return Number of bytes.
+     */
+    uint64_t CompressedBytes () const { return mCompressedBytes; }
+    /**
+     * @brief Retrieves the time spent in zlib (de)compressing, which doesn't block.
+     * @return Number of microseconds.
+     */
+    uint64_t Micros () const { return mMicros; }
+    /**
+     * @brief Describes the counters, for the statistics reports.
+     * @return Compression ratio and time spent, as text.
+     */
+    std::string Summary () const;
+
+private:
+
+    // VARS
+
+    Direction mDirection;
+    bool mValid;
+#ifdef _ENABLE_COMPRESSION
+    z_stream mStream;
+#endif
+
+    std::vector< char > mInput;
+    size_t mInputStart;
+    bool mFull;
+
+    uint64_t mPlainBytes;
+    uint64_t mCompressedBytes;
+    uint64_t mMicros;
+
+    const static size_t kChunkSize = 4096;
+};
+
+#endif // _streamcompression_h
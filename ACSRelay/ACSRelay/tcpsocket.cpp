@@ -17,11 +17,16 @@
  along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "ACSProtocol.h"
+#include "bufferpool.h"
+#include "eventloop.h"
 #include "log.h"
 #include "tcpsocket.h"
 
 #ifdef _WIN32
     #include <ws2tcpip.h>
+#else
+    #include <netinet/tcp.h>
 #endif
 
 #include <fcntl.h>
@@ -29,14 +34,405 @@
 #include <unistd.h>
 #include <string.h>
 
-long TCPSocket::Send ( const char* msg, const size_t len ) const
+/**
+ * @brief Makes Socket::WouldBlock() report whether the last read failed
+ *        only because no complete frame was available.
+ */
+static void SetReadError ( const bool would_block )
+{
+#ifdef _WIN32
+    WSASetLastError ( would_block ? WSAEWOULDBLOCK : WSAEMSGSIZE );
+#else
+    errno = would_block ? EWOULDBLOCK : EMSGSIZE;
+#endif
+}
+
+long TCPSocket::Send ( const char* msg, const size_t len )
+{
+    char frame[ TCP_BUFFER_SIZE ];
+    char encoded[ CarUpdateCodec::kMaxEncodedSize ];
+    const char* payload = msg;
+    size_t size = len;
+    size_t sent = 0;
+    long n;
+
+    // Empty frames would be indistinguishable from a closed connection
+    // once read, so don't bother sending them.
+    if ( len == 0 )
+        return 0;
+
+    if ( len > TCP_BUFFER_SIZE - kFrameHeaderSize )
+        return -1;
+
+    // What's left of the previous frame must go out first, otherwise the
+    // other side would lose track of frame boundaries.
+    if ( !SendUnsent () )
+        return -1;
+
+    if ( mEncoder != NULL && ( n = mEncoder -> Encode ( msg, len, encoded ) ) > 0 )
+    {
+        payload = encoded;
+        size = n;
+    }
+
+    frame[ 0 ] = static_cast<char> ( ( size >> 8 ) & 0xFF );
+    frame[ 1 ] = static_cast<char> ( size & 0xFF );
+    memcpy ( frame + kFrameHeaderSize, payload, size );
+
+    if ( mDeflater != NULL )
+    {
+        // The frame goes out with the next flush, together with the ones
+        // that follow it by then.
+        if ( !mDeflater -> Deflate ( frame, size + kFrameHeaderSize, mDeflated, mFlushInterval == 0 ) )
+        {
+            Log::e () << "Couldn't compress a message for " << mHost << ":" << mRemotePort << ".";
+            return -1;
+        }
+
+        if ( mFlushInterval == 0 )
+        {
+            SendUnsent ();
+        }
+        else if ( !mDeflatePending )
+        {
+            mDeflatePending = true;
+            mDeflatePendingSince = std::chrono::high_resolution_clock::now ();
+        }
+    }
+    else
+    {
+        while ( sent < size + kFrameHeaderSize )
+        {
+            n = send ( mSockFd, frame + sent, size + kFrameHeaderSize - sent, SOCKET_SEND_FLAGS );
+
+            if ( n < 0 )
+            {
+                if ( errno == EINTR )
+                    continue;
+
+                if ( WouldBlock () && sent > 0 )
+                    break;
+
+                return -1;
+            }
+
+            sent += n;
+        }
+
+        // A non-blocking socket may take only part of the frame. Keep the
+        // rest; the frame counts as sent since nothing can come before it.
+        if ( sent < size + kFrameHeaderSize )
+        {
+            if ( mUnsent == NULL )
+                mUnsent = static_cast<char*> ( BufferPool::Allocate ( TCP_BUFFER_SIZE ) );
+
+            mUnsentLength = size + kFrameHeaderSize - sent;
+            memcpy ( mUnsent, frame + sent, mUnsentLength );
+        }
+    }
+
+    // The other end now has this update to decode the next ones against.
+    if ( mEncoder != NULL )
+        mEncoder -> Remember ( msg, len );
+
+    return len;
+}
+
+bool TCPSocket::SendUnsent ()
+{
+    size_t sent = 0;
+    long n;
+
+    while ( sent < mUnsentLength )
+    {
+        n = send ( mSockFd, mUnsent + sent, mUnsentLength - sent, SOCKET_SEND_FLAGS );
+
+        if ( n < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            // errno tells the caller whether the socket would block
+            // or the connection is lost.
+            break;
+        }
+
+        sent += n;
+    }
+
+    if ( mUnsentLength > 0 )
+    {
+        memmove ( mUnsent, mUnsent + sent, mUnsentLength - sent );
+        mUnsentLength -= sent;
+
+        if ( mUnsentLength > 0 )
+            return false;
+
+        // Peers that keep up never need it, so don't hold on to it.
+        BufferPool::Free ( mUnsent );
+        mUnsent = NULL;
+    }
+
+    // Compressed bytes come after the partially sent frame, if any.
+    sent = 0;
+
+    while ( sent < mDeflated.size () )
+    {
+        n = send ( mSockFd, mDeflated.data () + sent, mDeflated.size () - sent, SOCKET_SEND_FLAGS );
+
+        if ( n < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            break;
+        }
+
+        sent += n;
+    }
+
+    mDeflated.erase ( mDeflated.begin (), mDeflated.begin () + sent );
+
+    return mDeflated.empty ();
+}
+
+bool TCPSocket::FlushCompressed ()
+{
+    if ( mDeflatePending )
+    {
+        mDeflatePending = false;
+
+        if ( !mDeflater -> Deflate ( NULL, 0, mDeflated, true ) )
+            Log::e () << "Couldn't compress messages for " << mHost << ":" << mRemotePort << ".";
+    }
+
+    return SendUnsent ();
+}
+
+int TCPSocket::FlushTimeout () const
+{
+    long elapsed;
+
+    if ( !mDeflatePending )
+        return -1;
+
+    elapsed = std::chrono::duration_cast< std::chrono::milliseconds > ( std::chrono::high_resolution_clock::now () - mDeflatePendingSince ).count ();
+
+    return elapsed >= mFlushInterval ? 0 : static_cast<int> ( mFlushInterval - elapsed );
+}
+
+long TCPSocket::FrameSize () const
+{
+    if ( mRecvEnd - mRecvStart < kFrameHeaderSize )
+        return -1;
+
+    return ( static_cast<uint8_t> ( mRecvBuffer[ mRecvStart ] ) << 8 ) |
+             static_cast<uint8_t> ( mRecvBuffer[ mRecvStart + 1 ] );
+}
+
+bool TCPSocket::HasFrame () const
+{
+    long size = FrameSize ();
+
+    return size >= 0 && mRecvEnd - mRecvStart >= kFrameHeaderSize + size;
+}
+
+bool TCPSocket::HasPending () const
+{
+    return HasFrame () || ( mInflating && mInflater -> HasPending () );
+}
+
+long TCPSocket::Fill ()
+{
+    char compressed[ TCP_BUFFER_SIZE ];
+    long n;
+
+    if ( !mInflating )
+    {
+        n = recv ( mSockFd, mRecvBuffer + mRecvEnd, TCP_BUFFER_SIZE - mRecvEnd, SOCKET_READ_FLAGS );
+
+        if ( n > 0 )
+            mRecvEnd += n;
+
+        return n;
+    }
+
+    // Whatever zlib still holds comes before what's on the socket.
+    if ( !mInflater -> HasPending () )
+    {
+        n = recv ( mSockFd, compressed, TCP_BUFFER_SIZE, SOCKET_READ_FLAGS );
+
+        if ( n <= 0 )
+            return n;
+
+        mInflater -> Input ( compressed, n );
+    }
+
+    n = mInflater -> Inflate ( mRecvBuffer + mRecvEnd, TCP_BUFFER_SIZE - mRecvEnd );
+
+    if ( n < 0 )
+    {
+        Log::e () << "Corrupt compressed stream from " << mHost << ":" << mRemotePort << ".";
+        SetReadError ( false );
+        return -1;
+    }
+
+    if ( n == 0 )
+    {
+        // Not even one byte out of what we got. Wait for more.
+        SetReadError ( true );
+        return -1;
+    }
+
+    mRecvEnd += n;
+
+    return n;
+}
+
+void TCPSocket::StartInflating ()
 {
-    return send ( mSockFd, msg, len, 0 );
+    long n;
+
+    mInflating = true;
+
+    mInflater -> Input ( mRecvBuffer + mRecvStart, mRecvEnd - mRecvStart );
+    mRecvStart = mRecvEnd = 0;
+
+    // Decompress it right away, so that HasPending() tells the truth.
+    n = mInflater -> Inflate ( mRecvBuffer, TCP_BUFFER_SIZE );
+
+    if ( n > 0 )
+        mRecvEnd = n;
 }
 
 long TCPSocket::Read ( char *msg, const size_t len )
 {
-    return recv ( mSockFd, msg, len, 0 );
+    char decoded[ CarUpdateCodec::kCarUpdateSize ];
+    const char* payload;
+    long n, size;
+
+    if ( mRecvBuffer == NULL )
+        mRecvBuffer = static_cast<char*> ( BufferPool::Allocate ( TCP_BUFFER_SIZE ) );
+
+    if ( !HasFrame () )
+    {
+        // Move the incomplete frame to the front of the buffer
+        // to make room for the rest of it.
+        if ( mRecvStart > 0 )
+        {
+            memmove ( mRecvBuffer, mRecvBuffer + mRecvStart, mRecvEnd - mRecvStart );
+            mRecvEnd -= mRecvStart;
+            mRecvStart = 0;
+        }
+
+        n = Fill ();
+
+        if ( n <= 0 )
+            return n;
+
+        if ( !HasFrame () )
+        {
+            // A frame that can't fit in the buffer means the stream is
+            // corrupt and we'd never be able to find the next frame.
+            SetReadError ( FrameSize () <= static_cast<long> ( TCP_BUFFER_SIZE - kFrameHeaderSize ) );
+            return -1;
+        }
+    }
+
+    size = FrameSize ();
+    payload = mRecvBuffer + mRecvStart + kFrameHeaderSize;
+
+    mRecvStart += kFrameHeaderSize + size;
+
+    // The other end starts compressing right after this one. It's meant
+    // for us only, so go on with the next frame (if it's here already).
+    if ( mInflater != NULL && !mInflating && size > 0 && static_cast<int8_t> ( payload[ 0 ] ) == ACSProtocol::ACSR_COMPRESSION )
+    {
+        StartInflating ();
+        Log::v () << "Messages from " << mHost << ":" << mRemotePort << " are compressed from now on.";
+
+        if ( !HasFrame () )
+        {
+            SetReadError ( true );
+            return -1;
+        }
+
+        return Read ( msg, len );
+    }
+
+    if ( mDecoder != NULL && size > 0 )
+    {
+        if ( static_cast<int8_t> ( payload[ 0 ] ) == ACSProtocol::ACSR_CAR_UPDATE_DELTA )
+        {
+            size = mDecoder -> Decode ( payload, size, decoded );
+            payload = decoded;
+
+            // The two ends disagree on what was sent before. There's no
+            // way to recover from that, much like from a corrupt stream.
+            if ( size < 0 )
+            {
+                SetReadError ( false );
+                return -1;
+            }
+        }
+        else
+        {
+            mDecoder -> Remember ( payload, size );
+        }
+    }
+
+    // Like recvfrom() on a datagram socket, a message that doesn't
+    // fit the caller's buffer is truncated.
+    memcpy ( msg, payload, static_cast<size_t> ( size ) < len ? size : len );
+
+    if ( mRecvStart == mRecvEnd )
+        mRecvStart = mRecvEnd = 0;
+
+    return static_cast<size_t> ( size ) < len ? size : len;
+}
+
+void TCPSocket::EnableCarUpdateEncoding ()
+{
+    if ( mEncoder == NULL )
+        mEncoder = new CarUpdateCodec ();
+}
+
+void TCPSocket::EnableCarUpdateDecoding ()
+{
+    if ( mDecoder == NULL )
+        mDecoder = new CarUpdateCodec ();
+}
+
+
+bool TCPSocket::EnableCompression ( const unsigned int flush_interval )
+{
+    char compression = ACSProtocol::ACSR_COMPRESSION;
+    StreamCompression* deflater;
+
+    if ( mDeflater != NULL )
+        return true;
+
+    deflater = new StreamCompression ( StreamCompression::DEFLATE );
+
+    // The last frame the other end gets as it is.
+    if ( !deflater -> Valid () || Send ( &compression, 1 ) < 0 )
+    {
+        delete deflater;
+        return false;
+    }
+
+    mDeflater = deflater;
+    mFlushInterval = flush_interval;
+
+    return true;
+}
+
+bool TCPSocket::EnableDecompression ()
+{
+    if ( mInflater == NULL )
+        mInflater = new StreamCompression ( StreamCompression::INFLATE );
+
+    return mInflater -> Valid ();
 }
 
 int TCPSocket::Accept()
@@ -51,27 +447,16 @@ int TCPSocket::Accept()
     return retval;
 }
 
-void TCPSocket::SetBlocking( const bool blocking )
+void TCPSocket::SetNoDelay ()
 {
-#ifdef _WIN32
-    unsigned long block;
-    block = blocking ? 1 : 0;
-    ioctlsocket ( mSockFd, FIONBIO, &block );
-#else
-    int opts;
+    int flag = 1;
 
-    if ( blocking )
-    {
-        opts = fcntl (mSockFd, F_GETFL );
-        opts = opts & ( ~O_NONBLOCK );
-        fcntl ( mSockFd, F_SETFL, opts );
-    }
-    else
-        fcntl ( mSockFd, F_SETFL, O_NONBLOCK );
-#endif
+    // Every frame carries a complete ACSP message which should reach the
+    // other relay right away, not once Nagle's algorithm decides to send it.
+    setsockopt ( mSockFd, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*> ( &flag ), sizeof ( flag ) );
 }
 
-int TCPSocket::Connect( unsigned short timeout )
+int TCPSocket::Connect( unsigned short timeout, EventLoop* loop )
 {
     fd_set rd, wr;
     long status;
@@ -79,6 +464,21 @@ int TCPSocket::Connect( unsigned short timeout )
     char err;
     socklen_t len = sizeof ( int );
 
+#ifdef __linux__
+    // The loop waits for the connection itself, on a blocking socket.
+    if ( loop != NULL && loop -> Transmits () )
+    {
+        SetBlocking ( true );
+
+        if ( ( status = loop -> Connect ( mSockFd, reinterpret_cast<struct sockaddr*> ( &mCa ), sizeof ( mCa ), timeout * 1000 ) ) != 0 )
+            return static_cast<int> ( status );
+
+        SetNoDelay ();
+
+        return 0;
+    }
+#endif
+
     tv.tv_sec = timeout;
     tv.tv_usec = 0;
 
@@ -115,6 +515,7 @@ int TCPSocket::Connect( unsigned short timeout )
         // Make the socket blocking again...
 
         SetBlocking ( true );
+        SetNoDelay ();
 
         // And return from the function.
 
@@ -144,6 +545,14 @@ TCPSocket::TCPSocket ( const std::string host, const unsigned int remote_port )
     struct sockaddr_in sa;
 
     mIsConnected = false;
+    mRecvBuffer = mUnsent = NULL;
+    mRecvStart = mRecvEnd = 0;
+    mUnsentLength = 0;
+    mEncoder = mDecoder = NULL;
+    mDeflater = mInflater = NULL;
+    mFlushInterval = 0;
+    mDeflatePending = false;
+    mInflating = false;
 
     mHost = host;
     mLocalPort = 0;
@@ -174,6 +583,15 @@ TCPSocket::TCPSocket ( Type type, const unsigned int param )
 {
     struct sockaddr_in sa;
 
+    mRecvBuffer = mUnsent = NULL;
+    mRecvStart = mRecvEnd = 0;
+    mUnsentLength = 0;
+    mEncoder = mDecoder = NULL;
+    mDeflater = mInflater = NULL;
+    mFlushInterval = 0;
+    mDeflatePending = false;
+    mInflating = false;
+
     if ( type == FROM_FD )
     {
         mSockFd = param;
@@ -187,6 +605,8 @@ TCPSocket::TCPSocket ( Type type, const unsigned int param )
         {
             mIsConnected = true;
 
+            SetNoDelay ();
+
             mHost = inet_ntoa ( mCa.sin_addr );
             mRemotePort = ntohs ( mCa.sin_port );
 
@@ -229,4 +649,12 @@ TCPSocket::TCPSocket ( Type type, const unsigned int param )
 TCPSocket::~TCPSocket()
 {
     Close ();
+
+    BufferPool::Free ( mRecvBuffer );
+    BufferPool::Free ( mUnsent );
+
+    delete mEncoder;
+    delete mDecoder;
+    delete mDeflater;
+    delete mInflater;
 }
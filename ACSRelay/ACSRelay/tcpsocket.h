@@ -20,9 +20,17 @@
 #ifndef _tcpsocket_h
 #define _tcpsocket_h
 
+#include "carupdatecodec.h"
 #include "socket.h"
+#include "streamcompression.h"
 
-#define TCP_BUFFER_SIZE 1024
+#include <chrono>
+#include <stdint.h>
+#include <vector>
+
+#define TCP_BUFFER_SIZE 16384
+
+class EventLoop;
 
 /**
  * @class TCPSocket
@@ -30,6 +38,22 @@
  *        Subclass of the Socket virtual class.
  *        TCPSocket provides basic functionality for communication
  *        over a TCP socket.
+ *
+ *        Since TCP is a byte stream, every message is sent as a frame
+ *        made of a 16 bit length (network byte order) followed by
+ *        the message itself. Incoming bytes are gathered in a
+ *        reassembly buffer, so one recv() may yield several messages
+ *        and incomplete ones are carried over to the next read.
+ *
+ *        The reassembly buffer and the one holding a partially sent frame
+ *        come from the BufferPool, and only when they're first needed.
+ *
+ *        Links between relays may delta-encode ACSP_CAR_UPDATE packets
+ *        (see CarUpdateCodec). Read() hands them back decoded.
+ *
+ *        They may also compress the whole stream (see StreamCompression).
+ *        The relay that compresses sends an ACSR_COMPRESSION frame first;
+ *        every byte after it is part of the compressed stream.
  */
 class TCPSocket : public Socket
 {
@@ -63,19 +87,81 @@ public:
     TCPSocket ( const std::string host, const unsigned int remote_port );
     virtual ~TCPSocket();
     /**
-     * @brief Send bytes through the socket.
+     * @brief Send a framed message through the socket.
+     *        If a non-blocking socket accepts only part of the frame, the
+     *        rest is kept and sent by SendUnsent() before any other frame.
      * @param msg Array containing bytes.
      * @param len Number of bytes in the array.
-     * @return -1 on error, otherwise the number of sent bytes.
+     * @return -1 on error or if the socket would block (see Socket::WouldBlock),
+     *         otherwise the number of sent bytes.
+     */
+    long Send ( const char* msg, const size_t len );
+    /**
+     * @brief Tries to send what's left of a partially sent frame.
+     * @return True if nothing is left to send.
+     */
+    bool SendUnsent ();
+    /**
+     * @brief Checks if part of a frame is still waiting to be sent.
+     * @return True if SendUnsent() has something to send.
      */
-    long Send ( const char* msg, const size_t len ) const;
+    bool HasUnsent () const { return mUnsentLength > 0 || !mDeflated.empty (); }
     /**
-     * @brief Read bytes from the socket (if any available).
-     * @param msg Pointer to a byte array to hold the incoming data.
+     * @brief Read one message from the socket (if any available).
+     *        If the reassembly buffer doesn't hold a complete message,
+     *        as much data as possible is read from the socket first.
+     * @param msg Pointer to a byte array to hold the incoming message.
      * @param len Maximum number of bytes to read.
-     * @return -1 on error, otherwise the number of read bytes.
+     * @return 0 if the connection was closed, -1 on error or if no complete
+     *         message is available yet (see Socket::WouldBlock), otherwise
+     *         the size of the message.
      */
     long Read ( char *msg, const size_t len );
+    /**
+     * @brief Checks if the reassembly buffer holds a complete message.
+     * @return True if the next Read() won't need to touch the network.
+     */
+    bool HasPending () const;
+    /**
+     * @brief Delta-encodes the ACSP_CAR_UPDATE packets sent from now on.
+     *        Only for links whose other end asked for it with ACSR_CAR_UPDATE_CODEC.
+     */
+    void EnableCarUpdateEncoding ();
+    /**
+     * @brief Decodes the ACSR_CAR_UPDATE_DELTA packets read from now on.
+     *        Must be called before the other end is asked to encode them.
+     */
+    void EnableCarUpdateDecoding ();
+    /**
+     * @brief Compresses every frame sent from now on, after telling the
+     *        other end with an ACSR_COMPRESSION frame. Only for links whose
+     *        other end asked for it with ACSR_COMPRESSION.
+     * @param flush_interval Milliseconds compressed frames may wait for the
+     *        ones that follow, 0 to send every frame right away.
+     * @return False if compression isn't available, or the other end couldn't be told.
+     */
+    bool EnableCompression ( const unsigned int flush_interval );
+    /**
+     * @brief Gets ready to decompress everything after the ACSR_COMPRESSION
+     *        frame. Must be called before the other end is asked to compress.
+     * @return False if compression isn't available.
+     */
+    bool EnableDecompression ();
+    /**
+     * @brief Sends the frames compressed since the last flush.
+     * @return True if nothing is left to send.
+     */
+    bool FlushCompressed ();
+    /**
+     * @brief Computes how long compressed frames may still wait to be sent.
+     * @return Milliseconds until FlushCompressed() is due, or -1 if nothing is waiting.
+     */
+    int FlushTimeout () const;
+    /**
+     * @brief Retrieves the compressed stream in the direction the link uses it.
+     * @return Pointer to the StreamCompression, or NULL if the link isn't compressed.
+     */
+    const StreamCompression* Compression () const { return mDeflater != NULL ? mDeflater : mInflating ? mInflater : NULL; }
     /**
      * @brief Wrapper around the standard accept() C function.
      * @return Same values as accept()
@@ -84,9 +170,10 @@ public:
     /**
      * @brief Wrapper around the standard connect() C function.
      * @param timeout Number of seconds after which the connection will timeout.
+     * @param loop Event loop to connect through, if it does the I/O itself.
      * @return Negative value on error, 0 on successful connection.
      */
-    int Connect ( unsigned short timeout );
+    int Connect ( unsigned short timeout, EventLoop* loop = NULL );
     /**
      * @brief Closes the TCP socket.
      */
@@ -99,17 +186,63 @@ private:
     /**
      * @brief TCPSocket object constructor.
      */
-    TCPSocket () {}
+    TCPSocket () : mRecvBuffer ( NULL ), mUnsent ( NULL ), mEncoder ( NULL ), mDecoder ( NULL ), mDeflater ( NULL ), mInflater ( NULL ) {}
 
     // METHODS
 
-    void SetBlocking ( const bool blocking );
+    /**
+     * @brief Size of the frame at the start of the reassembly buffer.
+     * @return Payload size, or -1 if the header hasn't been received yet.
+     */
+    long FrameSize () const;
+    /**
+     * @brief Checks if the reassembly buffer holds a complete frame.
+     * @return True if it does.
+     */
+    bool HasFrame () const;
+    /**
+     * @brief Adds incoming bytes to the reassembly buffer, decompressing
+     *        them if needed.
+     * @return Same values as recv(), 0 meaning the connection was closed.
+     */
+    long Fill ();
+    /**
+     * @brief Switches to decompressing the incoming bytes, starting with
+     *        those already in the reassembly buffer.
+     */
+    void StartInflating ();
+    /**
+     * @brief Disables Nagle's algorithm on the connected socket.
+     */
+    void SetNoDelay ();
     
     // VARS
     
     /**
      */
     int8_t mIsConnected;
+
+    char* mRecvBuffer;
+    size_t mRecvStart;
+    size_t mRecvEnd;
+
+    char* mUnsent;
+    size_t mUnsentLength;
+
+    CarUpdateCodec* mEncoder;
+    CarUpdateCodec* mDecoder;
+
+    // Compressed bytes not sent yet go after the partially sent frame.
+    StreamCompression* mDeflater;
+    std::vector< char > mDeflated;
+    unsigned int mFlushInterval;
+    bool mDeflatePending;
+    std::chrono::high_resolution_clock::time_point mDeflatePendingSince;
+
+    StreamCompression* mInflater;
+    bool mInflating;
+
+    const static size_t kFrameHeaderSize = 2;
 };
 
 #endif // _tcpsocket_h
@@ -17,29 +17,54 @@
  along with ACSRelay.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "eventloop.h"
 #include "log.h"
 #include "udpsocket.h"
 
 #include <iostream>
 #include <string.h>
+#include <unistd.h>
 
 #ifdef _WIN32
     #include <ws2tcpip.h>
 #endif
 
-long  UDPSocket::Send ( const char* msg, const size_t len ) const
+long  UDPSocket::Send ( const char* msg, const size_t len )
 {
-    return sendto ( mSockFd, msg, len, 0, reinterpret_cast<const struct sockaddr*>( &mCa ), sizeof ( mCa ) );
+    return sendto ( mSockFd, msg, len, SOCKET_SEND_FLAGS, reinterpret_cast<const struct sockaddr*>( &mCa ), sizeof ( mCa ) );
 }
 
 long UDPSocket::Read ( char *msg, const size_t len )
 {
     socklen_t l = sizeof ( mCa );
+    struct sockaddr_in from;
+    // Whoever sends to a multicast socket is just one of the group's
+    // members. Keep sending to the group.
+    struct sockaddr_in* sender = mMulticast ? &from : &mCa;
     long n;
 
-    n = recvfrom( mSockFd, msg, len, 0, reinterpret_cast<struct sockaddr*>( &mCa ), &l );
+#ifdef __linux__
+    if ( mReceiving )
+    {
+        struct mmsghdr header;
+        struct iovec vector;
+
+        vector.iov_base = msg;
+        vector.iov_len = len;
+
+        memset ( &header, 0, sizeof ( header ) );
+        header.msg_hdr.msg_iov = &vector;
+        header.msg_hdr.msg_iovlen = 1;
+        header.msg_hdr.msg_name = sender;
+        header.msg_hdr.msg_namelen = l;
+
+        n = mLoop -> Receive ( mSockFd, &header, 1 ) < 1 ? -1 : static_cast<long> ( header.msg_len );
+    }
+    else
+#endif
+    n = recvfrom( mSockFd, msg, len, SOCKET_READ_FLAGS, reinterpret_cast<struct sockaddr*>( sender ), &l );
 
-    if ( n >= 1 )
+    if ( n >= 1 && !mMulticast )
     {
         mRemotePort = ntohs ( mCa.sin_port );
     }
@@ -47,26 +72,237 @@ long UDPSocket::Read ( char *msg, const size_t len )
     return n;
 }
 
-UDPSocket::UDPSocket ( const std::string host, const unsigned int local_port, const unsigned int remote_port )
+bool UDPSocket::Attach ( EventLoop* loop, void* data )
 {
-    struct sockaddr_in sa;
+    mLoop = loop;
 
-    mHost = host;
-    mLocalPort = local_port;
-    mRemotePort = remote_port;
+#ifdef __linux__
+    mReceiving = loop -> Receives ();
+    mTransmitting = loop -> Transmits ();
 
-    memset ( &sa, 0, sizeof ( mCa ) );
-    sa.sin_family = AF_INET;
-    sa.sin_addr.s_addr = htonl ( INADDR_ANY );
-    sa.sin_port = htons ( mLocalPort );
+    if ( mReceiving )
+        return loop -> AddReceiver ( mSockFd, data );
+#endif
 
-    mSockFd = socket ( AF_INET, SOCK_DGRAM, 0 );
+    return loop -> Add ( mSockFd, data );
+}
 
-    if ( bind ( mSockFd, reinterpret_cast<const struct sockaddr*>( &sa ), sizeof ( sa ) ) < 0 )
+bool UDPSocket::SetMulticast ( const unsigned int ttl, const std::string iface )
+{
+    struct in_addr addr;
+    int hops = static_cast<int> ( ttl );
+
+    if ( !IN_MULTICAST ( ntohl ( mCa.sin_addr.s_addr ) ) )
+        return false;
+
+    if ( setsockopt ( mSockFd, IPPROTO_IP, IP_MULTICAST_TTL, reinterpret_cast<const char*> ( &hops ), sizeof ( hops ) ) < 0 )
     {
-        Log::e() << "Failed to bind UDP socket for host " << mHost << ":" << mLocalPort;
+        Log::w () << "Failed to set the TTL of datagrams sent to multicast group " << mHost << ".";
+    }
+
+    if ( iface != "" )
+    {
+        if ( inet_pton ( AF_INET, iface.c_str (), &addr ) != 1 ||
+             setsockopt ( mSockFd, IPPROTO_IP, IP_MULTICAST_IF, reinterpret_cast<const char*> ( &addr ), sizeof ( addr ) ) < 0 )
+        {
+            Log::w () << "Failed to send to multicast group " << mHost << " from interface " << iface << ". Letting the system pick one.";
+        }
+    }
+
+    mMulticast = true;
+
+    return true;
+}
+
+void UDPSocket::SetBatchSize ( const unsigned int size )
+{
+    for ( auto p = mBatchPackets.begin (); p != mBatchPackets.end (); ++p )
+    {
+        ( *p ) -> Release ();
     }
 
+    mBatchSize = size < 1 ? 1 : size;
+    mBatchPackets.resize ( mBatchSize );
+
+    for ( unsigned int i = 0; i < mBatchSize; i++ )
+    {
+        mBatchPackets[ i ] = PacketBuffer::Acquire ();
+    }
+
+#ifdef __linux__
+    mBatchHeaders.assign ( mBatchSize, mmsghdr () );
+    mBatchVectors.assign ( mBatchSize, iovec () );
+    mBatchAddresses.assign ( mBatchSize, sockaddr_in () );
+
+    for ( unsigned int i = 0; i < mBatchSize; i++ )
+    {
+        mBatchVectors[ i ].iov_base = mBatchPackets[ i ] -> Data ();
+        mBatchVectors[ i ].iov_len = mBatchPackets[ i ] -> Capacity ();
+
+        mBatchHeaders[ i ].msg_hdr.msg_iov = &mBatchVectors[ i ];
+        mBatchHeaders[ i ].msg_hdr.msg_iovlen = 1;
+        mBatchHeaders[ i ].msg_hdr.msg_name = &mBatchAddresses[ i ];
+    }
+#endif
+}
+
+int UDPSocket::ReadBatch ()
+{
+    int n;
+
+    // Datagrams from the previous batch that are still waiting to be sent
+    // somewhere keep their buffers. Read into fresh ones instead.
+    for ( unsigned int i = 0; i < mBatchSize; i++ )
+    {
+        if ( mBatchPackets[ i ] -> Shared () )
+        {
+            mBatchPackets[ i ] -> Release ();
+            mBatchPackets[ i ] = PacketBuffer::Acquire ();
+#ifdef __linux__
+            mBatchVectors[ i ].iov_base = mBatchPackets[ i ] -> Data ();
+#endif
+        }
+    }
+
+#ifdef __linux__
+    for ( unsigned int i = 0; i < mBatchSize; i++ )
+    {
+        // The kernel overwrites these on every call.
+        mBatchHeaders[ i ].msg_hdr.msg_namelen = sizeof ( struct sockaddr_in );
+        mBatchHeaders[ i ].msg_hdr.msg_controllen = 0;
+        mBatchHeaders[ i ].msg_hdr.msg_flags = 0;
+    }
+
+    if ( mReceiving )
+        n = mLoop -> Receive ( mSockFd, mBatchHeaders.data (), mBatchSize );
+    else
+        n = recvmmsg ( mSockFd, mBatchHeaders.data (), mBatchSize, MSG_DONTWAIT, NULL );
+
+    if ( n < 1 )
+        return n;
+
+    for ( int i = 0; i < n; i++ )
+    {
+        mBatchPackets[ i ] -> SetLength ( mBatchHeaders[ i ].msg_len );
+    }
+
+    // Behave like Read(): remember who sent us the (last) datagram.
+    mCa = mBatchAddresses[ n - 1 ];
+    mRemotePort = ntohs ( mCa.sin_port );
+#else
+    // Without recvmmsg() we can't tell how many datagrams are waiting
+    // without risking to block, so settle for just one.
+    mBatchPackets[ 0 ] -> SetLength ( Read ( mBatchPackets[ 0 ] -> Data (), mBatchPackets[ 0 ] -> Capacity () ) );
+
+    n = mBatchPackets[ 0 ] -> Length () < 0 ? -1 : 1;
+#endif
+
+    return n;
+}
+
+long UDPSocket::Queue ( const char* msg, const size_t len )
+{
+    unsigned int sent;
+
+    // Make room if the queue is full. Datagrams must still leave
+    // in the order they were queued.
+    if ( mQueued == UDP_SEND_QUEUE_SIZE )
+    {
+        sent = Flush ();
+
+        if ( sent < mQueued )
+        {
+            // The socket would block. Keep only what couldn't be sent and
+            // tell the caller, who is responsible for keeping the rest
+            // (including this datagram) for later.
+            for ( unsigned int i = sent; i < mQueued; i++ )
+            {
+#ifdef __linux__
+                mSendVectors[ i - sent ] = mSendVectors[ i ];
+                mSendHeaders[ i - sent ] = mSendHeaders[ i ];
+                mSendHeaders[ i - sent ].msg_hdr.msg_iov = &mSendVectors[ i - sent ];
+#else
+                mSendMessages[ i - sent ] = mSendMessages[ i ];
+                mSendLengths[ i - sent ] = mSendLengths[ i ];
+#endif
+            }
+
+            mQueued -= sent;
+            SetWouldBlock ();
+            return -1;
+        }
+
+        mQueued = 0;
+    }
+
+#ifdef __linux__
+    mSendVectors[ mQueued ].iov_base = const_cast<char*> ( msg );
+    mSendVectors[ mQueued ].iov_len = len;
+
+    memset ( &mSendHeaders[ mQueued ], 0, sizeof ( struct mmsghdr ) );
+    mSendHeaders[ mQueued ].msg_hdr.msg_iov = &mSendVectors[ mQueued ];
+    mSendHeaders[ mQueued ].msg_hdr.msg_iovlen = 1;
+    mSendHeaders[ mQueued ].msg_hdr.msg_name = &mCa;
+    mSendHeaders[ mQueued ].msg_hdr.msg_namelen = sizeof ( mCa );
+#else
+    mSendMessages[ mQueued ] = msg;
+    mSendLengths[ mQueued ] = len;
+#endif
+
+    mQueued++;
+
+    return len;
+}
+
+unsigned int UDPSocket::Flush ()
+{
+    unsigned int sent = 0;
+    int n;
+
+    while ( sent < mQueued )
+    {
+#ifdef __linux__
+        if ( mTransmitting )
+            n = mLoop -> Transmit ( mSockFd, mSendHeaders + sent, mQueued - sent, SOCKET_SEND_FLAGS );
+        else
+            n = sendmmsg ( mSockFd, mSendHeaders + sent, mQueued - sent, SOCKET_SEND_FLAGS );
+#else
+        n = Send ( mSendMessages[ sent ], mSendLengths[ sent ] ) < 0 ? -1 : 1;
+#endif
+
+        if ( n < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            if ( WouldBlock () )
+                break;
+
+            // Drop the datagram that couldn't be sent, just like a failed
+            // Send() would, and carry on with the rest.
+            n = 1;
+        }
+
+        sent += n;
+    }
+
+    return sent;
+}
+
+UDPSocket::UDPSocket ( const std::string host, const unsigned int local_port, const unsigned int remote_port, const bool reuse_port )
+{
+    mHost = host;
+    mLocalPort = local_port;
+    mRemotePort = remote_port;
+    mMulticast = false;
+    mLoop = NULL;
+    mReceiving = false;
+    mTransmitting = false;
+    mBatchSize = 0;
+    mQueued = 0;
+
+    Bind ( reuse_port );
+
     // Now save host and port information in mCa
     // to be used when sending packets to the client plugin.
 
@@ -76,24 +312,68 @@ UDPSocket::UDPSocket ( const std::string host, const unsigned int local_port, co
     mCa.sin_port = htons ( mRemotePort );
 }
 
-UDPSocket::UDPSocket ( const unsigned int local_port )
+UDPSocket::UDPSocket ( const unsigned int local_port, const bool reuse_port )
 {
-    struct sockaddr_in sa;
     mLocalPort = local_port;
     mHost = "127.0.0.1";
+    mMulticast = false;
+    mLoop = NULL;
+    mReceiving = false;
+    mTransmitting = false;
+    mBatchSize = 0;
+    mQueued = 0;
+
+    Bind ( reuse_port );
 
-    memset ( &sa, 0, sizeof ( mCa ) );
+    memset ( &mCa, 0, sizeof ( mCa ) );
+    mCa.sin_addr.s_addr = INADDR_NONE;
+}
+
+void UDPSocket::Bind ( const bool reuse_port )
+{
+    struct sockaddr_in sa;
+
+    memset ( &sa, 0, sizeof ( sa ) );
     sa.sin_family = AF_INET;
     sa.sin_addr.s_addr = htonl ( INADDR_ANY );
-    sa.sin_port = htons( mLocalPort );
+    sa.sin_port = htons ( mLocalPort );
 
     mSockFd = socket ( AF_INET, SOCK_DGRAM, 0 );
 
+    // Every socket sharing the port must ask for it before binding.
+    if ( reuse_port )
+    {
+#ifdef SO_REUSEPORT
+        int flag = 1;
+
+        if ( setsockopt ( mSockFd, SOL_SOCKET, SO_REUSEPORT, reinterpret_cast<const char*> ( &flag ), sizeof ( flag ) ) < 0 )
+#endif
+        {
+            Log::w () << "Failed to share UDP port " << mLocalPort << " with other sockets.";
+        }
+    }
+
     if ( bind ( mSockFd, reinterpret_cast<const struct sockaddr*>( &sa ), sizeof ( sa ) ) < 0 )
     {
         Log::e() << "Failed to bind UDP socket for host " << mHost << ":" << mLocalPort;
     }
+}
 
-    memset ( &mCa, 0, sizeof ( mCa ) );
-    mCa.sin_addr.s_addr = INADDR_NONE;
+bool UDPSocket::CanReusePort ()
+{
+#ifdef SO_REUSEPORT
+    return true;
+#else
+    return false;
+#endif
+}
+
+UDPSocket::~UDPSocket ()
+{
+    for ( auto p = mBatchPackets.begin (); p != mBatchPackets.end (); ++p )
+    {
+        ( *p ) -> Release ();
+    }
+
+    close ( mSockFd );
 }
@@ -21,8 +21,17 @@
 #define _udpsocket_h
 
 #include "socket.h"
+#include "packetbuffer.h"
 
-#define UDP_BUFFER_SIZE 1024
+#include <vector>
+
+#ifdef __linux__
+    #include <sys/socket.h>
+#endif
+
+#define UDP_SEND_QUEUE_SIZE 64
+
+class EventLoop;
 
 /**
  * @class UDPSocket
@@ -41,24 +50,28 @@ public:
     /**
      * @brief UDPSocket object constructor
      * @param local_port Port on which to listen as a long integer.
+     * @param reuse_port True to share the port with other sockets that
+     *        ask for it too. The system spreads incoming datagrams between
+     *        them, always handing those from the same sender to the same socket.
      */
-    UDPSocket ( const unsigned int local_port );
+    UDPSocket ( const unsigned int local_port, const bool reuse_port = false );
     /**
      * @brief UDPSocket object constructor
      * @param host Hostname of the UDP correspondent.
      * @param local_port Port on which to listen as a long integer.
      * @param remote_port Port on which to send as a long integer.
+     * @param reuse_port True to share the local port with other sockets that ask for it too.
      */
-    UDPSocket ( const std::string host, const unsigned int local_port, const unsigned int remote_port );
+    UDPSocket ( const std::string host, const unsigned int local_port, const unsigned int remote_port, const bool reuse_port = false );
     
-    virtual ~UDPSocket() {}
+    virtual ~UDPSocket();
     /**
      * @brief Send bytes through the socket.
      * @param msg Array containing bytes.
      * @param len Number of bytes in the array.
      * @return -1 on error, otherwise the number of sent bytes.
      */
-    long Send ( const char* msg, const size_t len ) const;
+    long Send ( const char* msg, const size_t len );
     /**
      * @brief Read bytes from the socket (if any available).
      * @param msg Pointer to a byte array to hold the incoming data.
@@ -66,6 +79,90 @@ public:
      * @return -1 on error, otherwise the number of read bytes.
      */
     long Read ( char *msg, const size_t len );
+    /**
+     * @brief Sends to a multicast group, if that's what the correspondent is,
+     *        so that a single datagram reaches every plugin that joined it.
+     * @param ttl Number of routers the datagrams may cross. 1 keeps them on the LAN.
+     * @param iface Address of the local interface to send from, empty to let the system pick.
+     * @return True if the correspondent is a multicast group.
+     */
+    bool SetMulticast ( const unsigned int ttl, const std::string iface );
+    /**
+     * @brief Checks if the socket sends to a multicast group.
+     * @return True if SetMulticast() succeeded.
+     */
+    bool Multicast () const { return mMulticast; }
+    /**
+     * @brief Every plugin that joined the multicast group gets every datagram.
+     * @return True if the socket sends to a multicast group.
+     */
+    bool HasManyReaders () const { return mMulticast; }
+    /**
+     * @brief Checks if sockets can share their local port.
+     * @return True if the platform supports it.
+     */
+    static bool CanReusePort ();
+    /**
+     * @brief Registers the socket with an event loop. Loops that do the
+     *        I/O themselves are then used to receive and send datagrams.
+     * @param loop Event loop. It must outlive the socket.
+     * @param data Pointer handed back by the loop when datagrams are waiting.
+     * @return False if the socket couldn't be registered.
+     */
+    bool Attach ( EventLoop* loop, void* data );
+    /**
+     * @brief Sets the maximum number of datagrams read by a single ReadBatch() call.
+     *        The buffers that will hold the datagrams are acquired here.
+     *        ReadBatch() only replaces the ones somebody else kept.
+     * @param size Number of datagrams. Values lower than 1 are treated as 1.
+     */
+    void SetBatchSize ( const unsigned int size );
+    /**
+     * @brief Retrieves the maximum number of datagrams read by ReadBatch().
+     * @return Batch size as an unsigned integer.
+     */
+    unsigned int BatchSize () const { return mBatchSize; }
+    /**
+     * @brief Reads as many datagrams as are available, up to the batch size.
+     *        On Linux this takes a single recvmmsg() call, unless the
+     *        socket is attached to a loop that receives. The datagrams
+     *        can then be retrieved with BatchPacket().
+     * @return -1 on error, otherwise the number of read datagrams.
+     */
+    int ReadBatch ();
+    /**
+     * @brief Retrieves a datagram read by the last ReadBatch() call.
+     *        The socket keeps its reference to the buffer. Retain() it to
+     *        keep the datagram after the next ReadBatch() call.
+     * @param i Index of the datagram in the batch.
+     * @return Pointer to the buffer holding the datagram.
+     */
+    PacketBuffer* BatchPacket ( const unsigned int i ) { return mBatchPackets[ i ]; }
+    /**
+     * @brief Queue a datagram to be sent by the next Flush() call.
+     *        The datagram is not copied, so the same bytes can be queued on
+     *        many sockets. They must stay valid until Flush() is called.
+     * @param msg Array containing bytes.
+     * @param len Number of bytes in the array.
+     * @return Number of queued bytes.
+     */
+    long Queue ( const char* msg, const size_t len );
+    /**
+     * @brief Sends the queued datagrams until the socket would block.
+     *        On Linux this usually takes a single sendmmsg() call, or
+     *        hands them to the loop the socket is attached to.
+     * @return Index of the first datagram that couldn't be sent.
+     */
+    unsigned int Flush ();
+    /**
+     * @brief Retrieves the number of queued datagrams.
+     * @return Number of datagrams.
+     */
+    unsigned int Queued () const { return mQueued; }
+    /**
+     * @brief Forgets every queued datagram.
+     */
+    void ClearQueue () { mQueued = 0; }
     
 private:
     
@@ -75,6 +172,38 @@ private:
      * @brief UDPSocket object constructor.
      */
     UDPSocket () {}
+
+    // METHODS
+
+    /**
+     * @brief Creates the socket and binds it to the local port.
+     * @param reuse_port True to share the port with other sockets.
+     */
+    void Bind ( const bool reuse_port );
+
+    // VARS
+
+    bool mMulticast;
+    EventLoop* mLoop;
+    // The loop receives and sends the datagrams, see Attach().
+    bool mReceiving;
+    bool mTransmitting;
+    unsigned int mBatchSize;
+    std::vector< PacketBuffer* > mBatchPackets;
+#ifdef __linux__
+    std::vector< struct mmsghdr > mBatchHeaders;
+    std::vector< struct iovec > mBatchVectors;
+    std::vector< struct sockaddr_in > mBatchAddresses;
+#endif
+
+    unsigned int mQueued;
+#ifdef __linux__
+    struct mmsghdr mSendHeaders[ UDP_SEND_QUEUE_SIZE ];
+    struct iovec mSendVectors[ UDP_SEND_QUEUE_SIZE ];
+#else
+    const char* mSendMessages[ UDP_SEND_QUEUE_SIZE ];
+    size_t mSendLengths[ UDP_SEND_QUEUE_SIZE ];
+#endif
 };
 
 #endif // _udpsocket_h